@@ -0,0 +1,119 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sd.h"
+
+/*
+ * Packet compression.
+ *
+ * A small encoder for the LZ4 block format, so any LZ4 library can unpack
+ * what we send.  It's the greedy single-probe variant: one hash lookup
+ * per position and no lazy matching, which keeps it cheap enough for the
+ * board while still catching the repeated headers, idle cycles and
+ * control bits that make up most of a capture.  Blocks are never more
+ * than a packet, so the whole window fits in 16-bit offsets.
+ */
+
+#define LZ4_MIN_MATCH		4
+#define LZ4_LAST_LITERALS	5	/* A block always ends in this many literals */
+#define LZ4_MF_LIMIT		12	/* No match may start this close to the end */
+#define LZ4_HASH_BITS		10
+#define LZ4_MAX_OFFSET		65535
+
+static uint32_t lz4_read32(const uint8_t *p) {
+	uint32_t val;
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+static uint32_t lz4_hash(uint32_t seq) {
+	return (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Lengths of 15 and up spill into extra bytes of 255 */
+static uint8_t *lz4_put_length(uint8_t *op, uint32_t len) {
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static uint8_t *lz4_put_sequence(uint8_t *op, const uint8_t *lit,
+				 uint32_t lit_len, uint32_t offset,
+				 uint32_t match_len) {
+	uint8_t *token = op++;
+
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		op = lz4_put_length(op, lit_len - 15);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	/* The last sequence is literals alone */
+	if (!match_len)
+		return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	match_len -= LZ4_MIN_MATCH;
+	*token |= match_len < 15 ? match_len : 15;
+	if (match_len >= 15)
+		op = lz4_put_length(op, match_len - 15);
+	return op;
+}
+
+/* Worst case for a sequence carrying lit_len literals */
+static uint32_t lz4_sequence_bound(uint32_t lit_len) {
+	return 1 + lit_len / 255 + 1 + lit_len + 2 + 1;
+}
+
+/*
+ * Compress len bytes of src into dst as one LZ4 block.  Returns the block
+ * size, or 0 if it wouldn't fit in cap, meaning the data is better sent
+ * as it is.
+ */
+int compress_block(const uint8_t *src, int len, uint8_t *dst, int cap) {
+	uint16_t table[1 << LZ4_HASH_BITS];
+	uint8_t *op = dst, *end = dst + cap;
+	int ip = 0, anchor = 0;
+	int limit = len - LZ4_MF_LIMIT;
+	int match_limit = len - LZ4_LAST_LITERALS;
+
+	if (len > 0xffff)
+		return 0;
+	memset(table, 0, sizeof(table));
+
+	while (ip < limit) {
+		uint32_t seq = lz4_read32(src + ip);
+		uint32_t h = lz4_hash(seq);
+		int ref = table[h];
+		int match_len;
+
+		table[h] = ip;
+		if (ref >= ip || ip - ref > LZ4_MAX_OFFSET
+		 || lz4_read32(src + ref) != seq) {
+			/* Stride further the longer nothing has matched */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		match_len = LZ4_MIN_MATCH;
+		while (ip + match_len < match_limit
+		    && src[ref + match_len] == src[ip + match_len])
+			match_len++;
+
+		if (op + lz4_sequence_bound(ip - anchor) + match_len / 255 > end)
+			return 0;
+		op = lz4_put_sequence(op, src + anchor, ip - anchor,
+				      ip - ref, match_len);
+		ip += match_len;
+		anchor = ip;
+	}
+
+	if (op + lz4_sequence_bound(len - anchor) > end)
+		return 0;
+	op = lz4_put_sequence(op, src + anchor, len - anchor, 0, 0);
+	return op - dst;
+}
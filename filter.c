@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "sd.h"
+
+/*
+ * Capture filter.
+ *
+ * Filters are written as small predicates over the decoded sample fields,
+ * and compiled into postfix bytecode that runs against a bit stack.  The
+ * grammar is:
+ *
+ *   expr  := term { ("or" | "||") term }
+ *   term  := unary { ("and" | "&&") unary }
+ *   unary := ("not" | "!") unary | "(" expr ")" | test
+ *   test  := field [ "&" value ] op value
+ *          | field [ "&" value ] "in" value ".." value
+ *   op    := "==" | "=" | "!=" | "<" | "<=" | ">" | ">="
+ *
+ * Fields are type, data, ctrl, aux, sdcmd, sdarg and time (extended FPGA
+ * ticks).  Values are numbers, or one of the names nand, sd_cmd, sd_resp,
+ * ale, cle, we, re and cs.  For example:
+ *
+ *   type == nand and ctrl & cs == 0 and data in 0x60..0x70
+ *   sdcmd == 24 or time in 130000000..260000000
+ *
+ * Samples that don't match are dropped before they reach the decoders.
+ * Since a decoder needs every cycle of an operation to rebuild it, a
+ * filter can't be installed while "nd" or "sn" is decoding, and neither
+ * can be turned on under a filter or an armed trigger.  Either way the
+ * command is refused with FILTER_ERR_DECODING.
+ */
+
+struct filter_name {
+	const char	*name;
+	uint64_t	value;
+};
+
+static const struct filter_name filter_fields[] = {
+	{"type",  FILTER_FIELD_TYPE},
+	{"data",  FILTER_FIELD_DATA},
+	{"ctrl",  FILTER_FIELD_CTRL},
+	{"aux",   FILTER_FIELD_AUX},
+	{"sdcmd", FILTER_FIELD_SDCMD},
+	{"sdarg", FILTER_FIELD_SDARG},
+	{"time",  FILTER_FIELD_TIME},
+	{NULL, 0},
+};
+
+static const struct filter_name filter_constants[] = {
+	{"nand",    PKT_NAND},
+	{"sd_cmd",  PKT_SD_CMD},
+	{"sd_resp", PKT_SD_RESPONSE},
+	{"ale",     NAND_ALE},
+	{"cle",     NAND_CLE},
+	{"we",      NAND_WE},
+	{"re",      NAND_RE},
+	{"cs",      NAND_CS},
+	{NULL, 0},
+};
+
+struct filter_parser {
+	const char	*p;
+	const char	*error;
+	struct filter	*f;
+	int		depth;
+};
+
+static void skip_space(struct filter_parser *ps) {
+	while (isspace((unsigned char)*ps->p))
+		ps->p++;
+}
+
+/* Accept a symbol, e.g. "&&" or "(" */
+static int accept_sym(struct filter_parser *ps, const char *sym) {
+	skip_space(ps);
+	if (strncmp(ps->p, sym, strlen(sym)))
+		return 0;
+	ps->p += strlen(sym);
+	return 1;
+}
+
+/* Accept a keyword, e.g. "and", but not the start of "android" */
+static int accept_word(struct filter_parser *ps, const char *word) {
+	int len = strlen(word);
+	skip_space(ps);
+	if (strncmp(ps->p, word, len))
+		return 0;
+	if (isalnum((unsigned char)ps->p[len]) || ps->p[len] == '_')
+		return 0;
+	ps->p += len;
+	return 1;
+}
+
+static int lookup_name(struct filter_parser *ps,
+		       const struct filter_name *names, uint64_t *value) {
+	for (; names->name; names++) {
+		if (accept_word(ps, names->name)) {
+			*value = names->value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int parse_value(struct filter_parser *ps, uint64_t *value) {
+	char *end;
+
+	skip_space(ps);
+	if (!lookup_name(ps, filter_constants, value))
+		return 0;
+
+	if (!isdigit((unsigned char)*ps->p)) {
+		ps->error = "Expected a number";
+		return -1;
+	}
+	*value = strtoull(ps->p, &end, 0);
+	ps->p = end;
+	return 0;
+}
+
+static int emit(struct filter_parser *ps, struct filter_insn *insn) {
+	if (ps->f->len >= FILTER_MAX_INSNS) {
+		ps->error = "Filter too long";
+		return -1;
+	}
+
+	if (insn->op == FILTER_OP_TEST)
+		ps->depth++;
+	else if (insn->op != FILTER_OP_NOT)
+		ps->depth--;
+	if (ps->depth > FILTER_MAX_DEPTH) {
+		ps->error = "Filter nested too deeply";
+		return -1;
+	}
+
+	ps->f->insn[ps->f->len++] = *insn;
+	return 0;
+}
+
+static int emit_op(struct filter_parser *ps, int op) {
+	struct filter_insn insn;
+	memset(&insn, 0, sizeof(insn));
+	insn.op = op;
+	return emit(ps, &insn);
+}
+
+static int parse_expr(struct filter_parser *ps);
+
+static int parse_test(struct filter_parser *ps) {
+	struct filter_insn insn;
+	uint64_t field, v;
+
+	memset(&insn, 0, sizeof(insn));
+	insn.op = FILTER_OP_TEST;
+	insn.mask = ~0ULL;
+
+	if (lookup_name(ps, filter_fields, &field)) {
+		ps->error = "Expected a field name";
+		return -1;
+	}
+	insn.field = field;
+
+	if (!accept_sym(ps, "&&") && accept_sym(ps, "&")) {
+		if (parse_value(ps, &insn.mask))
+			return -1;
+	}
+
+	if (accept_word(ps, "in")) {
+		if (parse_value(ps, &insn.lo))
+			return -1;
+		if (!accept_sym(ps, "..")) {
+			ps->error = "Expected '..'";
+			return -1;
+		}
+		if (parse_value(ps, &insn.hi))
+			return -1;
+	}
+	else if (accept_sym(ps, "==") || accept_sym(ps, "=")) {
+		if (parse_value(ps, &v))
+			return -1;
+		insn.lo = insn.hi = v;
+	}
+	else if (accept_sym(ps, "!=")) {
+		if (parse_value(ps, &v))
+			return -1;
+		insn.lo = insn.hi = v;
+		insn.negate = 1;
+	}
+	else if (accept_sym(ps, "<=")) {
+		if (parse_value(ps, &v))
+			return -1;
+		insn.lo = 0;
+		insn.hi = v;
+	}
+	else if (accept_sym(ps, ">=")) {
+		if (parse_value(ps, &v))
+			return -1;
+		insn.lo = v;
+		insn.hi = ~0ULL;
+	}
+	else if (accept_sym(ps, "<")) {
+		if (parse_value(ps, &v))
+			return -1;
+		insn.lo = 0;
+		insn.hi = v - 1;
+		if (v == 0) {
+			insn.lo = 1; /* Never matches */
+			insn.hi = 0;
+		}
+	}
+	else if (accept_sym(ps, ">")) {
+		if (parse_value(ps, &v))
+			return -1;
+		insn.lo = v + 1;
+		insn.hi = ~0ULL;
+		if (v == ~0ULL) {
+			insn.lo = 1; /* Never matches */
+			insn.hi = 0;
+		}
+	}
+	else {
+		ps->error = "Expected a comparison";
+		return -1;
+	}
+
+	return emit(ps, &insn);
+}
+
+static int parse_unary(struct filter_parser *ps) {
+	if (accept_word(ps, "not")
+	 || (!accept_sym(ps, "!=") && accept_sym(ps, "!"))) {
+		if (parse_unary(ps))
+			return -1;
+		return emit_op(ps, FILTER_OP_NOT);
+	}
+
+	if (accept_sym(ps, "(")) {
+		if (parse_expr(ps))
+			return -1;
+		if (!accept_sym(ps, ")")) {
+			ps->error = "Expected ')'";
+			return -1;
+		}
+		return 0;
+	}
+
+	return parse_test(ps);
+}
+
+static int parse_term(struct filter_parser *ps) {
+	if (parse_unary(ps))
+		return -1;
+	while (accept_word(ps, "and") || accept_sym(ps, "&&")) {
+		if (parse_unary(ps))
+			return -1;
+		if (emit_op(ps, FILTER_OP_AND))
+			return -1;
+	}
+	return 0;
+}
+
+static int parse_expr(struct filter_parser *ps) {
+	if (parse_term(ps))
+		return -1;
+	while (accept_word(ps, "or") || accept_sym(ps, "||")) {
+		if (parse_term(ps))
+			return -1;
+		if (emit_op(ps, FILTER_OP_OR))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Compile text into f.  An empty string compiles to an empty filter,
+ * which matches everything.  On error, returns the offset of the problem
+ * and points error at a description.
+ */
+int filter_compile(struct filter *f, const char *text, const char **error) {
+	struct filter_parser ps;
+
+	memset(&ps, 0, sizeof(ps));
+	ps.p = text;
+	ps.f = f;
+	f->len = 0;
+
+	skip_space(&ps);
+	if (*ps.p == '\0')
+		return 0;
+
+	if (!parse_expr(&ps)) {
+		skip_space(&ps);
+		if (*ps.p == '\0')
+			return 0;
+		ps.error = "Unexpected text after filter";
+	}
+
+	*error = ps.error;
+	f->len = 0;
+	return (ps.p - text) + 1;
+}
+
+void filter_track(struct filter_state *st, struct fpga_sample *sample) {
+	if (sample->type == PKT_SD_CMD) {
+		uint64_t val = SD_SAMPLE_VALUE(sample);
+		if (sample->data == 0) {
+			st->sdcmd = val & 0x3f;
+			st->sdarg = 0;
+		}
+		else if (sample->data <= 4) {
+			int shift = (4 - sample->data) * 8;
+			st->sdarg &= ~(0xffULL << shift);
+			st->sdarg |= val << shift;
+		}
+	}
+}
+
+int filter_match(struct filter *f, struct filter_state *st,
+		 struct fpga_sample *sample) {
+	uint64_t fields[FILTER_FIELD_COUNT];
+	uint32_t stack = 0;
+	int i;
+
+	if (!f->len)
+		return 1;
+
+	fields[FILTER_FIELD_TYPE] = sample->type;
+	fields[FILTER_FIELD_DATA] = sample->data;
+	fields[FILTER_FIELD_CTRL] = sample->ctrl;
+	fields[FILTER_FIELD_AUX] = sample->aux;
+	fields[FILTER_FIELD_TIME] = ((uint64_t)sample->wraps << 32) | sample->counter;
+	if (sample->type == PKT_NAND) {
+		fields[FILTER_FIELD_SDCMD] = FILTER_NONE;
+		fields[FILTER_FIELD_SDARG] = FILTER_NONE;
+	}
+	else {
+		fields[FILTER_FIELD_SDCMD] = st->sdcmd;
+		fields[FILTER_FIELD_SDARG] = st->sdarg;
+	}
+
+	for (i=0; i<f->len; i++) {
+		struct filter_insn *insn = &f->insn[i];
+		uint32_t r;
+
+		switch (insn->op) {
+		case FILTER_OP_TEST: {
+			uint64_t v = fields[insn->field] & insn->mask;
+			r = (v >= insn->lo && v <= insn->hi) ^ insn->negate;
+			stack = (stack << 1) | r;
+			break;
+		}
+		case FILTER_OP_AND:
+			r = stack & (stack >> 1) & 1;
+			stack = ((stack >> 2) << 1) | r;
+			break;
+		case FILTER_OP_OR:
+			r = (stack | (stack >> 1)) & 1;
+			stack = ((stack >> 2) << 1) | r;
+			break;
+		case FILTER_OP_NOT:
+			stack ^= 1;
+			break;
+		}
+	}
+
+	return stack & 1;
+}
+
+/* Could any value in the bitmap pass this test? */
+static int filter_test_bitmap(struct filter_insn *insn, uint64_t bitmap,
+			      int none) {
+	int i;
+
+	if (none) {
+		uint64_t v = FILTER_NONE & insn->mask;
+		if ((v >= insn->lo && v <= insn->hi) ^ insn->negate)
+			return 1;
+	}
+	for (i=0; i<64; i++) {
+		uint64_t v;
+		if (!(bitmap & (1ULL << i)))
+			continue;
+		v = i & insn->mask;
+		if ((v >= insn->lo && v <= insn->hi) ^ insn->negate)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Run the filter over an index block summary instead of a sample.  Returns
+ * 0 only if no sample in the block can match, so the block can be skipped
+ * without reading it.  Anything the summary doesn't cover counts as a
+ * possible match, and so does "not", since the summary can't say that
+ * every sample passes the test underneath it.
+ */
+int filter_may_match(struct filter *f, struct record_block *blk) {
+	uint32_t stack = 0;
+	int i;
+
+	if (!f->len)
+		return 1;
+
+	for (i=0; i<f->len; i++) {
+		struct filter_insn *insn = &f->insn[i];
+		uint32_t r;
+
+		switch (insn->op) {
+		case FILTER_OP_TEST:
+			if (insn->field == FILTER_FIELD_TYPE)
+				r = filter_test_bitmap(insn, blk->types, 0);
+			else if (insn->field == FILTER_FIELD_SDCMD)
+				r = filter_test_bitmap(insn, blk->sdcmds,
+					(blk->types & (1 << PKT_NAND))
+					|| (blk->flags & RECORD_BLOCK_SDCMD_NONE));
+			else if (insn->field == FILTER_FIELD_TIME
+			      && insn->mask == ~0ULL && !insn->negate)
+				r = insn->lo <= blk->max_time
+				 && insn->hi >= blk->min_time;
+			else if (insn->field == FILTER_FIELD_TIME
+			      && insn->mask == ~0ULL)
+				r = !(insn->lo <= blk->min_time
+				   && insn->hi >= blk->max_time);
+			else
+				r = 1;
+			stack = (stack << 1) | r;
+			break;
+		case FILTER_OP_AND:
+			r = stack & (stack >> 1) & 1;
+			stack = ((stack >> 2) << 1) | r;
+			break;
+		case FILTER_OP_OR:
+			r = (stack | (stack >> 1)) & 1;
+			stack = ((stack >> 2) << 1) | r;
+			break;
+		case FILTER_OP_NOT:
+			stack |= 1;
+			break;
+		}
+	}
+
+	return stack & 1;
+}
+
+/* Run a sample through the installed filter, returning 1 to keep it */
+int filter_sample(struct sd *sd, struct fpga_sample *sample) {
+	filter_track(&sd->filter_state, sample);
+	if (filter_match(&sd->filter, &sd->filter_state, sample)) {
+		sd->filter_passed++;
+		return 1;
+	}
+	if (sample->type <= PKT_SD_RESPONSE)
+		sd->filter_dropped[sample->type]++;
+	return 0;
+}
+
+/* Whether a filter or trigger may go in, complaining if not */
+int filter_allowed(struct sd *sd) {
+	if (sd->nand_mode == DECODE_RAW && sd->sdsniff_mode == DECODE_RAW)
+		return 1;
+	pkt_send_error(sd, MAKE_ERROR(SUBSYS_FILTER, FILTER_ERR_DECODING, 0),
+		       "Can't filter or trigger while decoding");
+	return 0;
+}
+
+/* Whether a decoder may be turned on, complaining if not */
+int filter_decode_allowed(struct sd *sd) {
+	if (!sd->filter.len && sd->trigger_mode == TRIGGER_OFF)
+		return 1;
+	pkt_send_error(sd, MAKE_ERROR(SUBSYS_FILTER, FILTER_ERR_DECODING, 1),
+		       "Can't decode while filtering or triggering");
+	return 0;
+}
+
+static int filter_install(struct sd *sd, int arg) {
+	struct filter f;
+	const char *error;
+	int ret;
+
+	if (!filter_allowed(sd))
+		return -1;
+
+	ret = filter_compile(&f, sd->cmd_str, &error);
+	if (ret) {
+		char errmsg[512];
+		int offset = ret - 1;
+		snprintf(errmsg, sizeof(errmsg)-1,
+			 "Filter error at offset %d: %s", offset, error);
+		pkt_send_error(sd,
+			MAKE_ERROR(SUBSYS_FILTER, FILTER_ERR_SYNTAX, offset),
+			errmsg);
+		return -1;
+	}
+
+	pthread_mutex_lock(&sd->fpga_pipeline_lock);
+	memcpy(&sd->filter, &f, sizeof(f));
+	sd->filter_passed = 0;
+	memset(sd->filter_dropped, 0, sizeof(sd->filter_dropped));
+	pthread_mutex_unlock(&sd->fpga_pipeline_lock);
+	return 0;
+}
+
+static int filter_clear(struct sd *sd, int arg) {
+	pthread_mutex_lock(&sd->fpga_pipeline_lock);
+	sd->filter.len = 0;
+	pthread_mutex_unlock(&sd->fpga_pipeline_lock);
+	return 0;
+}
+
+static int filter_stats(struct sd *sd, int arg) {
+	pkt_send_filter_stats(sd);
+	return 0;
+}
+
+int filter_init(struct sd *sd) {
+	sd->filter.len = 0;
+	sd->filter_state.sdcmd = FILTER_NONE;
+	sd->filter_state.sdarg = FILTER_NONE;
+	parse_set_hook(sd, "fi", filter_install);
+	parse_set_hook(sd, "fc", filter_clear);
+	parse_set_hook(sd, "fs", filter_stats);
+	return 0;
+}
@@ -0,0 +1,400 @@
+#define _POSIX_C_SOURCE 20121221L
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sd.h"
+#include "gpio.h"
+
+/*
+ * Software model of the capture FPGA, standing in for both the GPIO and
+ * the I2C layers (build with "make USE_SIM=1").
+ *
+ * A producer thread pushes synthetic NAND and SD traffic into a virtual
+ * FIFO, and the pins and registers fpga.c uses are answered from it:
+ * DATA_READY while the FIFO isn't empty, DATA_OVERFLOW after a sample was
+ * lost, the clock overflow pin toggling each time the 32-bit counter
+ * wraps, the pause register (2), the ignore-blocks register (0x10) and
+ * the FIFO count register (0x1c).  The environment sets it up:
+ *
+ *   SPI_SIM_RATE   samples per second (default 100000)
+ *   SPI_SIM_BURST  samples produced back to back in each burst (default 1)
+ *   SPI_SIM_DEPTH  FIFO depth in samples (default 8192)
+ *
+ * Once a second, the producer prints how many samples were made, read out
+ * and lost, and the deepest the FIFO got, to find the highest rate a given
+ * drain strategy can keep up with.
+ */
+
+/* Pins as wired up in fpga.c and main.c */
+static const int sim_data_pins[] = {
+	45, 44, 42, 41, 40, 68, 38, 37, 63, 64, 65, 66, 67, 69, 70, 71,
+};
+#define SIM_BANK_PIN_0 57
+#define SIM_BANK_PIN_1 56
+#define SIM_DATA_READY_PIN 61
+#define SIM_CLOCK_OVERFLOW_PIN 72
+#define SIM_GET_NEW_SAMPLE_PIN 54
+#define SIM_DATA_OVERFLOW_PIN 60
+#define SIM_CLOCK_RESET_PIN 59
+#define SIM_MAX_PIN 128
+
+#define SIM_DEFAULT_RATE 100000
+#define SIM_DEFAULT_BURST 1
+#define SIM_DEFAULT_DEPTH 8192
+
+struct sim_step {
+	uint8_t		type;
+	uint8_t		data;
+	uint8_t		ctrl;
+};
+
+/*
+ * The traffic played in a loop: a NAND page read (command, five address
+ * cycles, confirm, four data bytes, then the chip deselected) and an SD
+ * CMD17 with its R1 response.  The decoder acts on rising WE and RE, so
+ * each NAND cycle takes two steps, the strobe low and then high.
+ */
+static const struct sim_step sim_script[] = {
+	{PKT_NAND, 0x00, NAND_CLE},
+	{PKT_NAND, 0x00, NAND_CLE | NAND_WE},
+	{PKT_NAND, 0x00, NAND_ALE},
+	{PKT_NAND, 0x00, NAND_ALE | NAND_WE},
+	{PKT_NAND, 0x00, NAND_ALE},
+	{PKT_NAND, 0x00, NAND_ALE | NAND_WE},
+	{PKT_NAND, 0x40, NAND_ALE},
+	{PKT_NAND, 0x40, NAND_ALE | NAND_WE},
+	{PKT_NAND, 0x01, NAND_ALE},
+	{PKT_NAND, 0x01, NAND_ALE | NAND_WE},
+	{PKT_NAND, 0x00, NAND_ALE},
+	{PKT_NAND, 0x00, NAND_ALE | NAND_WE},
+	{PKT_NAND, 0x30, NAND_CLE},
+	{PKT_NAND, 0x30, NAND_CLE | NAND_WE},
+	{PKT_NAND, 0xde, 0},
+	{PKT_NAND, 0xde, NAND_RE},
+	{PKT_NAND, 0xad, 0},
+	{PKT_NAND, 0xad, NAND_RE},
+	{PKT_NAND, 0xbe, 0},
+	{PKT_NAND, 0xbe, NAND_RE},
+	{PKT_NAND, 0xef, 0},
+	{PKT_NAND, 0xef, NAND_RE},
+	{PKT_NAND, 0x00, NAND_CS},
+	{PKT_SD_CMD, 0, 17},
+	{PKT_SD_CMD, 1, 0x00},
+	{PKT_SD_CMD, 2, 0x00},
+	{PKT_SD_CMD, 3, 0x08},
+	{PKT_SD_CMD, 4, 0x00},
+	{PKT_SD_RESPONSE, 0x00, 0},
+};
+
+static struct {
+	pthread_mutex_t	lock;
+	pthread_t	thread;
+	int		started;
+
+	uint32_t	rate, burst, depth;
+	uint8_t		(*fifo)[8];
+	uint32_t	head, count;
+	int		overflow;
+	int		paused;
+	uint32_t	ignore;
+	uint32_t	step;
+
+	struct timespec	epoch;		/* When the FPGA counter was zero */
+	uint32_t	wraps;
+	int		clock_pin;
+	int		pins[SIM_MAX_PIN];
+	uint8_t		latch[8];	/* Sample on the data pins */
+
+	int		ready_pipe[2];
+	int		clock_pipe[2];
+
+	uint64_t	produced, read, lost, ignored;
+	uint32_t	max_fill;
+} sim;
+
+static uint32_t sim_env(const char *name, uint32_t def) {
+	const char *val = getenv(name);
+	if (!val || !*val || !strtoul(val, NULL, 0))
+		return def;
+	return strtoul(val, NULL, 0);
+}
+
+/* Extended FPGA ticks since the counter was last reset */
+static uint64_t sim_ticks(void) {
+	struct timespec now;
+	uint64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - sim.epoch.tv_sec) * 1000000000ULL
+	   + now.tv_nsec - sim.epoch.tv_nsec;
+	return ns / 1000000000ULL * FPGA_FREQUENCY
+	     + ns % 1000000000ULL * FPGA_FREQUENCY / 1000000000ULL;
+}
+
+static void sim_signal(int fd) {
+	char c = 0;
+	if (write(fd, &c, 1) == -1) {
+		/* Pipe full means an edge is already pending */
+	}
+}
+
+/* Lay a sample out the way the FPGA does, see fpga_unpack_sample() */
+static void sim_pack(uint8_t *pkt, uint32_t counter,
+		     const struct sim_step *step) {
+	uint8_t ctrl = step->ctrl & 0x3f;
+	uint16_t aux = 0;
+
+	/* SD register values carry their top two bits in aux */
+	if (step->type == PKT_SD_CMD)
+		aux = step->ctrl >> 6;
+
+	memcpy(pkt, &counter, sizeof(counter));
+	pkt[4] = step->type | ((step->data & 0x0f) << 4);
+	pkt[5] = (step->data >> 4) | ((ctrl & 0x0f) << 4);
+	pkt[6] = (ctrl >> 4) | ((aux & 0x3f) << 2);
+	pkt[7] = (aux >> 6) & 0x0f;
+}
+
+/* Called with the lock held */
+static void sim_produce(uint64_t ticks) {
+	const struct sim_step *step;
+	uint32_t tail;
+
+	step = &sim_script[sim.step];
+	sim.step = (sim.step + 1) % (sizeof(sim_script) / sizeof(*sim_script));
+	sim.produced++;
+
+	if (sim.paused)
+		return;
+	if (sim.ignore) {
+		sim.ignore--;
+		sim.ignored++;
+		return;
+	}
+	if (sim.count >= sim.depth) {
+		sim.overflow = 1;
+		sim.lost++;
+		return;
+	}
+
+	tail = (sim.head + sim.count) % sim.depth;
+	sim_pack(sim.fifo[tail], ticks, step);
+	if (!sim.count++)
+		sim_signal(sim.ready_pipe[1]);
+	if (sim.count > sim.max_fill)
+		sim.max_fill = sim.count;
+}
+
+static void *sim_thread(void *arg) {
+	struct timespec next, report;
+	uint64_t interval, last_produced = 0, last_read = 0;
+
+	interval = sim.burst * 1000000000ULL / sim.rate;
+	if (!interval)
+		interval = 1;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	report = next;
+
+	while (1) {
+		uint64_t ticks;
+		uint32_t i;
+
+		next.tv_nsec += interval % 1000000000ULL;
+		next.tv_sec += interval / 1000000000ULL + next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		pthread_mutex_lock(&sim.lock);
+		ticks = sim_ticks();
+		for (i=0; i<sim.burst; i++)
+			sim_produce(ticks + i);
+
+		if ((uint32_t)(ticks >> 32) != sim.wraps) {
+			sim.wraps = ticks >> 32;
+			sim.clock_pin = !sim.clock_pin;
+			sim_signal(sim.clock_pipe[1]);
+		}
+
+		if (next.tv_sec > report.tv_sec) {
+			report = next;
+			fprintf(stderr, "sim: made %llu/s, read %llu/s, "
+				"lost %llu, max FIFO %u/%u\n",
+				(unsigned long long)(sim.produced - last_produced),
+				(unsigned long long)(sim.read - last_read),
+				(unsigned long long)sim.lost,
+				sim.max_fill, sim.depth);
+			last_produced = sim.produced;
+			last_read = sim.read;
+			sim.max_fill = sim.count;
+		}
+		pthread_mutex_unlock(&sim.lock);
+	}
+	return NULL;
+}
+
+static int sim_start(void) {
+	if (sim.started)
+		return 0;
+	sim.started = 1;
+
+	sim.rate = sim_env("SPI_SIM_RATE", SIM_DEFAULT_RATE);
+	sim.burst = sim_env("SPI_SIM_BURST", SIM_DEFAULT_BURST);
+	sim.depth = sim_env("SPI_SIM_DEPTH", SIM_DEFAULT_DEPTH);
+	sim.fifo = malloc(sim.depth * sizeof(*sim.fifo));
+	if (!sim.fifo) {
+		perror("Couldn't allocate simulated FIFO");
+		return -1;
+	}
+
+	if (pipe(sim.ready_pipe) || pipe(sim.clock_pipe)) {
+		perror("Couldn't create simulated edge pipes");
+		return -1;
+	}
+	fcntl(sim.ready_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(sim.ready_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(sim.clock_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(sim.clock_pipe[1], F_SETFL, O_NONBLOCK);
+
+	pthread_mutex_init(&sim.lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &sim.epoch);
+
+	fprintf(stderr, "sim: %u samples/s in bursts of %u, FIFO of %u\n",
+		sim.rate, sim.burst, sim.depth);
+	return pthread_create(&sim.thread, NULL, sim_thread, NULL);
+}
+
+
+int gpio_export(int gpio) {
+	return sim_start();
+}
+
+int gpio_unexport(int gpio) {
+	return 0;
+}
+
+int gpio_set_direction(int gpio, int is_output) {
+	return 0;
+}
+
+int gpio_set_edge(int gpio, int edge) {
+	return 0;
+}
+
+int gpio_open_edge(int gpio) {
+	if (sim_start())
+		return -1;
+	if (gpio == SIM_DATA_READY_PIN)
+		return sim.ready_pipe[0];
+	if (gpio == SIM_CLOCK_OVERFLOW_PIN)
+		return sim.clock_pipe[0];
+	return -1;
+}
+
+int gpio_set_value(int gpio, int value) {
+	if (gpio < 0 || gpio >= SIM_MAX_PIN)
+		return -1;
+
+	pthread_mutex_lock(&sim.lock);
+	value = !!value;
+
+	/* Any change on the sample pin moves the next sample onto the pins */
+	if (gpio == SIM_GET_NEW_SAMPLE_PIN && value != sim.pins[gpio]
+	 && sim.count) {
+		memcpy(sim.latch, sim.fifo[sim.head], sizeof(sim.latch));
+		sim.head = (sim.head + 1) % sim.depth;
+		sim.count--;
+		sim.read++;
+		if (!sim.count)
+			sim.overflow = 0;
+	}
+
+	/* Releasing the clock reset starts the counter from zero */
+	if (gpio == SIM_CLOCK_RESET_PIN && sim.pins[gpio] && !value) {
+		clock_gettime(CLOCK_MONOTONIC, &sim.epoch);
+		sim.wraps = 0;
+	}
+
+	sim.pins[gpio] = value;
+	pthread_mutex_unlock(&sim.lock);
+	return 0;
+}
+
+int gpio_get_value(int gpio) {
+	int bank, i, value;
+
+	if (gpio < 0 || gpio >= SIM_MAX_PIN)
+		return -1;
+
+	pthread_mutex_lock(&sim.lock);
+	if (gpio == SIM_DATA_READY_PIN)
+		value = sim.count > 0;
+	else if (gpio == SIM_DATA_OVERFLOW_PIN)
+		value = sim.overflow;
+	else if (gpio == SIM_CLOCK_OVERFLOW_PIN)
+		value = sim.clock_pin;
+	else {
+		value = sim.pins[gpio];
+		bank = sim.pins[SIM_BANK_PIN_0] | (sim.pins[SIM_BANK_PIN_1] << 1);
+		for (i=0; i<sizeof(sim_data_pins)/sizeof(*sim_data_pins); i++) {
+			if (sim_data_pins[i] != gpio)
+				continue;
+			value = (sim.latch[bank*2 + i/8] >> (i%8)) & 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sim.lock);
+	return value;
+}
+
+
+int i2c_init(struct sd *sd) {
+	sd->i2c_fpga_fd = -1;
+	return sim_start();
+}
+
+int i2c_set_buffer(struct sd *sd, uint8_t addr, uint8_t count, void *buf) {
+	uint8_t *bytes = buf;
+
+	pthread_mutex_lock(&sim.lock);
+	if (addr == 2 && count >= 1)
+		sim.paused = bytes[0];
+	else if (addr == 0x10 && count >= 4) {
+		uint32_t ignore;
+		memcpy(&ignore, bytes, sizeof(ignore));
+		sim.ignore = ntohl(ignore);
+	}
+	pthread_mutex_unlock(&sim.lock);
+	return 0;
+}
+
+int i2c_set_byte(struct sd *sd, uint8_t addr, uint8_t value) {
+	return i2c_set_buffer(sd, addr, 1, &value);
+}
+
+int i2c_get_buffer(struct sd *sd, uint8_t addr, uint8_t count, void *buf) {
+	memset(buf, 0, count);
+
+	pthread_mutex_lock(&sim.lock);
+	if (addr == 0x1c && count >= 2) {
+		uint16_t fill = htons(sim.count > 0xffff ? 0xffff : sim.count);
+		memcpy(buf, &fill, sizeof(fill));
+	}
+	else if (addr == 2 && count >= 1)
+		((uint8_t *)buf)[0] = sim.paused;
+	pthread_mutex_unlock(&sim.lock);
+	return 0;
+}
+
+int i2c_get_byte(struct sd *sd, uint8_t addr) {
+	uint8_t value;
+	i2c_get_buffer(sd, addr, 1, &value);
+	return value;
+}
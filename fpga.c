@@ -11,15 +11,17 @@
 #include <poll.h>
 #include <time.h>
 
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(__ARM_BIG_ENDIAN)
+#define FPGA_UNPACK_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define FPGA_UNPACK_SSE2
+#include <emmintrin.h>
+#endif
+
 #include "sd.h"
 #include "gpio.h"
 
-enum fpga_pkt_type {
-	PKT_NAND = 0,
-	PKT_SD_CMD = 1,
-	PKT_SD_RESPONSE = 2,
-};
-
 static int data_pins[] = {
 	45, // CAM_D[0]
 	44, // CAM_D[1]
@@ -46,13 +48,37 @@ static int bank_select_pins[] = {
 
 #define DATA_READY_PIN 61
 #define CLOCK_OVERFLOW_PIN 72
-#define GPIO_PATH "/sys/class/gpio"
 #define GET_NEW_SAMPLE_PIN 54
 #define DATA_OVERFLOW_PIN 60
 
 // When we drain the FPGA, store this many packets max
 #define MAX_PACKETS 1000000
 
+// Samples the FPGA's FIFO holds
+#define FIFO_DEPTH 8192
+
+// Default level to start draining at, and the smallest burst
+#define DRAIN_WATERMARK (FIFO_DEPTH / 8)
+#define DRAIN_MIN_BURST 256
+
+// Never leave a sample in the FIFO longer than this (ms)
+#define DRAIN_MAX_DELAY 10
+
+// Longest a command waits for the capture to catch up with it (ms)
+#define DRAIN_SYNC_TIMEOUT (DRAIN_MAX_DELAY * 10)
+
+// How long the bus stays quiet before the decoders send what they have (ms)
+#define DRAIN_QUIET_FLUSH (DRAIN_MAX_DELAY * 10)
+
+
+static int set_drain_watermark(struct sd *sd, int arg) {
+	if (arg < 1)
+		arg = 1;
+	if (arg > FIFO_DEPTH)
+		arg = FIFO_DEPTH;
+	sd->fpga_drain_watermark = arg;
+	return 0;
+}
 
 static int set_ignore_blocks(struct sd *sd, int arg) {
 	sd->fpga_ignore_blocks = htonl(arg);
@@ -62,15 +88,14 @@ static int set_ignore_blocks(struct sd *sd, int arg) {
 }
 
 int fpga_init(struct sd *sd) {
+	pthread_condattr_t attr;
 	int i;
-	char str[256];
 
 	/* Grab the "data ready pin", and open it so we can poll() */
 	gpio_export(DATA_READY_PIN);
 	gpio_set_direction(DATA_READY_PIN, GPIO_IN);
 	gpio_set_edge(DATA_READY_PIN, GPIO_EDGE_BOTH);
-	snprintf(str, sizeof(str)-1, "%s/gpio%d/value", GPIO_PATH, DATA_READY_PIN);
-	sd->fpga_ready_fd = open(str, O_RDONLY | O_NONBLOCK);
+	sd->fpga_ready_fd = gpio_open_edge(DATA_READY_PIN);
 	if (sd->fpga_ready_fd == -1)
 		return -1;
 
@@ -78,8 +103,7 @@ int fpga_init(struct sd *sd) {
 	gpio_export(sd->fpga_overflow_pin);
 	gpio_set_direction(sd->fpga_overflow_pin, GPIO_IN);
 	gpio_set_edge(sd->fpga_overflow_pin, GPIO_EDGE_BOTH);
-	snprintf(str, sizeof(str)-1, "%s/gpio%d/value", GPIO_PATH, sd->fpga_overflow_pin);
-	sd->fpga_overflow_fd = open(str, O_RDONLY | O_NONBLOCK);
+	sd->fpga_overflow_fd = gpio_open_edge(sd->fpga_overflow_pin);
 	if (sd->fpga_overflow_fd == -1)
 		return -1;
 	sd->fpga_overflow_pin_value = gpio_get_value(sd->fpga_overflow_pin);
@@ -102,9 +126,33 @@ int fpga_init(struct sd *sd) {
 		gpio_set_value(bank_select_pins[i], 0);
 	}
 
-	pthread_mutex_init(&sd->fpga_overflow_mutex, NULL);
-	
 	parse_set_hook(sd, "ib", set_ignore_blocks);
+	parse_set_hook(sd, "fw", set_drain_watermark);
+
+	sd->fpga_drain_watermark = DRAIN_WATERMARK;
+	sd->fpga_drain_burst = DRAIN_MIN_BURST;
+	sd->fpga_headroom = FIFO_DEPTH;
+
+	pthread_mutex_init(&sd->fpga_drain_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sd->fpga_drain_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return fpga_pipeline_init(sd);
+}
+
+/* Everything between raw samples and packets, which needs no hardware */
+int fpga_pipeline_init(struct sd *sd) {
+	pthread_mutex_init(&sd->fpga_pipeline_lock, NULL);
+	fpga_reset_ticks(sd);
+	timebase_init(sd);
+	telemetry_init(sd);
+
+	nand_init(sd);
+	sdsniff_init(sd);
+	filter_init(sd);
+	trigger_init(sd);
 
 	return 0;
 }
@@ -156,6 +204,7 @@ int fpga_get_new_sample(struct sd *st, uint8_t bytes[8]) {
 	}
 
 	if (!memcmp(last_data, bytes, sizeof(last_data))) {
+		telemetry_self->duplicates++;
 		fprintf(stderr, "Got duplicate packet - %d in a row\n", ++repeat_count);
 		return fpga_get_new_sample(st, bytes);
 	}
@@ -169,52 +218,307 @@ int fpga_data_avail(struct sd *st) {
 }
 
 
-static int fpga_send_packet(struct sd *sd, uint8_t *pkt) {
-	uint8_t pkt_type;
-	uint32_t fpga_counter;
-	memcpy(&fpga_counter, pkt, sizeof(fpga_counter));
-	pkt_type = pkt[4] & 0x0f;
+/*
+ * The low nibble of byte 4 is the sample type, and the remaining bits are
+ * laid out identically for every type, so pull them all apart at once.
+ */
+void fpga_unpack_sample(uint8_t *pkt, uint32_t wraps,
+			struct fpga_sample *sample) {
+	memcpy(&sample->counter, pkt, sizeof(sample->counter));
+	sample->wraps = wraps;
+	sample->type = pkt[4] & 0x0f;
+	sample->data = ((pkt[4] & 0xf0) >> 4) | ((pkt[5] & 0x0f) << 4);
+	sample->ctrl = ((pkt[5] & 0xf0) >> 4) | ((pkt[6] & 0x03) << 4);
+	sample->aux  = ((pkt[6] & 0xfc) >> 2) | ((pkt[7] & 0x0f) << 6);
+}
+
+
+/* Hand a sample that made it through the filter and trigger to the decoders */
+int fpga_emit_sample(struct sd *sd, struct fpga_sample *sample) {
+	if (sample->type == PKT_NAND && sd->nand_mode != DECODE_RAW) {
+		nand_decode_sample(sd, sample);
+		if (sd->nand_mode == DECODE_RECORDS)
+			return 0;
+	}
+
+	if (sample->type != PKT_NAND && sd->sdsniff_mode != DECODE_RAW) {
+		sdsniff_decode_sample(sd, sample);
+		if (sd->sdsniff_mode == DECODE_RECORDS)
+			return 0;
+	}
+
+	return fpga_send_sample(sd, &sd->pkt_batch, sample);
+}
+
+
+/* Send a sample as-is, batched if the client asked for it */
+int fpga_send_sample(struct sd *sd, struct pkt_batch *batch,
+		     struct fpga_sample *sample) {
+	telemetry_self->samples_sent++;
+	if (sd->pkt_features & PKT_FEATURE_BATCH)
+		return pkt_batch_add(sd, batch, sample);
 
-	if (pkt_type == PKT_NAND) {
-		uint8_t data;
-		uint8_t ctrl;
+	if (sample->type == PKT_NAND) {
 		uint8_t unknown[2];
-		data = ((pkt[4] & 0xf0) >> 4) | ((pkt[5] & 0x0f) << 4);
-		ctrl = ((pkt[5] & 0xf0) >> 4) | ((pkt[6] & 0x03) << 4);
-		unknown[0] = ((pkt[6] & 0xfc) >> 2) | ((pkt[7] & 0x03) << 6);
-		unknown[1] = ((pkt[7] & 0x0c) >> 2);
-		return pkt_send_nand_cycle(sd, fpga_counter, data, ctrl, unknown);
+		unknown[0] = sample->aux & 0xff;
+		unknown[1] = sample->aux >> 8;
+		return pkt_send_nand_cycle(sd, sample->wraps, sample->counter, sample->data, sample->ctrl, unknown);
 	}
-	else if (pkt_type == PKT_SD_CMD) {
-		uint8_t regnum;
-		uint8_t val;
-                regnum = ((pkt[4] & 0xf0) >> 4) | ((pkt[5] & 0x0f) << 4);
-		val = ((pkt[5] & 0xf0) >> 4) | ((pkt[6] & 0x03) << 4);
-		return pkt_send_sd_cmd_arg_fpga(sd, fpga_counter, regnum, val);
+	else if (sample->type == PKT_SD_CMD)
+		return pkt_send_sd_cmd_arg_fpga(sd, sample->wraps, sample->counter, sample->data, sample->ctrl);
+	else
+		return pkt_send_sd_response_fpga(sd, sample->wraps, sample->counter, sample->data);
+}
+
+
+/* Filter, trigger and emit one decoded sample */
+int fpga_process_sample(struct sd *sd, struct fpga_sample *sample) {
+	if (!filter_sample(sd, sample))
+		return 0;
+
+	if (sd->trigger_mode != TRIGGER_OFF && !trigger_sample(sd, sample))
+		return 0;
+
+	return fpga_emit_sample(sd, sample);
+}
+
+
+/* Complain about a sample type the FPGA doesn't send */
+static int fpga_unknown_sample(struct sd *sd, struct fpga_sample *sample) {
+	uint32_t err = MAKE_ERROR(SUBSYS_FPGA, FPGA_ERR_UNKNOWN_PKT, sample->type);
+	char errmsg[512];
+	snprintf(errmsg, sizeof(errmsg)-1, "Unrecognized FPGA packet type %d", sample->type);
+	return pkt_send_error(sd, err, errmsg);
+}
+
+
+/* Decode one raw sample and push it through the pipeline */
+int fpga_send_packet(struct sd *sd, uint8_t *pkt, uint32_t wraps) {
+	struct fpga_sample sample;
+
+	fpga_unpack_sample(pkt, wraps, &sample);
+
+	if (sample.type > PKT_SD_RESPONSE)
+		return fpga_unknown_sample(sd, &sample);
+
+	return fpga_process_sample(sd, &sample);
+}
+
+
+/*
+ * Eight samples at a time for fpga_unpack_batch().  Read as a native
+ * 32-bit word, bytes 4-7 hold type, data, ctrl and aux at bits 0, 4, 12
+ * and 18, so every field is a shift and a mask on the same four lanes.
+ */
+#if defined(FPGA_UNPACK_NEON)
+#define FPGA_UNPACK_VECTOR 8
+
+static uint16x8_t fpga_unpack_field(uint32x4_t hi0, uint32x4_t hi1,
+				    int shift, uint32_t mask) {
+	int32x4_t right = vdupq_n_s32(-shift);
+	uint32x4_t m = vdupq_n_u32(mask);
+
+	return vcombine_u16(vmovn_u32(vandq_u32(vshlq_u32(hi0, right), m)),
+			    vmovn_u32(vandq_u32(vshlq_u32(hi1, right), m)));
+}
+
+static int fpga_unpack_vector(struct fpga_raw *raw,
+			      struct fpga_batch *batch, int i) {
+	uint32x4_t hi[2];
+	uint16x8_t type;
+	int j;
+
+	for (j=0; j<2; j++) {
+		struct fpga_raw *r = raw + i + j*4;
+		uint32x4x2_t split;
+
+		/* Counter and fields alternate; pull them into two vectors */
+		split = vuzpq_u32(
+			vcombine_u32(vld1_u32((const uint32_t *)r[0].bytes),
+				     vld1_u32((const uint32_t *)r[1].bytes)),
+			vcombine_u32(vld1_u32((const uint32_t *)r[2].bytes),
+				     vld1_u32((const uint32_t *)r[3].bytes)));
+		vst1q_u32(&batch->counter[i + j*4], split.val[0]);
+		hi[j] = split.val[1];
 	}
 
-	else if (pkt_type == PKT_SD_RESPONSE) {
-		uint8_t val;
-                val = ((pkt[4] & 0xf0) >> 4) | ((pkt[5] & 0x0f) << 4);
-		return pkt_send_sd_response_fpga(sd, fpga_counter, val);
+	type = fpga_unpack_field(hi[0], hi[1], 0, 0x0f);
+	vst1_u8(&batch->type[i], vmovn_u16(type));
+	vst1_u8(&batch->data[i],
+		vmovn_u16(fpga_unpack_field(hi[0], hi[1], 4, 0xff)));
+	vst1_u8(&batch->ctrl[i],
+		vmovn_u16(fpga_unpack_field(hi[0], hi[1], 12, 0x3f)));
+	vst1q_u16(&batch->aux[i], fpga_unpack_field(hi[0], hi[1], 18, 0x3ff));
+
+	for (j=0; j<8; j++)
+		batch->wraps[i + j] = raw[i + j].wraps;
+
+	type = vcgtq_u16(type, vdupq_n_u16(PKT_SD_RESPONSE));
+	return vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(type)), 0) != 0;
+}
+
+#elif defined(FPGA_UNPACK_SSE2)
+#define FPGA_UNPACK_VECTOR 8
+
+/* Values are at most 10 bits, so the signed pack never saturates */
+static __m128i fpga_unpack_field(__m128i hi0, __m128i hi1,
+				 int shift, int mask) {
+	__m128i m = _mm_set1_epi32(mask);
+
+	return _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(hi0, shift), m),
+			       _mm_and_si128(_mm_srli_epi32(hi1, shift), m));
+}
+
+static int fpga_unpack_vector(struct fpga_raw *raw,
+			      struct fpga_batch *batch, int i) {
+	__m128i hi[2];
+	__m128i type, data, ctrl;
+	int j;
+
+	for (j=0; j<2; j++) {
+		struct fpga_raw *r = raw + i + j*4;
+		__m128i a, b;
+
+		/* Counter and fields alternate; pull them into two vectors */
+		a = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)r[0].bytes),
+				       _mm_loadl_epi64((const __m128i *)r[1].bytes));
+		b = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)r[2].bytes),
+				       _mm_loadl_epi64((const __m128i *)r[3].bytes));
+		a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+		b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i *)&batch->counter[i + j*4],
+				 _mm_unpacklo_epi64(a, b));
+		hi[j] = _mm_unpackhi_epi64(a, b);
 	}
-	else {
-		uint32_t err = MAKE_ERROR(SUBSYS_FPGA, FPGA_ERR_UNKNOWN_PKT, pkt_type);
-		char errmsg[512];
-		snprintf(errmsg, sizeof(errmsg)-1, "Unrecognized FPGA packet type %d", pkt_type);
-		return pkt_send_error(sd, err, errmsg);
+
+	type = fpga_unpack_field(hi[0], hi[1], 0, 0x0f);
+	data = fpga_unpack_field(hi[0], hi[1], 4, 0xff);
+	ctrl = fpga_unpack_field(hi[0], hi[1], 12, 0x3f);
+	_mm_storel_epi64((__m128i *)&batch->type[i], _mm_packus_epi16(type, type));
+	_mm_storel_epi64((__m128i *)&batch->data[i], _mm_packus_epi16(data, data));
+	_mm_storel_epi64((__m128i *)&batch->ctrl[i], _mm_packus_epi16(ctrl, ctrl));
+	_mm_storeu_si128((__m128i *)&batch->aux[i],
+			 fpga_unpack_field(hi[0], hi[1], 18, 0x3ff));
+
+	for (j=0; j<8; j++)
+		batch->wraps[i + j] = raw[i + j].wraps;
+
+	type = _mm_cmpgt_epi16(type, _mm_set1_epi16(PKT_SD_RESPONSE));
+	return _mm_movemask_epi8(type) != 0;
+}
+
+#else
+#define FPGA_UNPACK_VECTOR 0
+#endif
+
+/*
+ * The same as fpga_unpack_sample(), a whole run at a time and one field
+ * per array, with no branches in the loop.  NEON or SSE2 does most of the
+ * run where there is one, and plain C does the rest.  Returns non-zero if
+ * any sample had an unknown type.
+ */
+int fpga_unpack_batch(struct fpga_raw *raw, int count,
+		      struct fpga_batch *batch) {
+	int bad = 0;
+	int i = 0;
+
+#if FPGA_UNPACK_VECTOR
+	for (; i + FPGA_UNPACK_VECTOR <= count; i += FPGA_UNPACK_VECTOR)
+		bad |= fpga_unpack_vector(raw, batch, i);
+#endif
+
+	for (; i<count; i++) {
+		const uint8_t *pkt = raw[i].bytes;
+		uint32_t counter;
+
+		memcpy(&counter, pkt, sizeof(counter));
+		batch->counter[i] = counter;
+		batch->wraps[i] = raw[i].wraps;
+		batch->type[i] = pkt[4] & 0x0f;
+		batch->data[i] = (pkt[4] >> 4) | (pkt[5] << 4);
+		batch->ctrl[i] = ((pkt[5] >> 4) | (pkt[6] << 4)) & 0x3f;
+		batch->aux[i]  = (pkt[6] >> 2) | ((pkt[7] & 0x0f) << 6);
+		bad |= (pkt[4] & 0x0f) > PKT_SD_RESPONSE;
 	}
+	batch->count = count;
+	return bad;
+}
+
+static void fpga_batch_sample(struct fpga_batch *batch, int i,
+			      struct fpga_sample *sample) {
+	sample->counter = batch->counter[i];
+	sample->wraps = batch->wraps[i];
+	sample->type = batch->type[i];
+	sample->data = batch->data[i];
+	sample->ctrl = batch->ctrl[i];
+	sample->aux = batch->aux[i];
+}
+
+/* Nothing between the FIFO and a PACKET_FPGA_BATCH looks at samples */
+static int fpga_batch_passthrough(struct sd *sd) {
+	return (sd->pkt_features & PKT_FEATURE_BATCH)
+	    && !sd->filter.len
+	    && sd->trigger_mode == TRIGGER_OFF
+	    && sd->nand_mode == DECODE_RAW
+	    && sd->sdsniff_mode == DECODE_RAW;
+}
+
+/*
+ * Push a run of raw samples through the pipeline, with the pipeline lock
+ * held.  When nothing needs to see samples one at a time, a run goes
+ * straight from the decoder into the batch packet, and the filter only
+ * follows the SD commands going past.  Otherwise each decoded sample is
+ * filtered, triggered and emitted in turn.
+ */
+int fpga_send_batch(struct sd *sd, struct fpga_raw *raw, int count) {
+	/* Only used under the pipeline lock */
+	static struct fpga_batch batch;
+	struct fpga_sample sample;
+	int offset, i;
+
+	for (offset=0; offset<count; offset+=batch.count) {
+		int n = count - offset;
+		int passthrough = fpga_batch_passthrough(sd);
+		int bad;
+
+		if (n > FPGA_BATCH_MAX)
+			n = FPGA_BATCH_MAX;
+		bad = fpga_unpack_batch(raw + offset, n, &batch);
+
+		if (bad || !passthrough) {
+			for (i=0; i<n; i++) {
+				fpga_batch_sample(&batch, i, &sample);
+				if (sample.type > PKT_SD_RESPONSE)
+					fpga_unknown_sample(sd, &sample);
+				else
+					fpga_process_sample(sd, &sample);
+			}
+			continue;
+		}
+
+		for (i=0; i<n; i++) {
+			if (batch.type[i] != PKT_SD_CMD)
+				continue;
+			fpga_batch_sample(&batch, i, &sample);
+			filter_track(&sd->filter_state, &sample);
+		}
+		sd->filter_passed += n;
+		telemetry_self->samples_sent += n;
+		pkt_batch_add_run(sd, &sd->pkt_batch, &batch);
+	}
+	return 0;
 }
 
 
 int fpga_read_data(struct sd *sd) {
-	uint8_t pkt[8];
+	struct fpga_raw raw;
 	if (!fpga_data_avail(sd)) {
 		fprintf(stderr, "No data avilable!\n");
 		return -1;
 	}
 
 	if (gpio_get_value(DATA_OVERFLOW_PIN)) {
+		telemetry_self->overflows++;
 		fprintf(stderr, "FPGA FIFO overflowed\n");
 		pkt_send_error(sd,
 			       MAKE_ERROR(SUBSYS_FPGA, FPGA_ERR_OVERFLOW, 0),
@@ -222,34 +526,169 @@ int fpga_read_data(struct sd *sd) {
 	}
 	
 	/* Obtain the new sample and send it over the wire */
-	fpga_get_new_sample(sd, pkt);
-	return fpga_send_packet(sd, pkt);
+	fpga_get_new_sample(sd, raw.bytes);
+	telemetry_self->samples_read++;
+	fpga_clock_extend(sd, &raw, 1);
+	recorder_write_samples(sd, &raw, 1);
+	pthread_mutex_lock(&sd->fpga_pipeline_lock);
+	fpga_send_packet(sd, raw.bytes, raw.wraps);
+	pthread_mutex_unlock(&sd->fpga_pipeline_lock);
+	return pkt_batch_flush(sd, &sd->pkt_batch);
+}
+
+/*
+ * Drain scheduling.
+ *
+ * Rather than waiting for the ready edge and then a fixed delay, the drain
+ * thread watches the FIFO level (register 0x1c) and drains once enough
+ * has built up, or once the oldest sample has waited DRAIN_MAX_DELAY.
+ * How much is enough follows the measured fill rate: what arrives in
+ * DRAIN_MAX_DELAY, but no more than the watermark, so a quiet bus gets
+ * drained in a few larger bursts and a busy one gets drained early.
+ * Between looks the event loop sleeps for as long as the fill rate says
+ * it'll take to get there, and an empty FIFO just waits for the ready
+ * edge.  The drain itself runs on a thread of its own.  The least
+ * free space the FIFO had at the start of a drain is kept, as a measure of
+ * how close it came to overflowing.
+ *
+ * The decoders only send an operation once a later sample ends it, so
+ * the last one before the bus goes quiet would wait for the next burst.
+ * If one is still pending DRAIN_QUIET_FLUSH after a drain left the FIFO
+ * empty, a drain runs anyway, and finding nothing it has them send it.
+ */
+static uint32_t fpga_fifo_level(struct sd *sd) {
+	uint16_t level;
+	i2c_get_buffer(sd, 0x1c, 2, &level);
+	return ntohs(level);
+}
+
+static int64_t fpga_elapsed_ms(struct timespec *since, struct timespec *now) {
+	return (now->tv_sec - since->tv_sec) * 1000LL
+	     + (now->tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void fpga_fill_measure(struct sd *sd, uint32_t level,
+			      struct timespec *now) {
+	int64_t ms = fpga_elapsed_ms(&sd->fpga_fill_time, now);
+	uint32_t rate;
+
+	if (ms <= 0 || level < sd->fpga_fill_last)
+		return;
+
+	/* Smooth it a little, bursts are what we're sizing for */
+	rate = (level - sd->fpga_fill_last) * 1000LL / ms;
+	sd->fpga_fill_rate = (sd->fpga_fill_rate * 3 + rate) / 4;
+	sd->fpga_fill_last = level;
+	sd->fpga_fill_time = *now;
+}
+
+/* Samples to let build up before draining, at the current fill rate */
+static uint32_t fpga_drain_target(struct sd *sd) {
+	uint32_t burst = sd->fpga_fill_rate * DRAIN_MAX_DELAY / 1000;
+
+	if (burst < DRAIN_MIN_BURST)
+		burst = DRAIN_MIN_BURST;
+	if (burst > sd->fpga_drain_watermark)
+		burst = sd->fpga_drain_watermark;
+	sd->fpga_drain_burst = burst;
+	return burst;
+}
+
+/*
+ * Say whether it's time to drain.  Returns the FIFO level if it is, 1 for
+ * a quiet drain, or 0 and how many ms until it's worth looking again in
+ * *timeout, -1 for not until the ready edge.  Clear the edge with fpga_ready_fd() first, so
+ * one can't slip past.
+ */
+int fpga_drain_check(struct sd *sd, int *timeout) {
+	struct timespec now;
+	uint32_t level, headroom;
+	int64_t ms;
+
+	level = fpga_fifo_level(sd);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fpga_fill_measure(sd, level, &now);
+
+	if (!level && fpga_data_avail(sd))
+		level = 1;
+
+	if (!level) {
+		sd->fpga_drain_waiting = 0;
+		*timeout = -1;
+		if (!nand_pending(sd) && !sdsniff_pending(sd))
+			return 0;
+
+		ms = DRAIN_QUIET_FLUSH - fpga_elapsed_ms(&sd->fpga_drain_last, &now);
+		if (ms > 0) {
+			*timeout = ms;
+			return 0;
+		}
+		sd->fpga_drain_quiet = 1;
+		return 1;
+	}
+
+	if (!sd->fpga_drain_waiting) {
+		sd->fpga_drain_first = now;
+		sd->fpga_drain_waiting = 1;
+	}
+
+	if (level < fpga_drain_target(sd)) {
+		ms = DRAIN_MAX_DELAY - fpga_elapsed_ms(&sd->fpga_drain_first, &now);
+		if (ms > 0) {
+			if (sd->fpga_fill_rate) {
+				int64_t due = (sd->fpga_drain_burst - level)
+					    * 1000LL / sd->fpga_fill_rate;
+				if (due < ms)
+					ms = due ? due : 1;
+			}
+			*timeout = ms;
+			return 0;
+		}
+	}
+	sd->fpga_drain_waiting = 0;
+
+	headroom = level < FIFO_DEPTH ? FIFO_DEPTH - level : 0;
+	if (headroom < sd->fpga_headroom)
+		sd->fpga_headroom = headroom;
+	telemetry_self->fifo_sum += level;
+	if (level > telemetry_self->fifo_max)
+		telemetry_self->fifo_max = level;
+	return level;
 }
 
 int fpga_drain(struct sd *sd) {
-	uint8_t pkt_buffer[MAX_PACKETS][8];
-	uint16_t wr_data_count;
+	/* Far too big for a thread's stack, and only this thread drains */
+	static struct fpga_raw pkt_buffer[MAX_PACKETS];
+	struct timespec start, now;
 	int packet_offset = 0;
 	int overflow_count = 0;
-	int current_packet;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	/* Prevent the FPGA from filling the FIFO */
 	i2c_set_byte(sd, 2, 1);
-	i2c_get_buffer(sd, 0x1c, 2, &wr_data_count);
-	wr_data_count = ntohs(wr_data_count);
-	fprintf(stderr, "Should read %d packets\n", wr_data_count);
 
 	for (packet_offset = 0;
 	     packet_offset < MAX_PACKETS && fpga_data_avail(sd);
 	     packet_offset++) {
 		if (gpio_get_value(DATA_OVERFLOW_PIN))
 			overflow_count++;
-		fpga_get_new_sample(sd, pkt_buffer[packet_offset]);
+		fpga_get_new_sample(sd, pkt_buffer[packet_offset].bytes);
 	}
-	fprintf(stderr, "Read %d packets\n", packet_offset);
 
-	for (current_packet=0; current_packet<packet_offset; current_packet++)
-		fpga_send_packet(sd, pkt_buffer[current_packet]);
+	fpga_clock_check(sd);
+	fpga_clock_extend(sd, pkt_buffer, packet_offset);
+	recorder_write_samples(sd, pkt_buffer, packet_offset);
+
+	pthread_mutex_lock(&sd->fpga_pipeline_lock);
+	fpga_send_batch(sd, pkt_buffer, packet_offset);
+	if (sd->fpga_drain_quiet && !packet_offset) {
+		nand_flush(sd);
+		sdsniff_flush(sd);
+	}
+	pthread_mutex_unlock(&sd->fpga_pipeline_lock);
+	sd->fpga_drain_quiet = 0;
+	pkt_batch_flush(sd, &sd->pkt_batch);
 
 	if (overflow_count) {
 		char errmsg[512];
@@ -267,27 +706,159 @@ int fpga_drain(struct sd *sd) {
 	pkt_send_buffer_drain(sd, PKT_BUFFER_DRAIN_STOP);
 	i2c_set_byte(sd, 2, 0);
 
+	sd->fpga_fill_last = fpga_fifo_level(sd);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sd->fpga_fill_time = now;
+	sd->fpga_drain_last = now;
+
+	telemetry_self->samples_read += packet_offset;
+	telemetry_self->overflows += overflow_count;
+	telemetry_drain((now.tv_sec - start.tv_sec) * 1000000000ULL
+			+ now.tv_nsec - start.tv_nsec);
+
 	return 0;
 }
 
-int fpga_ready_fd(struct sd *sd) {
+/* Once a drain's packets are queued, let anyone waiting on it know */
+void fpga_drain_done(struct sd *sd) {
+	pthread_mutex_lock(&sd->fpga_drain_lock);
+	sd->fpga_drains++;
+	pthread_cond_broadcast(&sd->fpga_drain_cond);
+	pthread_mutex_unlock(&sd->fpga_drain_lock);
+}
+
+/*
+ * Wait for what a command just did on the bus to come out of the FIFO,
+ * so it goes out ahead of the command's end.  Nothing to wait for if the
+ * FIFO's empty.  Otherwise a drain that started after now has to finish:
+ * a drain already running may have missed the last samples, but the one
+ * after can't have.  A bus that's busy anyway might never leave the FIFO
+ * empty, so that's as long as it waits, up to DRAIN_SYNC_TIMEOUT.
+ * Returns 0, or ETIMEDOUT if it gave up waiting.
+ */
+int fpga_drain_sync(struct sd *sd) {
+	struct timespec deadline;
+	uint32_t start;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += DRAIN_SYNC_TIMEOUT * 1000000L;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&sd->fpga_drain_lock);
+	start = sd->fpga_drains;
+	while (!ret && sd->fpga_drains - start < 2 && fpga_data_avail(sd))
+		ret = pthread_cond_timedwait(&sd->fpga_drain_cond,
+					     &sd->fpga_drain_lock, &deadline);
+	pthread_mutex_unlock(&sd->fpga_drain_lock);
+	return ret;
+}
+
+/*
+ * Dummy read required to get poll() to work.  Edges are watched
+ * edge-triggered, so read until there's nothing left, or one that came
+ * in since could be missed.
+ */
+static void fpga_clear_edge(int fd) {
 	char bfr[15];
-	/* Dummy read required to get poll() to work */
-	read(sd->fpga_ready_fd, bfr, sizeof(bfr));
+	while (read(fd, bfr, sizeof(bfr)) > 0)
+		;
+}
+
+int fpga_ready_fd(struct sd *sd) {
+	fpga_clear_edge(sd->fpga_ready_fd);
 	return sd->fpga_ready_fd;
 }
 
 int fpga_overflow_fd(struct sd *sd) {
-	char bfr[15];
-	/* Dummy read required to get poll() to work */
-	read(sd->fpga_overflow_fd, bfr, sizeof(bfr));
+	fpga_clear_edge(sd->fpga_overflow_fd);
 	return sd->fpga_overflow_fd;
 }
 
+/*
+ * Extended FPGA clock.
+ *
+ * The FPGA counter is only 32 bits wide and wraps every 33 seconds.
+ * Samples leave the FIFO in order, so a counter that goes backwards means
+ * the clock wrapped, and the drain path stamps every sample with its wrap
+ * count that way.  The drain thread is the only writer; readers go
+ * through a sequence count and retry if they raced a write, so nothing on
+ * the per-packet path takes a lock.  Edges on the overflow pin, counted by
+ * the main loop, are only a cross-check, for when the capture went quiet
+ * for more than a whole period between two samples.
+ *
+ * A reset, which "rc" asks for from the command thread, is only posted
+ * there, and the drain thread picks it up before its next samples, so it
+ * stays the only writer.  The edge count isn't cleared either, as the
+ * loop is its only writer; the skew is set to where it stands instead.
+ */
+static void fpga_clock_store(struct sd *sd, uint32_t wraps, uint32_t last) {
+	__sync_fetch_and_add(&sd->fpga_clock_seq, 1);
+	sd->fpga_wraps = wraps;
+	sd->fpga_clock_last = last;
+	__sync_fetch_and_add(&sd->fpga_clock_seq, 1);
+}
+
+static void fpga_clock_reset_maybe(struct sd *sd) {
+	uint32_t reset = sd->fpga_clock_reset;
+
+	if (reset == sd->fpga_clock_reset_seen)
+		return;
+	sd->fpga_clock_reset_seen = reset;
+	sd->fpga_clock_skew = sd->fpga_clock_edges;
+	fpga_clock_store(sd, 0, 0);
+}
+
+void fpga_clock_extend(struct sd *sd, struct fpga_raw *raw, int count) {
+	uint32_t wraps, last;
+	int i;
+
+	fpga_clock_reset_maybe(sd);
+	if (!count)
+		return;
+
+	wraps = sd->fpga_wraps;
+	last = sd->fpga_clock_last;
+
+	for (i=0; i<count; i++) {
+		uint32_t counter;
+		memcpy(&counter, raw[i].bytes, sizeof(counter));
+		if (counter < last)
+			wraps++;
+		last = counter;
+		raw[i].wraps = wraps;
+	}
+	fpga_clock_store(sd, wraps, last);
+}
+
+/*
+ * Both counts should move together, give or take an edge that lands
+ * between the last sample and the check.  If the pin has seen two or more
+ * wraps the samples didn't, the bus sat idle across whole periods.  If
+ * it's behind, the polling thread missed edges, and the samples win.
+ */
+void fpga_clock_check(struct sd *sd) {
+	int32_t skew;
+
+	fpga_clock_reset_maybe(sd);
+	skew = (int32_t)(sd->fpga_clock_edges - sd->fpga_wraps)
+	     - sd->fpga_clock_skew;
+	if (skew >= 2) {
+		fprintf(stderr, "Clock wrapped %d times with no samples\n",
+			skew - 1);
+		fpga_clock_store(sd, sd->fpga_wraps + skew - 1,
+				 sd->fpga_clock_last);
+	}
+	else if (skew <= -2) {
+		fprintf(stderr, "Missed %d clock overflow edges\n", -skew);
+		sd->fpga_clock_skew += skew;
+	}
+}
+
+/* Start the extended clock again from 0, as of the drain's next samples */
 int fpga_reset_ticks(struct sd *sd) {
-	pthread_mutex_lock(&sd->fpga_overflow_mutex);
-	sd->fpga_clock_ticks = 0;
-	pthread_mutex_unlock(&sd->fpga_overflow_mutex);
+	__sync_fetch_and_add(&sd->fpga_clock_reset, 1);
 	return 0;
 }
 
@@ -295,20 +866,21 @@ int fpga_tick_clock_maybe(struct sd *sd) {
 	int new;
 	new = gpio_get_value(sd->fpga_overflow_pin);
 	if (new != sd->fpga_overflow_pin_value) {
-		pthread_mutex_lock(&sd->fpga_overflow_mutex);
-		sd->fpga_clock_ticks++;
-		pthread_mutex_unlock(&sd->fpga_overflow_mutex);
+		__sync_fetch_and_add(&sd->fpga_clock_edges, 1);
 		sd->fpga_overflow_pin_value = new;
 		return 1;
 	}
 	return 0;
 }
 
+/* Wrap count as of the newest sample, safe to call from any thread */
 uint32_t fpga_ticks(struct sd *sd) {
-	uint32_t ticks;
-	pthread_mutex_lock(&sd->fpga_overflow_mutex);
-	ticks = sd->fpga_clock_ticks;
-	pthread_mutex_unlock(&sd->fpga_overflow_mutex);
+	uint32_t seq, ticks;
+	do {
+		seq = sd->fpga_clock_seq;
+		__sync_synchronize();
+		ticks = sd->fpga_wraps;
+		__sync_synchronize();
+	} while ((seq & 1) || seq != sd->fpga_clock_seq);
 	return ticks;
 }
-
@@ -192,3 +192,10 @@ int gpio_set_edge(int gpio, int edge) {
 	close(fd);
 	return 0;
 }
+
+
+int gpio_open_edge(int gpio) {
+	char gpio_path[256];
+	snprintf(gpio_path, sizeof(gpio_path)-1, GPIO_PATH "/gpio%d/value", gpio);
+	return open(gpio_path, O_RDONLY | O_NONBLOCK);
+}
@@ -19,4 +19,14 @@ int gpio_set_direction(int gpio, int is_output);
 int gpio_set_value(int gpio, int value);
 int gpio_get_value(int gpio);
 int gpio_set_edge(int gpio, int edge);
+
+/* Open a descriptor to poll() for edges set up with gpio_set_edge() */
+int gpio_open_edge(int gpio);
+#ifdef USE_SIM
+/* The simulated FPGA signals an edge by writing to a pipe */
+#define GPIO_EDGE_EVENTS POLLIN
+#else
+/* sysfs flags an edge as priority data on the value file */
+#define GPIO_EDGE_EVENTS POLLPRI
+#endif
 #endif /* __GPIO_H__ */
@@ -1,6 +1,7 @@
 #define _POSIX_C_SOURCE 20121221L
 #define DEBUG
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <strings.h>
@@ -8,6 +9,10 @@
 #include <string.h>
 #include <ctype.h>
 #include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include "sd.h"
 #include "gpio.h"
 
@@ -19,12 +24,20 @@
 #define POWER_PIN 55
 #define CLOCK_RESET_PIN 59
 
-/* Time out after 250 ms, in order to check for e.g. FPGA data available */
-#define POLL_TIMEOUT 250
+/* Events epoll_wait() hands back at once */
+#define LOOP_EVENTS 16
 
 
+/* "bm" alone keeps to the original binary mode, "bm 3" takes frames */
 static int set_binmode(struct sd *server, int arg) {
-	parse_set_mode(server, PARSE_MODE_BINARY);
+	if (arg < PARSE_FRAME_VERSION) {
+		parse_set_mode(server, PARSE_MODE_BINARY);
+		return 0;
+	}
+
+	/* The hello's version byte says the frames are understood */
+	parse_set_mode(server, PARSE_MODE_FRAMED);
+	pkt_send_hello(server, server->pkt_features);
 	return 0;
 }
 
@@ -33,15 +46,17 @@ static int set_linemode(struct sd *server, int arg) {
 	return 0;
 }
 
+static int client_hello(struct sd *server, int arg) {
+	server->pkt_features = arg & PKT_FEATURES_SUPPORTED;
+	pkt_send_hello(server, server->pkt_features);
+	return 0;
+}
 
-static int get_net_command(struct sd *server, struct sd_cmd *cmd) {
-	int ret;
 
-	ret = parse_get_next_command(server, cmd);
-	if (ret < 0) {
-		perror("Quitting");
-		return -1;
-	}
+/* Take the next command the client sent, if a whole one has arrived */
+static int get_net_command(struct sd *server, struct sd_cmd *cmd) {
+	if (!parse_get_next_command(server, cmd))
+		return 0;
 
 #ifdef DEBUG
 	fprintf(stderr, "Got command: %c%c - %s", cmd->cmd[0], cmd->cmd[1],
@@ -50,88 +65,379 @@ static int get_net_command(struct sd *server, struct sd_cmd *cmd) {
 		fprintf(stderr, " - arg: %d", cmd->arg);
 	fprintf(stderr, "\n");
 #endif
-	return 0;
+	return 1;
 }
 
+/* Returns what the command's handler did */
 static int handle_net_command(struct sd *server, struct sd_cmd *cmd) {
 	/* In reality, all commands should have a handle routine */
 	if (cmd->syscmd->handle_cmd)
-		cmd->syscmd->handle_cmd(server, cmd->arg);
-	else
-		fprintf(stderr, "WARNING: Command %c%c missing handle_cmd\n",
-			cmd->cmd[0], cmd->cmd[1]);
-	return 0;
+		return cmd->syscmd->handle_cmd(server, cmd->arg);
+
+	fprintf(stderr, "WARNING: Command %c%c missing handle_cmd\n",
+		cmd->cmd[0], cmd->cmd[1]);
+	return -1;
 }
 
 
+/*
+ * Event loop.
+ *
+ * Everything the main thread waits for goes through one epoll set: the
+ * listening socket, the client in control and any observers, the FPGA's
+ * data ready and clock overflow edges, and timerfds for the next drain
+ * and the next periodic stats, so it only ever wakes up for something
+ * that happened, with no timeout to go round on.
+ *
+ * Nothing in the loop blocks for long.  Commands, which can spend a long
+ * time bit-banging the SD card, and drains run on worker threads, each
+ * started by writing to an eventfd and answering on another when done.
+ * While a command runs, the client in control isn't read from, and any
+ * commands it already sent wait their turn; observers and drains carry
+ * on regardless.
+ */
+
+enum loop_source {
+	LOOP_LISTEN,
+	LOOP_CONTROL,
+	LOOP_OBSERVER,
+	LOOP_FPGA_READY,
+	LOOP_CLOCK_OVERFLOW,
+	LOOP_DRAIN_TIMER,
+	LOOP_DRAIN_DONE,
+	LOOP_COMMAND_DONE,
+	LOOP_TELEMETRY_TIMER,
+};
+
+/* Which source an event is from, and its descriptor, ride in the event */
+static int loop_add(struct sd *server, int fd, uint32_t events, int source) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u64 = ((uint64_t)source << 32) | (uint32_t)fd;
+	return epoll_ctl(server->loop_fd, EPOLL_CTL_ADD, fd, &ev);
+}
 
-static void *clock_overflow_thread(void *arg) {
-	struct sd *server = arg;
-	int ret;
+static void loop_remove(struct sd *server, int fd) {
+	struct epoll_event ev;
+	epoll_ctl(server->loop_fd, EPOLL_CTL_DEL, fd, &ev);
+}
 
-	while (!server->should_exit) {
-		struct pollfd handles[1];
+/* Go off in ms, straight away for 0, or never for -1 */
+static void loop_arm(int timer, int ms) {
+	struct itimerspec its;
 
-		memset(handles, 0, sizeof(handles));
-		handles[0].fd     = fpga_overflow_fd(server);
-		handles[0].events = POLLPRI;
+	memset(&its, 0, sizeof(its));
+	if (ms > 0) {
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	}
+	else if (!ms)
+		its.it_value.tv_nsec = 1;
+	timerfd_settime(timer, 0, &its, NULL);
+}
 
-		ret = poll(handles, sizeof(handles)/sizeof(*handles), POLL_TIMEOUT);
-		if (ret < 0) {
-			perror("Couldn't poll");
-			return NULL;
-		}
+/* Collect a timer or eventfd count, blocking for an eventfd with none */
+static uint64_t loop_read(int fd) {
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+	return count;
+}
+
+static void loop_signal(int fd) {
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) == -1) {
+		/* Only fails once the count is near 2^64 */
+	}
+}
+
+
+/*
+ * Runs each command the loop hands it.  A command is done when its
+ * handler returns, having sent or queued everything it's going to, so
+ * the end goes straight out after it, with what the handler returned and
+ * how long it took.
+ */
+static void *command_thread(void *arg) {
+	struct sd *server = arg;
+	struct sd_cmd *cmd = &server->loop_command;
+	struct timespec start, end;
+	int ret;
+
+	/* Queries send samples from this thread */
+	telemetry_thread("net");
 
-		if (fpga_tick_clock_maybe(server))
-			fprintf(stderr, "Clock wrapped\n");
+	while (!server->should_exit) {
+		if (!loop_read(server->loop_command_go) || server->should_exit)
+			continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pkt_send_command(server, cmd, CMD_START);
+		ret = handle_net_command(server, cmd);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		pkt_send_cmd_done(server, cmd, ret,
+				  (end.tv_sec - start.tv_sec) * 1000000
+				  + (end.tv_nsec - start.tv_nsec) / 1000);
+		net_flush(server);
+
+		loop_signal(server->loop_command_done);
 	}
 	return NULL;
 }
 
 
+/* Drains the FIFO each time the loop says it's time */
 static void *data_available_thread(void *arg) {
 	struct sd *server = arg;
-	int ret;
+
+	telemetry_thread("drain");
+	net_lossy();
 
 	while (!server->should_exit) {
-		struct pollfd handles[1];
+		if (!loop_read(server->loop_drain_go) || server->should_exit)
+			continue;
 
-		memset(handles, 0, sizeof(handles));
-		handles[0].fd     = fpga_ready_fd(server);
-		handles[0].events = POLLPRI;
+		pkt_send_buffer_drain(server, PKT_BUFFER_DRAIN_START);
+		fpga_drain(server);
+		net_flush(server);
+		fpga_drain_done(server);
 
-		ret = poll(handles, sizeof(handles)/sizeof(*handles), POLL_TIMEOUT);
-		if (ret < 0) {
-			perror("Couldn't poll");
-			return NULL;
+		loop_signal(server->loop_drain_done);
+	}
+	return NULL;
+}
+
+
+/* Start a drain now, or set the timer for when to look again */
+static void loop_drain_check(struct sd *server) {
+	int timeout;
+
+	if (server->loop_draining)
+		return;
+
+	fpga_ready_fd(server);
+	if (fpga_drain_check(server, &timeout)) {
+		server->loop_draining = 1;
+		loop_arm(server->loop_drain_timer, -1);
+		loop_signal(server->loop_drain_go);
+	}
+	else
+		loop_arm(server->loop_drain_timer, timeout);
+}
+
+/* Hand the next command, if there is one, to the command thread */
+static int loop_command_next(struct sd *server) {
+	if (!get_net_command(server, &server->loop_command))
+		return 0;
+	server->loop_command_busy = 1;
+	loop_signal(server->loop_command_go);
+	return 1;
+}
+
+/* Read what the client sent, and start on the first command in it */
+static void loop_command_start(struct sd *server) {
+	if (net_read_input(server) <= 0) {
+		net_disconnect(server);
+		return;
+	}
+
+	/* Leave anything else it sends until everything before it is done */
+	if (loop_command_next(server))
+		loop_remove(server, net_fd(server));
+}
+
+static void loop_command_done(struct sd *server) {
+	server->loop_command_busy = 0;
+	parse_write_prompt(server);
+
+	/* Commands sent together run back to back */
+	if (!loop_command_next(server))
+		loop_add(server, net_fd(server), EPOLLIN, LOOP_CONTROL);
+
+	/* "si" may have changed when the next report is due */
+	loop_arm(server->loop_telemetry_timer, telemetry_timeout(server));
+}
+
+static int loop_accept(struct sd *server) {
+	int fd, ret;
+
+	ret = net_accept(server, &fd);
+	if (ret < 0)
+		return ret;
+	if (ret == NET_ROLE_OBSERVER)
+		loop_add(server, fd, EPOLLIN, LOOP_OBSERVER);
+	if (ret != NET_ROLE_CONTROL)
+		return 0;
+
+	/* Every client starts out with the defaults */
+	parse_set_mode(server, PARSE_MODE_LINE);
+	server->pkt_features = 0;
+	server->telemetry_interval = 0;
+	loop_arm(server->loop_telemetry_timer, -1);
+
+	/* The controller hears what we can do, observers what they'll get */
+	net_audience(NET_FRAME_CONTROLLER);
+	pkt_send_hello(server, PKT_FEATURES_SUPPORTED);
+	net_audience(NET_FRAME_OBSERVERS);
+	if (server->net_observer_count)
+		pkt_send_hello(server, server->pkt_features);
+	net_audience(0);
+	parse_write_prompt(server);
+	net_flush(server);
+
+	loop_add(server, fd, EPOLLIN, LOOP_CONTROL);
+	return 0;
+}
+
+static int loop_init(struct sd *server, int capture) {
+	server->loop_fd = epoll_create1(0);
+	server->loop_drain_timer = timerfd_create(CLOCK_MONOTONIC, 0);
+	server->loop_telemetry_timer = timerfd_create(CLOCK_MONOTONIC, 0);
+	server->loop_drain_go = eventfd(0, 0);
+	server->loop_drain_done = eventfd(0, 0);
+	server->loop_command_go = eventfd(0, 0);
+	server->loop_command_done = eventfd(0, 0);
+	if (server->loop_fd < 0
+	 || server->loop_drain_timer < 0 || server->loop_telemetry_timer < 0
+	 || server->loop_drain_go < 0 || server->loop_drain_done < 0
+	 || server->loop_command_go < 0 || server->loop_command_done < 0)
+		return -1;
+
+	loop_add(server, net_listen_fd(server), EPOLLIN, LOOP_LISTEN);
+	loop_add(server, server->loop_command_done, EPOLLIN, LOOP_COMMAND_DONE);
+	loop_add(server, server->loop_telemetry_timer, EPOLLIN,
+		 LOOP_TELEMETRY_TIMER);
+	pthread_create(&server->loop_command_thread, NULL,
+		       command_thread, server);
+
+	/* Capture (and recording) carries on between clients */
+	if (!capture)
+		return 0;
+
+	loop_add(server, server->fpga_ready_fd, GPIO_EDGE_EVENTS | EPOLLET,
+		 LOOP_FPGA_READY);
+	loop_add(server, server->fpga_overflow_fd, GPIO_EDGE_EVENTS | EPOLLET,
+		 LOOP_CLOCK_OVERFLOW);
+	loop_add(server, server->loop_drain_timer, EPOLLIN, LOOP_DRAIN_TIMER);
+	loop_add(server, server->loop_drain_done, EPOLLIN, LOOP_DRAIN_DONE);
+	pthread_create(&server->fpga_data_available_thread, NULL,
+		       data_available_thread, server);
+	loop_drain_check(server);
+	return 0;
+}
+
+static int loop_run(struct sd *server) {
+	struct epoll_event events[LOOP_EVENTS];
+	int count, i;
+
+	while (!server->should_exit) {
+		count = epoll_wait(server->loop_fd, events, LOOP_EVENTS, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Couldn't wait for events");
+			return -1;
 		}
 
-		while(fpga_data_avail(server)) {
-			struct timespec ts;
-			uint16_t wr_data_count;
-			pkt_send_buffer_drain(server, PKT_BUFFER_DRAIN_START);
-			ts.tv_sec = 0;
-			ts.tv_nsec = 10000000;
-			nanosleep(&ts, NULL);
-			i2c_get_buffer(server, 0x1c, 2, &wr_data_count);
-			wr_data_count = ntohs(wr_data_count);
-			fprintf(stderr, "Got FPGA data, draining (at least %d packets)...\n", wr_data_count);
-			fpga_drain(server);
-			fprintf(stderr, "Done draining\n");
+		for (i=0; i<count; i++) {
+			int source = events[i].data.u64 >> 32;
+			int fd = (uint32_t)events[i].data.u64;
+			uint32_t revents = events[i].events;
+
+			switch (source) {
+			case LOOP_LISTEN:
+				if (loop_accept(server) < 0) {
+					perror("Couldn't accept network connections");
+					return -1;
+				}
+				break;
+
+			case LOOP_CONTROL:
+				/* Gone since, along with whatever it sent */
+				if (fd != net_fd(server) || server->loop_command_busy)
+					break;
+				if (revents & (EPOLLHUP | EPOLLERR)) {
+					printf("Remote side disconnected.\n");
+					net_disconnect(server);
+				}
+				else if (revents & EPOLLIN)
+					loop_command_start(server);
+				break;
+
+			case LOOP_OBSERVER:
+				net_observer_event(server, fd, revents);
+				break;
+
+			case LOOP_FPGA_READY:
+				loop_drain_check(server);
+				break;
+
+			case LOOP_CLOCK_OVERFLOW:
+				fpga_overflow_fd(server);
+				if (fpga_tick_clock_maybe(server))
+					fprintf(stderr, "Clock wrapped\n");
+				break;
+
+			case LOOP_DRAIN_TIMER:
+				loop_read(fd);
+				loop_drain_check(server);
+				break;
+
+			case LOOP_DRAIN_DONE:
+				loop_read(fd);
+				server->loop_draining = 0;
+				loop_drain_check(server);
+				break;
+
+			case LOOP_COMMAND_DONE:
+				loop_read(fd);
+				loop_command_done(server);
+				break;
+
+			case LOOP_TELEMETRY_TIMER:
+				loop_read(fd);
+				telemetry_tick(server);
+				loop_arm(fd, telemetry_timeout(server));
+				break;
+			}
 		}
 	}
-	return NULL;
+	return 0;
 }
 
 
-
 int main(int argc, char **argv) {
 	struct sd server;
 	int ret;
+	int opt;
+	char *record_dir = NULL;
+	char *replay_dir = NULL;
 
 
 	memset(&server, 0, sizeof(server));
 
+	while ((opt = getopt(argc, argv, "d:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			record_dir = optarg;
+			break;
+		case 'r':
+			replay_dir = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d recording-directory] [-r replay-directory]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* A client going away shouldn't take the server with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Drain scheduling counts FIFO levels from this thread */
+	telemetry_thread("loop");
+
 	ret = parse_init(&server);
 	if (ret < 0) {
 		perror("Couldn't initialize parser");
@@ -144,83 +450,58 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	ret = i2c_init(&server);
-	if (ret < 0) {
-		perror("Couldn't initialize i2c");
-		return 1;
+	if (replay_dir) {
+		/* Replaying a recording needs none of the hardware */
+		clock_gettime(CLOCK_MONOTONIC, &server.fpga_starttime);
+		fpga_pipeline_init(&server);
+		replay_init(&server, replay_dir);
 	}
+	else {
+		ret = i2c_init(&server);
+		if (ret < 0) {
+			perror("Couldn't initialize i2c");
+			return 1;
+		}
 
-	ret = fpga_init(&server);
-	if (ret < 0) {
-		perror("Couldn't initialize NAND");
-		return 1;
-	}
+		ret = fpga_init(&server);
+		if (ret < 0) {
+			perror("Couldn't initialize NAND");
+			return 1;
+		}
 
-	
-	ret = sd_init(&server,
-		      MISO_PIN, MOSI_PIN, CLK_PIN, CS_PIN,
-		      POWER_PIN, CLOCK_RESET_PIN);
-        if (ret < 0) {
-                return 1;
-		perror("Couldn't initialize SD");
-		return 1;
+		ret = sd_init(&server,
+			      MISO_PIN, MOSI_PIN, CLK_PIN, CS_PIN,
+			      POWER_PIN, CLOCK_RESET_PIN);
+		if (ret < 0) {
+			perror("Couldn't initialize SD");
+			return 1;
+		}
 	}
 
-
-	ret = net_accept(&server);
-	if (ret < 0) {
-		perror("Couldn't accept network connections");
-		return 1;
+	recorder_init(&server);
+	if (record_dir) {
+		strncpy(server.record_dir, record_dir, sizeof(server.record_dir)-1);
+		recorder_start(&server);
 	}
 
 	parse_set_hook(&server, "bm", set_binmode);
 	parse_set_hook(&server, "lm", set_linemode);
+	parse_set_hook(&server, "hi", client_hello);
 
-	pkt_send_hello(&server);
-	parse_write_prompt(&server);
-
-	pthread_create(&server.fpga_overflow_thread, NULL,
-		       clock_overflow_thread, &server);
-	pthread_create(&server.fpga_data_available_thread, NULL,
-		       data_available_thread, &server);
-	while (1) {
-		struct pollfd handles[1];
-
-		memset(handles, 0, sizeof(handles));
-		handles[0].fd     = net_fd(&server);
-		handles[0].events = POLLIN | POLLHUP;
-
-		ret = poll(handles, sizeof(handles)/sizeof(*handles), POLL_TIMEOUT);
-		if (ret < 0) {
-			perror("Couldn't poll");
-			break;
-		}
-
-		if (handles[0].revents & POLLHUP) {
-			printf("Remote side disconnected.  Quitting.\n");
-			break;
-		}
-		if (handles[0].revents & POLLIN) {
-			int ret;
-			struct sd_cmd cmd;
-			struct timespec ts;
-			ret = get_net_command(&server, &cmd);
-			if (ret)
-				break;
+	ret = loop_init(&server, !replay_dir);
+	if (ret < 0) {
+		perror("Couldn't set up the event loop");
+		return 1;
+	}
 
-			pkt_send_command(&server, &cmd, CMD_START);
-			ret = handle_net_command(&server, &cmd);
-			ts.tv_sec = 0;
-			ts.tv_nsec = 10000000;
-			nanosleep(&ts, NULL);
-			pkt_send_command(&server, &cmd, CMD_END);
+	/*
+	 * One client at a time is in control and sends commands; anyone
+	 * else who connects meanwhile watches, see net.c.
+	 */
+	loop_run(&server);
 
-			if (ret)
-				break;
-			parse_write_prompt(&server);
-		}
-	}
 	server.should_exit = 1;
+	recorder_stop(&server);
 	net_deinit(&server);
 	parse_deinit(&server);
 	return 0;
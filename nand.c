@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sd.h"
+
+/*
+ * On-board NAND bus decoder.
+ *
+ * Walks the PKT_NAND cycle stream and rebuilds whole operations from it:
+ * a command latch (CLE high on a WE rising edge) starts an operation,
+ * address latches (ALE) and a second "confirm" command are collected, and
+ * data is counted on WE rising edges (data in) or RE rising edges (data
+ * out).  A second command only counts as a confirm where it's the one
+ * that finishes the first: after its address cycles for 00h/30h, 00h/35h,
+ * 05h/E0h and 60h/D0h, or after the data for 80h/10h, 11h or 15h.  Any
+ * other command starts an operation of its own, so a reset followed by a
+ * status read with CS held low is still two operations.  The operation is sent as a single PACKET_NAND_OP when the next
+ * command arrives, or when the chip is deselected after a data phase.
+ * Cycles with CS deasserted are ignored.
+ */
+
+enum nand_state {
+	NAND_IDLE,
+	NAND_COMMAND,	/* Command and address cycles */
+	NAND_CONFIRMED,	/* Second command latched, e.g. 0x30 or 0xd0 */
+	NAND_DATA_IN,
+	NAND_DATA_OUT,
+};
+
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+/* Whether cmd finishes the operation op started, once its addresses are in */
+static int nand_is_confirm(struct nand_op *op, uint8_t cmd) {
+	if (!op->addr_count)
+		return 0;
+
+	switch (op->opcode) {
+	case 0x00:
+		return cmd == 0x30 || cmd == 0x35;
+	case 0x05:
+		return cmd == 0xe0;
+	case 0x60:
+		return cmd == 0xd0;
+	}
+	return 0;
+}
+
+/* Commands that finish a program sequence, after the data-in phase */
+static int nand_is_program_confirm(struct nand_op *op, uint8_t cmd) {
+	if (op->opcode != 0x80)
+		return 0;
+	return cmd == 0x10 || cmd == 0x11 || cmd == 0x15;
+}
+
+static void nand_start(struct nand_op *op, struct fpga_sample *sample) {
+	memset(op, 0, sizeof(*op));
+	op->state = NAND_COMMAND;
+	op->start_counter = sample->counter;
+	op->start_wraps = sample->wraps;
+	op->end_counter = sample->counter;
+	op->end_wraps = sample->wraps;
+	op->data_hash = FNV_OFFSET_BASIS;
+}
+
+static void nand_data(struct nand_op *op, uint8_t byte) {
+	if (op->data_len < sizeof(op->data_head))
+		op->data_head[op->data_len] = byte;
+	op->data_len++;
+	op->data_hash = (op->data_hash ^ byte) * FNV_PRIME;
+	op->flags |= NAND_OP_DATA;
+}
+
+/* Whether an operation is partway through, waiting for more cycles */
+int nand_pending(struct sd *sd) {
+	return sd->nand_op.state != NAND_IDLE;
+}
+
+int nand_flush(struct sd *sd) {
+	struct nand_op *op = &sd->nand_op;
+	int ret;
+
+	if (op->state == NAND_IDLE)
+		return 0;
+
+	ret = pkt_send_nand_op(sd, op);
+	op->state = NAND_IDLE;
+	return ret;
+}
+
+int nand_decode_sample(struct sd *sd, struct fpga_sample *sample) {
+	struct nand_op *op = &sd->nand_op;
+	uint8_t ctrl = sample->ctrl;
+	uint8_t last = sd->nand_last_ctrl;
+	int we_rise, re_rise;
+
+	sd->nand_last_ctrl = ctrl;
+
+	/* Deselecting the chip ends a data phase */
+	if ((ctrl & NAND_CS) && !(last & NAND_CS)) {
+		if (op->state == NAND_DATA_IN
+		 || op->state == NAND_DATA_OUT
+		 || op->state == NAND_CONFIRMED)
+			nand_flush(sd);
+		return 0;
+	}
+	if (ctrl & NAND_CS)
+		return 0;
+
+	we_rise = (ctrl & NAND_WE) && !(last & NAND_WE);
+	re_rise = (ctrl & NAND_RE) && !(last & NAND_RE);
+	if (!we_rise && !re_rise)
+		return 0;
+
+	if (op->state != NAND_IDLE) {
+		op->end_counter = sample->counter;
+		op->end_wraps = sample->wraps;
+	}
+
+	if (we_rise && (ctrl & NAND_CLE)) {
+		if ((op->state == NAND_COMMAND
+		  && nand_is_confirm(op, sample->data))
+		 || (op->state == NAND_DATA_IN
+		  && nand_is_program_confirm(op, sample->data))) {
+			op->confirm = sample->data;
+			op->flags |= NAND_OP_CONFIRM;
+			op->state = NAND_CONFIRMED;
+			return 0;
+		}
+
+		nand_flush(sd);
+		nand_start(op, sample);
+		op->opcode = sample->data;
+	}
+
+	else if (we_rise && (ctrl & NAND_ALE)) {
+		if (op->state == NAND_IDLE) {
+			nand_start(op, sample);
+			op->opcode = 0xff;
+		}
+		if (op->addr_count < sizeof(op->addr))
+			op->addr[op->addr_count] = sample->data;
+		if (op->addr_count < 0xff)
+			op->addr_count++;
+	}
+
+	else if (we_rise) {
+		if (op->state == NAND_IDLE)
+			return 0;
+		op->state = NAND_DATA_IN;
+		nand_data(op, sample->data);
+	}
+
+	else {
+		if (op->state == NAND_IDLE)
+			return 0;
+		op->state = NAND_DATA_OUT;
+		op->flags |= NAND_OP_DATA_OUT;
+		nand_data(op, sample->data);
+	}
+
+	return 0;
+}
+
+static int nand_set_mode(struct sd *sd, int arg) {
+	if (arg < DECODE_RAW || arg > DECODE_BOTH)
+		arg = DECODE_RAW;
+	if (arg != DECODE_RAW && !filter_decode_allowed(sd))
+		return -1;
+	sd->nand_mode = arg;
+	return 0;
+}
+
+int nand_init(struct sd *sd) {
+	sd->nand_mode = DECODE_RAW;
+	sd->nand_last_ctrl = NAND_CS;
+	sd->nand_op.state = NAND_IDLE;
+	parse_set_hook(sd, "nd", nand_set_mode);
+	return 0;
+}
@@ -1,6 +1,9 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -9,34 +12,1082 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "sd.h"
 
+/*
+ * Bulk data channel.
+ *
+ * Capture samples and block data go out as UDP datagrams to the address
+ * and port set with "ip" and "up", by default the client's own address
+ * and NET_DATA_PORT, so a burst of samples never holds up a reply on the
+ * TCP control channel.  Packets are packed whole into datagrams of up to
+ * NET_DATAGRAM_SIZE bytes, behind a 4-byte big-endian sequence number
+ * that counts up from 0 for each client, so the client can tell what it
+ * has lost.  Full datagrams are queued and handed to the kernel
+ * NET_DATAGRAM_BATCH at a time with one sendmmsg(), and net_flush() sends
+ * whatever is queued once a drain or a command is done.  A datagram is
+ * only a list of pieces of the writer's queued frames, which the kernel
+ * copies straight out of them; the frames are held until it has.
+ *
+ * With "up 0" the data goes down the TCP connection instead, as it did
+ * before the two were split.
+ */
+
+static uint64_t net_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Whether anyone at all is listening */
+static int net_clients(struct sd *server) {
+    return server->net_fd >= 0 || server->net_observer_count;
+}
+
+static int net_data_udp(struct sd *server) {
+    return server->net_fd >= 0 && server->net_data_addr.sin_port;
+}
+
+static void net_queue_release(struct sd *server, struct net_queue *q,
+                              struct net_frame *f);
+
+/*
+ * Send every complete datagram, and the one being filled, and give back
+ * the frames they came from.  Takes net_lock.
+ */
+static void net_send_datagrams(struct sd *server) {
+    struct net_datagrams *dg = &server->net_datagrams;
+    struct mmsghdr msgs[NET_DATAGRAM_BATCH];
+    int sent, i;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i=0; i<dg->count; i++) {
+        msgs[i].msg_hdr.msg_name = &server->net_data_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(server->net_data_addr);
+        msgs[i].msg_hdr.msg_iov = dg->iov[i];
+        msgs[i].msg_hdr.msg_iovlen = dg->iovcnt[i];
+    }
+
+    sent = 0;
+    while (sent < dg->count) {
+        int ret = sendmmsg(server->net_data_socket, msgs + sent,
+                           dg->count - sent, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        /* Whatever couldn't go is lost, and the sequence numbers say so */
+        if (ret <= 0)
+            break;
+        sent += ret;
+    }
+
+    for (i=0; i<dg->nframes; i++)
+        net_queue_release(server, &server->net_data, dg->frames[i]);
+    dg->nframes = 0;
+    dg->count = 0;
+}
+
+/* Start a datagram with the next sequence number.  Takes net_lock. */
+static int net_datagram_open(struct sd *server) {
+    struct net_datagrams *dg = &server->net_datagrams;
+    int i;
+
+    if (dg->count >= NET_DATAGRAM_BATCH)
+        net_send_datagrams(server);
+    if (!dg->count)
+        dg->deadline = net_now_ns() + server->net_flush_us * 1000ULL;
+
+    i = dg->count++;
+    dg->seq[i] = htonl(server->net_data_seq++);
+    dg->iov[i][0].iov_base = &dg->seq[i];
+    dg->iov[i][0].iov_len = NET_DATAGRAM_SEQ;
+    dg->iovcnt[i] = 1;
+    dg->len[i] = NET_DATAGRAM_SEQ;
+    return i;
+}
+
+/*
+ * Add a data frame to the datagrams, which send it from where it is.
+ * Returns 1 if it's been kept to be given back once it has gone, or 0 if
+ * it was sent straight away.  Takes net_lock.
+ */
+static int net_queue_data(struct sd *server, struct net_frame *f) {
+    struct net_datagrams *dg = &server->net_datagrams;
+    int i = dg->count - 1;
+
+    /* Too big for any datagram: send it alone, and let IP fragment it */
+    if (f->len > NET_DATAGRAM_SIZE - NET_DATAGRAM_SEQ) {
+        struct msghdr msg;
+        struct iovec iov[2];
+        uint32_t seq;
+
+        net_send_datagrams(server);
+        seq = htonl(server->net_data_seq++);
+        iov[0].iov_base = &seq;
+        iov[0].iov_len = sizeof(seq);
+        iov[1].iov_base = f->buf;
+        iov[1].iov_len = f->len;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &server->net_data_addr;
+        msg.msg_namelen = sizeof(server->net_data_addr);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        sendmsg(server->net_data_socket, &msg, 0);
+        return 0;
+    }
+
+    if (!dg->count || dg->len[i] + f->len > NET_DATAGRAM_SIZE
+     || dg->iovcnt[i] > NET_DATAGRAM_FRAMES)
+        i = net_datagram_open(server);
+
+    dg->iov[i][dg->iovcnt[i]].iov_base = f->buf;
+    dg->iov[i][dg->iovcnt[i]].iov_len = f->len;
+    dg->iovcnt[i]++;
+    dg->len[i] += f->len;
+    dg->frames[dg->nframes++] = f;
+    return 1;
+}
+
+/*
+ * TCP output buffer.
+ *
+ * Packets are mostly a dozen or so bytes, so rather than a write() each
+ * they're gathered up in net_out and go out together: when the buffer
+ * fills, when the oldest byte in it has waited net_flush_us, or when
+ * net_flush() is called at the end of a drain or a command.  A frame
+ * that doesn't fit, or of NET_OUT_DIRECT bytes or more, like one full of
+ * blocks, goes out in the same writev() as the buffer, without being
+ * copied in.  The writer thread wakes up for the deadline when
+ * nothing else is being written.  "nl 0" writes every frame straight
+ * out.
+ *
+ * Since the buffering is done here, Nagle's algorithm would only hold
+ * each flush back, so the socket is TCP_NODELAY.
+ */
+
+static int net_writev_all(int fd, struct iovec *iov, int count) {
+    while (count) {
+        ssize_t ret = writev(fd, iov, count);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+
+        while (count && ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+/* Send the buffer, and then count bytes of data */
+static int net_out_flush(struct sd *server, void *data, size_t count) {
+    struct net_outbuf *out = &server->net_out;
+    struct iovec iov[2];
+    int n = 0;
+
+    if (out->len) {
+        iov[n].iov_base = out->buf;
+        iov[n].iov_len = out->len;
+        n++;
+    }
+    if (count) {
+        iov[n].iov_base = data;
+        iov[n].iov_len = count;
+        n++;
+    }
+    out->len = 0;
+
+    if (!n)
+        return 0;
+    return net_writev_all(server->net_fd, iov, n);
+}
+
+static int net_write_tcp(struct sd *server, void *data, size_t count) {
+    struct net_outbuf *out = &server->net_out;
+    uint64_t now;
+
+    if (!server->net_flush_us || count >= NET_OUT_DIRECT
+     || out->len + count > sizeof(out->buf))
+        return net_out_flush(server, data, count) ? -1 : count;
+
+    now = net_now_ns();
+    if (!out->len)
+        out->deadline = now + server->net_flush_us * 1000ULL;
+    memcpy(out->buf + out->len, data, count);
+    out->len += count;
+
+    if (now >= out->deadline && net_out_flush(server, NULL, 0))
+        return -1;
+    return count;
+}
+
+/*
+ * Observers.
+ *
+ * The first client to connect is in control, and anyone connecting
+ * while it's there is a read-only observer, up to NET_MAX_OBSERVERS of
+ * them.  Observers get a copy of everything the writer thread sends, all
+ * down their TCP connection, but can only send one command: "sm mask"
+ * to see just the packet types whose bits are set in mask, e.g.
+ * "sm 0x10000" for SD command records.
+ *
+ * Each frame is copied once into a reference-counted net_ref that every
+ * observer taking everything shares; one with a narrower mask gets its
+ * own copy with just the packets it wants.  Each observer has a thread
+ * of its own to write them, and a bounded queue.  The writer thread only
+ * ever holds an observer's lock for long enough to queue a frame, and
+ * when the queue is full the oldest frame is dropped and counted, so an
+ * observer that can't keep up never holds anyone else up.
+ */
+
+static struct net_ref *net_ref_new(uint8_t *buf, uint32_t len,
+                                   uint32_t mask) {
+    struct net_ref *ref;
+    uint32_t off = 0, size;
+
+    ref = malloc(sizeof(*ref) + len);
+    if (!ref)
+        return NULL;
+    ref->refs = 1;
+
+    if (mask == NET_OBSERVE_ALL) {
+        memcpy(ref->buf, buf, len);
+        ref->len = len;
+        return ref;
+    }
+
+    /* Every packet carries its size at 9, see pkt_set_header() */
+    ref->len = 0;
+    while (off + 11 <= len) {
+        size = (buf[off+9] << 8) | buf[off+10];
+        if (size < 11 || off + size > len)
+            break;
+        if (buf[off] < 32 && (mask & (1U << buf[off]))) {
+            memcpy(ref->buf + ref->len, buf + off, size);
+            ref->len += size;
+        }
+        off += size;
+    }
+    if (!ref->len) {
+        free(ref);
+        return NULL;
+    }
+    return ref;
+}
+
+static void net_ref_put(struct net_ref *ref) {
+    if (!__sync_sub_and_fetch(&ref->refs, 1))
+        free(ref);
+}
+
+static void net_observer_push(struct net_observer *o, struct net_ref *ref) {
+    pthread_mutex_lock(&o->lock);
+    if (!o->closing) {
+        if (o->head - o->tail == NET_OBSERVER_FRAMES) {
+            net_ref_put(o->queue[o->tail++ % NET_OBSERVER_FRAMES]);
+            o->dropped++;
+            telemetry_self->observer_dropped++;
+        }
+        __sync_fetch_and_add(&ref->refs, 1);
+        o->queue[o->head++ % NET_OBSERVER_FRAMES] = ref;
+        pthread_cond_signal(&o->cond);
+    }
+    pthread_mutex_unlock(&o->lock);
+}
+
+/* Give every observer a copy of what the writer thread is sending */
+static void net_observers_post(struct sd *server, struct net_frame *f) {
+    struct net_ref *all = NULL, *ref;
+    int i;
+
+    if (!server->net_observer_count)
+        return;
+
+    pthread_mutex_lock(&server->net_observer_lock);
+    for (i=0; i<NET_MAX_OBSERVERS; i++) {
+        struct net_observer *o = &server->net_observers[i];
+        if (o->fd < 0)
+            continue;
+
+        if (o->mask == NET_OBSERVE_ALL) {
+            if (!all)
+                all = net_ref_new(f->buf, f->len, NET_OBSERVE_ALL);
+            if (all)
+                net_observer_push(o, all);
+        }
+        else if ((ref = net_ref_new(f->buf, f->len, o->mask))) {
+            net_observer_push(o, ref);
+            net_ref_put(ref);
+        }
+    }
+    pthread_mutex_unlock(&server->net_observer_lock);
+
+    if (all)
+        net_ref_put(all);
+}
+
+static void *net_observer_thread(void *arg) {
+    struct net_observer *o = arg;
+
+    while (1) {
+        struct net_ref *ref;
+        struct iovec iov;
+
+        pthread_mutex_lock(&o->lock);
+        while (o->head == o->tail && !o->closing)
+            pthread_cond_wait(&o->cond, &o->lock);
+        if (o->closing) {
+            pthread_mutex_unlock(&o->lock);
+            break;
+        }
+        ref = o->queue[o->tail++ % NET_OBSERVER_FRAMES];
+        pthread_mutex_unlock(&o->lock);
+
+        /* A write error means it's gone, which the main loop will see */
+        iov.iov_base = ref->buf;
+        iov.iov_len = ref->len;
+        net_writev_all(o->fd, &iov, 1);
+        net_ref_put(ref);
+    }
+    return NULL;
+}
+
+static int net_observer_add(struct sd *server, int fd,
+                            struct sockaddr_in *addr) {
+    struct net_observer *o = NULL;
+    char hello[PKT_HELLO_SIZE];
+    struct net_ref *ref;
+    int i;
+
+    for (i=0; i<NET_MAX_OBSERVERS; i++) {
+        if (server->net_observers[i].fd < 0) {
+            o = &server->net_observers[i];
+            break;
+        }
+    }
+    if (!o)
+        return -1;
+
+    o->addr = *addr;
+    o->mask = NET_OBSERVE_ALL;
+    o->head = 0;
+    o->tail = 0;
+    o->closing = 0;
+    o->dropped = 0;
+    o->line_len = 0;
+    if (pthread_create(&o->thread, NULL, net_observer_thread, o))
+        return -1;
+
+    /* Say what the packets look like before the first of them */
+    pkt_build_hello(server, hello, server->pkt_features);
+    pthread_mutex_lock(&server->net_observer_lock);
+    if ((ref = net_ref_new((uint8_t *)hello, sizeof(hello),
+                           NET_OBSERVE_ALL))) {
+        net_observer_push(o, ref);
+        net_ref_put(ref);
+    }
+    o->fd = fd;
+    server->net_observer_count++;
+    pthread_mutex_unlock(&server->net_observer_lock);
+    return 0;
+}
+
+static void net_observer_remove(struct sd *server, struct net_observer *o) {
+    pthread_mutex_lock(&server->net_observer_lock);
+    server->net_observer_count--;
+    pthread_mutex_unlock(&server->net_observer_lock);
+
+    /* Get its thread out of a write() to a client that stopped reading */
+    pthread_mutex_lock(&o->lock);
+    o->closing = 1;
+    pthread_cond_signal(&o->cond);
+    pthread_mutex_unlock(&o->lock);
+    shutdown(o->fd, SHUT_RDWR);
+    pthread_join(o->thread, NULL);
+
+    while (o->tail != o->head)
+        net_ref_put(o->queue[o->tail++ % NET_OBSERVER_FRAMES]);
+
+    printf("Observer %s gone, %llu frames dropped\n",
+           inet_ntoa(o->addr.sin_addr), (unsigned long long)o->dropped);
+
+    pthread_mutex_lock(&server->net_observer_lock);
+    close(o->fd);
+    o->fd = -1;
+    pthread_mutex_unlock(&server->net_observer_lock);
+}
+
+/* "sm [mask]", the only command an observer has */
+static void net_observer_command(struct net_observer *o, char *line) {
+    char *arg;
+
+    while (isspace((unsigned char)*line))
+        line++;
+    if (strncmp(line, "sm", 2)) {
+        fprintf(stderr, "Observers can't send \"%s\"\n", line);
+        return;
+    }
+
+    arg = line + 2;
+    while (isspace((unsigned char)*arg))
+        arg++;
+    pthread_mutex_lock(&o->lock);
+    o->mask = *arg ? strtoul(arg, NULL, 0) : NET_OBSERVE_ALL;
+    pthread_mutex_unlock(&o->lock);
+}
+
+/* Read what an observer sent, or let it go */
+void net_observer_event(struct sd *server, int fd, int revents) {
+    struct net_observer *o = NULL;
+    char buf[64];
+    int i, ret;
+
+    for (i=0; i<NET_MAX_OBSERVERS; i++)
+        if (server->net_observers[i].fd == fd)
+            o = &server->net_observers[i];
+    if (!o)
+        return;
+
+    ret = -1;
+    if (revents & POLLIN)
+        ret = read(fd, buf, sizeof(buf));
+    if (ret <= 0) {
+        net_observer_remove(server, o);
+        return;
+    }
+
+    for (i=0; i<ret; i++) {
+        if (buf[i] == '\n' || buf[i] == '\r') {
+            o->line[o->line_len] = '\0';
+            if (o->line_len)
+                net_observer_command(o, o->line);
+            o->line_len = 0;
+        }
+        else if (o->line_len < sizeof(o->line) - 1)
+            o->line[o->line_len++] = buf[i];
+    }
+}
+
+/*
+ * Writer thread.
+ *
+ * Only net_writer_thread() touches the sockets.  Everyone else claims a
+ * frame in one of two bounded lock-free queues, one for control and one
+ * for data, writes packets straight into it, and hands it over when it's
+ * full, when its first packet has waited net_flush_us, when the thread
+ * calls net_flush(), or straight away for control packets, so a slow
+ * client never holds up a drain.  On the UDP channel a data frame is
+ * never bigger than a datagram.
+ *
+ * The queues are rings of preallocated frames with a sequence number in
+ * each (Vyukov's bounded queue), so putting and taking need nothing more
+ * than a compare-and-swap.
+ *
+ * Control frames go ahead of any data that's waiting, so a reply isn't
+ * stuck behind a megabyte of capture, with two exceptions.  A control
+ * frame carries the ring position of the last data frame its own thread
+ * queued, and waits until the writer has taken that, so a command's
+ * CMD_END still comes after the sector it read, even while another
+ * thread is still filling a data frame ahead of it.  And after
+ * NET_CONTROL_BURST control frames in a row while data waits, one data
+ * frame goes, so a client polling "st" in a loop can't starve the
+ * capture.  How long frames of each class wait in the queue is counted
+ * in telemetry.
+ *
+ * After "up 0" both classes share one socket, and a reply could still
+ * sit behind whatever capture the kernel is holding for a slow client.
+ * So the socket is only allowed NET_BULK_LOWAT bytes of unsent data
+ * before data frames are held back here, where replies can pass them.
+ *
+ * When the data queue is full, a thread that has called net_lossy(),
+ * like the drain thread, throws away the oldest data frame to make room
+ * and counts it in telemetry: losing some capture beats letting the FIFO
+ * overflow.  Anyone else, like a replay or a query, and anyone with a
+ * control frame, waits for the writer instead.
+ */
+
+/* Control frames that may jump the data queue before one data frame goes */
+#define NET_CONTROL_BURST 8
+
+/* Unsent bytes the kernel may hold before data over TCP waits, see above */
+#define NET_BULK_LOWAT 65536
+
+/* How often to look for replies while data is held back */
+#define NET_BULK_POLL_MS 1
+
+struct net_stage {
+    struct net_frame    *frame;     /* The slot being filled, or NULL */
+    uint32_t            pos;        /* ... and its place in the ring */
+    int                 cls;        /* Class of the last one, for flushes */
+    uint64_t            deadline;
+    int                 lossy;
+    int                 audience;   /* NET_FRAME_CONTROLLER or _OBSERVERS */
+    int                 has_data;   /* data_pos is set */
+    uint32_t            data_pos;
+};
+static __thread struct net_stage net_stage;
+
+static struct net_queue *net_queue_for(struct sd *server, int cls) {
+    if (cls == NET_CLASS_CONTROL)
+        return &server->net_control;
+    return &server->net_data;
+}
+
+static int net_queue_alloc(struct net_queue *q, uint32_t size) {
+    uint32_t i;
+
+    q->frames = calloc(size, sizeof(*q->frames));
+    if (!q->frames)
+        return -1;
+    for (i=0; i<size; i++)
+        q->frames[i].seq = i;
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+    return 0;
+}
+
+/*
+ * Claim the next free frame, or NULL if the queue is full.  Its place in
+ * the ring goes in *at.
+ */
+static struct net_frame *net_queue_reserve(struct net_queue *q,
+                                           uint32_t *at) {
+    uint32_t pos = q->head;
+
+    while (1) {
+        struct net_frame *f = &q->frames[pos & q->mask];
+        int32_t dif = (int32_t)(f->seq - pos);
+
+        if (!dif) {
+            if (__sync_bool_compare_and_swap(&q->head, pos, pos + 1)) {
+                *at = pos;
+                return f;
+            }
+        }
+        else if (dif < 0)
+            return NULL;
+        pos = q->head;
+    }
+}
+
+/* Make a reserved frame visible to the other side */
+static void net_queue_publish(struct net_frame *f) {
+    __sync_synchronize();
+    f->seq++;
+}
+
+/* Take the oldest finished frame, or NULL if there isn't one */
+static struct net_frame *net_queue_take(struct net_queue *q) {
+    uint32_t pos = q->tail;
+
+    while (1) {
+        struct net_frame *f = &q->frames[pos & q->mask];
+        int32_t dif = (int32_t)(f->seq - (pos + 1));
+
+        if (!dif) {
+            if (__sync_bool_compare_and_swap(&q->tail, pos, pos + 1)) {
+                __sync_synchronize();
+                return f;
+            }
+        }
+        else if (dif < 0)
+            return NULL;
+        pos = q->tail;
+    }
+}
+
+/*
+ * Hand a taken frame back, for reuse once the ring comes round, and wake
+ * anyone waiting in net_space_wait() or net_sync().  They count
+ * themselves in net_space_waiters under net_space_lock before they look
+ * at the queue, so either they see this frame or we see them.
+ */
+static void net_queue_release(struct sd *server, struct net_queue *q,
+                              struct net_frame *f) {
+    __sync_synchronize();
+    f->seq += q->mask;
+    __sync_synchronize();
+    if (server->net_space_waiters) {
+        pthread_mutex_lock(&server->net_space_lock);
+        pthread_cond_broadcast(&server->net_space_cond);
+        pthread_mutex_unlock(&server->net_space_lock);
+    }
+}
+
+/* The oldest finished frame, left where it is */
+static struct net_frame *net_queue_peek(struct net_queue *q) {
+    uint32_t pos = q->tail;
+    struct net_frame *f = &q->frames[pos & q->mask];
+
+    if (f->seq != pos + 1)
+        return NULL;
+    __sync_synchronize();
+    return f;
+}
+
+static void net_writer_wake(struct sd *server) {
+    __sync_synchronize();
+    if (server->net_writer_idle) {
+        pthread_mutex_lock(&server->net_writer_lock);
+        pthread_cond_signal(&server->net_writer_cond);
+        pthread_mutex_unlock(&server->net_writer_lock);
+    }
+}
+
+/*
+ * Claim a frame, sleeping until the writer hands one back if the queue
+ * is full.  NULL if we're shutting down and never will.
+ */
+static struct net_frame *net_space_wait(struct sd *server,
+                                        struct net_queue *q, uint32_t *at) {
+    struct net_frame *f;
+
+    pthread_mutex_lock(&server->net_space_lock);
+    server->net_space_waiters++;
+    __sync_synchronize();
+    while (!(f = net_queue_reserve(q, at)) && !server->should_exit) {
+        net_writer_wake(server);
+        pthread_cond_wait(&server->net_space_cond, &server->net_space_lock);
+    }
+    server->net_space_waiters--;
+    pthread_mutex_unlock(&server->net_space_lock);
+    return f;
+}
+
+/*
+ * Claim a slot for this thread to fill, making room the way net_lossy()
+ * says if the queue is full.  NULL if we're shutting down.
+ */
+static struct net_frame *net_stage_open(struct sd *server, int cls) {
+    struct net_queue *q = net_queue_for(server, cls);
+    struct net_frame *f, *old;
+    uint32_t pos;
+
+    while (!(f = net_queue_reserve(q, &pos))) {
+        /* Out of room: the oldest capture goes, not the newest */
+        if (cls == NET_CLASS_DATA && net_stage.lossy
+         && (old = net_queue_take(q))) {
+            net_queue_release(server, q, old);
+            telemetry_self->frames_dropped++;
+            continue;
+        }
+
+        f = net_space_wait(server, q, &pos);
+        if (!f)
+            return NULL;
+        break;
+    }
+
+    f->cls = cls;
+    f->flags = net_stage.audience;
+    f->session = server->net_session;
+    f->len = 0;
+    net_stage.frame = f;
+    net_stage.pos = pos;
+    net_stage.cls = cls;
+    net_stage.deadline = net_now_ns() + server->net_flush_us * 1000ULL;
+    return f;
+}
+
+/* Hand this thread's slot to the writer, or an empty one to flush */
+static void net_stage_send(struct sd *server, int flags) {
+    struct net_frame *f = net_stage.frame;
+
+    if (!f) {
+        if (!flags)
+            return;
+        f = net_stage_open(server, net_stage.cls);
+        if (!f)
+            return;
+    }
+
+    f->flags |= flags;
+    if (f->cls == NET_CLASS_DATA) {
+        net_stage.data_pos = net_stage.pos;
+        net_stage.has_data = 1;
+    }
+    else if (net_stage.has_data) {
+        f->after = net_stage.data_pos;
+        f->flags |= NET_FRAME_AFTER;
+    }
+    f->queued = net_now_ns();
+    net_queue_publish(f);
+    net_writer_wake(server);
+    net_stage.frame = NULL;
+}
+
+/*
+ * Give back this thread's slot empty once nobody's listening, so it isn't
+ * left holding up the frames behind it.
+ */
+static void net_stage_drop(struct sd *server) {
+    if (net_stage.frame) {
+        net_stage.frame->len = 0;
+        net_stage_send(server, 0);
+    }
+}
+
+/* Add a packet, in pieces, to this thread's frame */
+static int net_stage_packet(struct sd *server, int cls,
+                            const struct iovec *iov, int iovcnt) {
+    struct net_frame *f = net_stage.frame;
+    uint32_t room = NET_FRAME_SIZE;
+    size_t count = 0;
+    int i;
+
+    for (i=0; i<iovcnt; i++)
+        count += iov[i].iov_len;
+
+    /* With nobody connected, the data just goes to the recorder */
+    if (!net_clients(server)) {
+        net_stage_drop(server);
+        return count;
+    }
+
+    if (cls == NET_CLASS_DATA && net_data_mtu(server))
+        room = net_data_mtu(server);
+    if (count > NET_FRAME_SIZE)
+        return -1;
+
+    if (f && (f->cls != cls || f->flags != net_stage.audience
+           || f->len + count > room)) {
+        net_stage_send(server, 0);
+        f = NULL;
+    }
+    if (!f && !(f = net_stage_open(server, cls)))
+        return count;
+
+    for (i=0; i<iovcnt; i++) {
+        memcpy(f->buf + f->len, iov[i].iov_base, iov[i].iov_len);
+        f->len += iov[i].iov_len;
+    }
+
+    if (cls == NET_CLASS_CONTROL || net_now_ns() >= net_stage.deadline)
+        net_stage_send(server, 0);
+    return count;
+}
+
+/* Let this thread's data be dropped rather than wait for the writer */
+void net_lossy(void) {
+    net_stage.lossy = 1;
+}
+
+/*
+ * Send this thread's next packets only to the controller, or only to
+ * observers, with NET_FRAME_CONTROLLER or NET_FRAME_OBSERVERS, or to
+ * everyone again with 0.
+ */
+void net_audience(int only) {
+    net_stage.audience = only;
+}
+
+/* Capture and block data: over UDP, or TCP after "up 0" */
 int net_write_data(struct sd *server, void *data, size_t count) {
-    int ret;
+    struct iovec iov;
+
+    iov.iov_base = data;
+    iov.iov_len = count;
+    return net_stage_packet(server, NET_CLASS_DATA, &iov, 1);
+}
+
+/* Replies and everything else that isn't bulk data */
+int net_write_control(struct sd *server, void *data, size_t count) {
+    struct iovec iov;
+
+    iov.iov_base = data;
+    iov.iov_len = count;
+    return net_stage_packet(server, NET_CLASS_CONTROL, &iov, 1);
+}
+
+/*
+ * The same for a packet in pieces, like a header and a block that's
+ * somewhere else, so it needn't be put together first.  The pieces are
+ * copied straight into the frame, and can be reused once this returns.
+ */
+int net_writev_data(struct sd *server, const struct iovec *iov, int iovcnt) {
+    return net_stage_packet(server, NET_CLASS_DATA, iov, iovcnt);
+}
+
+int net_writev_control(struct sd *server, const struct iovec *iov,
+                       int iovcnt) {
+    return net_stage_packet(server, NET_CLASS_CONTROL, iov, iovcnt);
+}
+
+/* Send everything this thread has written, on both channels */
+int net_flush(struct sd *server) {
+    if (!net_clients(server)) {
+        net_stage_drop(server);
+        return 0;
+    }
+    net_stage_send(server, NET_FRAME_FLUSH);
+    return 0;
+}
+
+/* Wait for the writer to send everything queued so far */
+int net_sync(struct sd *server) {
+    uint32_t ctl, data;
+
+    net_flush(server);
+    ctl = server->net_control.head;
+    data = server->net_data.head;
+
+    pthread_mutex_lock(&server->net_space_lock);
+    server->net_space_waiters++;
+    __sync_synchronize();
+    while (net_clients(server) && !server->should_exit
+        && ((int32_t)(server->net_control.tail - ctl) < 0
+         || (int32_t)(server->net_data.tail - data) < 0))
+        pthread_cond_wait(&server->net_space_cond, &server->net_space_lock);
+    server->net_space_waiters--;
+    pthread_mutex_unlock(&server->net_space_lock);
+    return 0;
+}
+
+/*
+ * Send a frame on its way, and give it back once it's gone, which for
+ * one in a datagram is when the batch goes.  Takes net_lock.
+ */
+static void net_writer_send(struct sd *server, struct net_queue *q,
+                            struct net_frame *f) {
+    int live = server->net_fd >= 0 && f->session == server->net_session;
+    int flush = f->flags & NET_FRAME_FLUSH;
+    int kept = 0;
+
+    if (live && f->len) {
+        if (f->cls == NET_CLASS_DATA && net_data_udp(server)) {
+            kept = net_queue_data(server, f);
+            server->net_tx_bytes += f->len;
+        }
+        else if (net_write_tcp(server, f->buf, f->len) >= 0)
+            server->net_tx_bytes += f->len;
+    }
+    if (!kept)
+        net_queue_release(server, q, f);
+
+    if (live && flush) {
+        if (net_data_udp(server))
+            net_send_datagrams(server);
+        net_out_flush(server, NULL, 0);
+    }
+}
+
+/* Whether the socket can take more data without it piling up */
+static int net_bulk_ready(struct sd *server) {
+    struct pollfd pfd;
+
+    if (net_data_udp(server) || server->net_fd < 0)
+        return 1;
+    pfd.fd = server->net_fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    /* Let errors through, so the write finds them */
+    return poll(&pfd, 1, 0) != 0;
+}
+
+/* Wait for the socket to take more data, or for a reply to need sending */
+static void net_bulk_wait(struct sd *server) {
+    struct pollfd pfd;
+
+    pfd.fd = server->net_fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (pfd.fd >= 0)
+        poll(&pfd, 1, NET_BULK_POLL_MS);
+}
+
+/* Why net_writer_next() found nothing it could send */
+#define NET_HELD_BULK   1   /* Data the socket can't take yet */
+#define NET_HELD_ORDER  2   /* A reply behind its own unfinished data */
+
+/*
+ * Next frame to send, by class, see above.  Sets *held when something is
+ * waiting but can't go yet.
+ */
+static struct net_frame *net_writer_next(struct sd *server,
+                                         struct net_queue **from,
+                                         int *held) {
+    static int burst;
+    struct net_frame *ctl, *data, *f;
+    int bulk;
+
+    *held = 0;
+    while (1) {
+        ctl = net_queue_peek(&server->net_control);
+        data = net_queue_peek(&server->net_data);
+
+        /* Not until the writer's past its thread's last data frame */
+        if (ctl && (ctl->flags & NET_FRAME_AFTER)
+         && (int32_t)(server->net_data.tail - ctl->after) <= 0) {
+            ctl = NULL;
+            if (!data) {
+                *held = NET_HELD_ORDER;
+                return NULL;
+            }
+        }
+        if (!ctl && !data)
+            return NULL;
+        bulk = data && net_bulk_ready(server);
+
+        if (ctl && (!bulk || burst < NET_CONTROL_BURST))
+            *from = &server->net_control;
+        else if (bulk)
+            *from = &server->net_data;
+        else {
+            *held = NET_HELD_BULK;
+            return NULL;
+        }
+
+        /* A producer may have thrown the data frame away since */
+        f = net_queue_take(*from);
+        if (!f)
+            continue;
+
+        if (f->cls == NET_CLASS_CONTROL && data)
+            burst++;
+        else
+            burst = 0;
+        return f;
+    }
+}
+
+/* How long a frame sat in its queue */
+static void net_writer_account(struct net_frame *f) {
+    struct telemetry *t = telemetry_self;
+    uint64_t now = net_now_ns();
+    uint64_t ns = now > f->queued ? now - f->queued : 0;
+
+    t->queue_frames[f->cls]++;
+    t->queue_ns[f->cls] += ns;
+    if (ns > t->queue_max_ns[f->cls])
+        t->queue_max_ns[f->cls] = ns;
+}
+
+/* Send whatever has waited long enough, and say when the rest is due */
+static uint64_t net_writer_due(struct sd *server) {
+    uint64_t now = net_now_ns(), due = 0;
+
     pthread_mutex_lock(&server->net_lock);
-    ret = write(server->net_fd, data, count);
+    if (server->net_out.len) {
+        if (now >= server->net_out.deadline)
+            net_out_flush(server, NULL, 0);
+        else
+            due = server->net_out.deadline;
+    }
+    if (server->net_datagrams.count) {
+        if (now >= server->net_datagrams.deadline)
+            net_send_datagrams(server);
+        else if (!due || server->net_datagrams.deadline < due)
+            due = server->net_datagrams.deadline;
+    }
     pthread_mutex_unlock(&server->net_lock);
-    return ret;
+    return due;
+}
+
+static void *net_writer_thread(void *arg) {
+    struct sd *server = arg;
+
+    telemetry_thread("writer");
+    while (!server->should_exit) {
+        struct net_queue *q;
+        struct net_frame *f;
+        struct timespec ts;
+        uint64_t due;
+        int held;
+
+        /*
+         * Taking the frame moves the ring on, so while it's written from
+         * where it is, a slow client only ever holds this one slot back
+         * from the producers.  It goes back once it's been sent.
+         */
+        f = net_writer_next(server, &q, &held);
+        if (f) {
+            net_writer_account(f);
+            if (f->len && !(f->flags & NET_FRAME_CONTROLLER))
+                net_observers_post(server, f);
+            if (f->flags & NET_FRAME_OBSERVERS) {
+                net_queue_release(server, q, f);
+                continue;
+            }
+            pthread_mutex_lock(&server->net_lock);
+            net_writer_send(server, q, f);
+            pthread_mutex_unlock(&server->net_lock);
+            continue;
+        }
+
+        due = net_writer_due(server);
+        if (held == NET_HELD_BULK) {
+            net_bulk_wait(server);
+            continue;
+        }
+        ts.tv_sec = due / 1000000000;
+        ts.tv_nsec = due % 1000000000;
+
+        /*
+         * Producers look at net_writer_idle after queueing, see
+         * net_writer_wake(), and net_deinit() signals under the lock.
+         * With no deadline to meet, sleep until one of them does.  A
+         * reply held for its data waits for that data to be queued.
+         */
+        pthread_mutex_lock(&server->net_writer_lock);
+        server->net_writer_idle = 1;
+        __sync_synchronize();
+        if (!server->should_exit
+         && (held == NET_HELD_ORDER || !net_queue_peek(&server->net_control))
+         && !net_queue_peek(&server->net_data)) {
+            if (due)
+                pthread_cond_timedwait(&server->net_writer_cond,
+                                       &server->net_writer_lock, &ts);
+            else
+                pthread_cond_wait(&server->net_writer_cond,
+                                  &server->net_writer_lock);
+        }
+        server->net_writer_idle = 0;
+        pthread_mutex_unlock(&server->net_writer_lock);
+    }
+    return NULL;
+}
+
+/* Most packet data a datagram can carry, or 0 if there's no limit */
+int net_data_mtu(struct sd *server) {
+    if (!net_data_udp(server))
+        return 0;
+    return NET_DATAGRAM_SIZE - NET_DATAGRAM_SEQ;
 }
 
 int net_fd(struct sd *server) {
 	return server->net_fd;
 }
 
-/* Note: This assumes the client is very well behaved (e.g. it sends
- * complete commands in a single packet).
- * It will block until a packet is received.
+/*
+ * Read whatever the client has sent onto the end of net_bfr, behind any
+ * commands there that haven't been run yet.  Returns how much was read,
+ * 0 once the client has closed the connection, or -1.
  */
-int net_get_packet(struct sd *server, uint8_t **data) {
+int net_read_input(struct sd *server) {
     int ret;
     int tries;
+    int room = sizeof(server->net_bfr) - server->net_bfr_ptr;
+
+    if (room <= 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
 
     tries = 0;
     ret = -1;
     while(tries++ < NET_MAX_TRIES && ret < 0) {
         
-        ret = read(server->net_fd, server->net_bfr, sizeof(server->net_bfr));
+        ret = read(server->net_fd, server->net_bfr + server->net_bfr_ptr,
+                   room);
 
         /* Interrupted during read (unlikely).  Try again. */
         if (ret == -1 && (errno == EINTR || errno == EAGAIN)) {
@@ -51,31 +1102,94 @@ int net_get_packet(struct sd *server, uint8_t **data) {
     /* Generic "unable to read" error */
     if (ret == -1) {
         perror("Unable to read()");
-        close(server->net_socket);
     }
 
     /* Client closed connection */
     else if (ret == 0) {
         fprintf(stderr, "Other side closed connection\n");
-        close(server->net_socket);
-        server->net_socket = 0;
     }
     else {
-        *data = server->net_bfr;
+        server->net_bfr_ptr += ret;
     }
 
     return ret;
 }
 
-int net_accept(struct sd *server) {
-    socklen_t len = sizeof(server->net_sockaddr);
-    printf("Listening on port %d\n", server->net_port);
-    server->net_fd = accept(server->net_socket,
-                            (struct sockaddr *)&(server->net_sockaddr),
-                            &len);
-    printf("Connection from %s\n", inet_ntoa(server->net_sockaddr.sin_addr));
+int net_listen_fd(struct sd *server) {
+    return server->net_socket;
+}
+
+/*
+ * Take the next connection: in control if nobody is, or else watching.
+ * Says which, see enum net_role, and its descriptor goes in *newfd.
+ */
+int net_accept(struct sd *server, int *newfd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd, val;
+
+    fd = accept(server->net_socket, (struct sockaddr *)&addr, &len);
+    if (fd < 0)
+        return fd;
+    *newfd = fd;
+
+    val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+    if (server->net_fd >= 0) {
+        if (net_observer_add(server, fd, &addr)) {
+            printf("Turning away %s, too many clients\n",
+                   inet_ntoa(addr.sin_addr));
+            close(fd);
+            return NET_ROLE_NONE;
+        }
+        printf("Observer from %s\n", inet_ntoa(addr.sin_addr));
+        return NET_ROLE_OBSERVER;
+    }
+    printf("Connection from %s\n", inet_ntoa(addr.sin_addr));
+
+#ifdef TCP_NOTSENT_LOWAT
+    val = NET_BULK_LOWAT;
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &val, sizeof(val));
+#endif
+
+    pthread_mutex_lock(&server->net_lock);
+    server->net_sockaddr = addr;
+    server->net_fd = fd;
+    server->net_out.len = 0;
+    server->net_bfr_ptr = 0;
+    server->net_bfr_skip = 0;
+
+    /* Data goes back to the client until it says otherwise */
+    server->net_data_addr.sin_family = AF_INET;
+    server->net_data_addr.sin_addr = server->net_sockaddr.sin_addr;
+    server->net_data_addr.sin_port = htons(NET_DATA_PORT);
+    server->net_data_seq = 0;
+    pthread_mutex_unlock(&server->net_lock);
+    return NET_ROLE_CONTROL;
+}
+
+/* Drop the current client, and go back to waiting for the next one */
+int net_disconnect(struct sd *server) {
+    /* Get the writer out of a write() to a client that stopped reading */
+    if (server->net_fd >= 0)
+        shutdown(server->net_fd, SHUT_RDWR);
+
+    pthread_mutex_lock(&server->net_lock);
+    if (net_data_udp(server))
+        net_send_datagrams(server);
+    if (server->net_fd >= 0)
+        close(server->net_fd);
+    server->net_fd = -1;
+    server->net_out.len = 0;
 
-    return server->net_fd;
+    /*
+     * Nothing queued for this client should reach the next one, but
+     * observers still get it all, so the queues are left to drain.
+     */
+    server->net_session++;
+    pthread_mutex_unlock(&server->net_lock);
+    return 0;
 }
 
 static int net_init_socket(struct sd *server) {
@@ -90,6 +1204,11 @@ static int net_init_socket(struct sd *server) {
         return -1;
     }
 
+    /* Observers that were dropped leave TIME_WAITs behind on this port */
+    len = sizeof(val);
+    val = 1;
+    setsockopt(server->net_socket, SOL_SOCKET, SO_REUSEADDR, &val, len);
+
     bzero(&server->net_sockaddr, sizeof(server->net_sockaddr));
     server->net_sockaddr.sin_family = AF_INET;
     server->net_sockaddr.sin_port = htons(server->net_port);
@@ -115,25 +1234,115 @@ static int net_init_socket(struct sd *server) {
     getsockopt(server->net_socket, SOL_SOCKET, SO_RCVBUF,
               &server->net_buf_len, &len);
 
-    len = sizeof(val);
-    val = 1;
-    setsockopt(server->net_socket, SOL_SOCKET, SO_REUSEADDR, &val, len);
+    return 0;
+}
+
+
+static int net_set_data_addr(struct sd *server, int arg) {
+    struct in_addr addr;
+
+    pthread_mutex_lock(&server->net_lock);
+    if (net_data_udp(server))
+        net_send_datagrams(server);
+    /* 0 means the address the client connected from */
+    if (arg)
+        server->net_data_addr.sin_addr.s_addr = htonl(arg);
+    else
+        server->net_data_addr.sin_addr = server->net_sockaddr.sin_addr;
+    addr = server->net_data_addr.sin_addr;
+    pthread_mutex_unlock(&server->net_lock);
 
+    printf("Sending data to %s\n", inet_ntoa(addr));
     return 0;
 }
 
+static int net_set_data_port(struct sd *server, int arg) {
+    pthread_mutex_lock(&server->net_lock);
+    if (net_data_udp(server))
+        net_send_datagrams(server);
+    server->net_data_addr.sin_port = htons(arg & 0xffff);
+    pthread_mutex_unlock(&server->net_lock);
+    return 0;
+}
+
+static int net_set_flush_latency(struct sd *server, int arg) {
+    net_flush(server);
+    server->net_flush_us = arg < 0 ? 0 : arg;
+    return 0;
+}
 
 int net_init(struct sd *server) {
+    pthread_condattr_t attr;
+    int i;
+
+    server->net_port = NET_PORT;
+    server->net_fd = -1;
+    pthread_mutex_init(&server->net_lock, NULL);
+
+    pthread_mutex_init(&server->net_observer_lock, NULL);
+    for (i=0; i<NET_MAX_OBSERVERS; i++) {
+        server->net_observers[i].fd = -1;
+        pthread_mutex_init(&server->net_observers[i].lock, NULL);
+        pthread_cond_init(&server->net_observers[i].cond, NULL);
+    }
 
-    server->net_port = NET_DATA_PORT;
+    if (net_queue_alloc(&server->net_control, NET_CONTROL_FRAMES)
+     || net_queue_alloc(&server->net_data, NET_DATA_FRAMES)) {
+        perror("Couldn't allocate network frames");
+        return -1;
+    }
+
+    /* The writer's deadlines are on the monotonic clock */
+    pthread_mutex_init(&server->net_writer_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&server->net_writer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&server->net_space_lock, NULL);
+    pthread_cond_init(&server->net_space_cond, NULL);
 
     /* Set up UDP data channel */
-    return net_init_socket(server);
+    server->net_data_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server->net_data_socket < 0) {
+        perror("Couldn't create data socket");
+        return -1;
+    }
+
+    server->net_flush_us = NET_FLUSH_US;
+    parse_set_hook(server, "nl", net_set_flush_latency);
+    parse_set_hook(server, "ip", net_set_data_addr);
+    parse_set_hook(server, "up", net_set_data_port);
+
+    /* Set up TCP control channel */
+    if (net_init_socket(server))
+        return -1;
+    printf("Listening on port %d\n", server->net_port);
+
+    return pthread_create(&server->net_writer, NULL,
+                          net_writer_thread, server);
 }
 
 int net_deinit(struct sd *server) {
-    close(server->net_fd);
+    int i;
+
+    net_disconnect(server);
+    for (i=0; i<NET_MAX_OBSERVERS; i++)
+        if (server->net_observers[i].fd >= 0)
+            net_observer_remove(server, &server->net_observers[i]);
+
+    server->should_exit = 1;
+    pthread_mutex_lock(&server->net_writer_lock);
+    pthread_cond_signal(&server->net_writer_cond);
+    pthread_mutex_unlock(&server->net_writer_lock);
+    pthread_join(server->net_writer, NULL);
+
+    /* Nothing will free up frames now */
+    pthread_mutex_lock(&server->net_space_lock);
+    pthread_cond_broadcast(&server->net_space_cond);
+    pthread_mutex_unlock(&server->net_space_lock);
+
     close(server->net_socket);
+    close(server->net_data_socket);
 
     return 0;
 }
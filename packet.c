@@ -4,11 +4,7 @@
 #include "sd.h"
 
 
-enum FPGAFrequency {
-	FPGA_FREQUENCY = 130000000,
-};
-
-#define PKT_VERSION_NUMBER 2
+#define PKT_VERSION_NUMBER 3	/* 3 added binary command frames, "bm 3" */
 #define PKT_HEADER_SIZE (1+4+4+2)
 
 enum PacketType {
@@ -26,6 +22,16 @@ enum PacketType {
 	PACKET_RESET = 11,
 	PACKET_BUFFER_DRAIN = 12,
 	PACKET_HELLO = 13,
+	PACKET_FPGA_BATCH = 14,
+	PACKET_NAND_OP = 15,
+	PACKET_SD_CMD_RECORD = 16,
+	PACKET_FILTER_STATS = 17,
+	PACKET_TRIGGER = 18,
+	PACKET_RECORD_STATUS = 19,
+	PACKET_QUERY_DONE = 20,
+	PACKET_REPLAY_STATS = 21,
+	PACKET_STATS = 22,
+	PACKET_COMPRESSED = 23,
 };
 
 
@@ -54,6 +60,63 @@ static int pkt_set_header(struct sd *sd, char *pkt, int type, int size) {
 }
 
 
+/* Send a packet generated on the CPU side, keeping a copy on disk */
+static int pkt_send_cpu(struct sd *sd, char *pkt, int size) {
+	recorder_write_packet(sd, pkt, size);
+	return net_write_control(sd, pkt, size);
+}
+
+/* The same, for block data and markers that belong in the data stream */
+static int pkt_send_cpu_data(struct sd *sd, char *pkt, int size) {
+	recorder_write_packet(sd, pkt, size);
+	return net_write_data(sd, pkt, size);
+}
+
+/*
+ * Whether a recorded CPU-side packet belongs in a replay.  Blocks, card
+ * registers, drains, resets and board errors happened on the bus; hellos,
+ * command echoes and replies to status commands were only ever meant for
+ * whoever was connected during the recording.
+ */
+int pkt_replayable(const uint8_t *pkt, int len) {
+	if (len < PKT_HEADER_SIZE)
+		return 0;
+
+	switch (pkt[0]) {
+	case PACKET_HELLO:
+	case PACKET_COMMAND:
+	case PACKET_BUFFER_OFFSET:
+	case PACKET_FILTER_STATS:
+	case PACKET_RECORD_STATUS:
+	case PACKET_QUERY_DONE:
+	case PACKET_REPLAY_STATS:
+	case PACKET_STATS:
+		return 0;
+	case PACKET_ERROR:
+		/* The top byte of the code is the subsystem */
+		return len > PKT_HEADER_SIZE
+		    && (pkt[PKT_HEADER_SIZE] == SUBSYS_SD
+		     || pkt[PKT_HEADER_SIZE] == SUBSYS_FPGA);
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Packets that are mostly somebody else's buffer go out as a header plus
+ * the buffer where it is, rather than being copied together first.
+ */
+static int pkt_sendv_cpu(struct sd *sd, struct iovec *iov, int iovcnt) {
+	recorder_writev_packet(sd, iov, iovcnt);
+	return net_writev_control(sd, iov, iovcnt);
+}
+
+static int pkt_sendv_cpu_data(struct sd *sd, struct iovec *iov, int iovcnt) {
+	recorder_writev_packet(sd, iov, iovcnt);
+	return net_writev_data(sd, iov, iovcnt);
+}
+
+
 /* Generic packet header (for FPGA ticks)
  *  Offset | Size | Description
  * --------+------+-------------
@@ -61,19 +124,11 @@ static int pkt_set_header(struct sd *sd, char *pkt, int type, int size) {
  *     1   |  4   | Seconds since reset
  *     5   |  4   | Nanoseconds since reset
  */
-static int pkt_set_header_fpga(struct sd *sd, char *pkt, uint32_t fpga_counter, int type, int size) {
-	uint32_t ticks = fpga_ticks(sd);
-	long long total_ticks = ticks*0x100000000LL + fpga_counter;
-	long long total_secs;
-	long long nsec_ticks;
+static int pkt_set_header_fpga(struct sd *sd, char *pkt, uint32_t ticks, uint32_t fpga_counter, int type, int size) {
 	uint32_t sec, nsec;
 	uint16_t sz;
 
-	total_secs = total_ticks / FPGA_FREQUENCY;
-	nsec_ticks = total_ticks - (total_secs * FPGA_FREQUENCY);
-	sec = total_secs;
-	nsec = (nsec_ticks * 1000000000) / FPGA_FREQUENCY;
-//	fprintf(stderr, "After %d ticks, we have %d sec and %d nsec\n", ticks, sec, nsec);
+	timebase_convert(sd, ((uint64_t)ticks << 32) | fpga_counter, &sec, &nsec);
 
 	pkt[0] = type;
 	sec = htonl(sec);
@@ -86,6 +141,14 @@ static int pkt_set_header_fpga(struct sd *sd, char *pkt, uint32_t fpga_counter,
 }
 
 
+static void pkt_put_u64(char *p, uint64_t val) {
+	uint32_t hi = htonl(val >> 32);
+	uint32_t lo = htonl(val & 0xffffffff);
+	memcpy(p+0, &hi, sizeof(hi));
+	memcpy(p+4, &lo, sizeof(lo));
+}
+
+
 /* PKT_ERROR
  *  Offset | Size | Description
  * --------+------+-------------
@@ -94,17 +157,27 @@ static int pkt_set_header_fpga(struct sd *sd, char *pkt, uint32_t fpga_counter,
  *    15   | 512  | Textual error message (NULL-padded)
  */
 int pkt_send_error(struct sd *sd, uint32_t code, char *msg) {
-	char pkt[PKT_HEADER_SIZE+4+512];
+	static const char padding[512];
+	char hdr[PKT_HEADER_SIZE+4];
+	struct iovec iov[3];
 	uint32_t real_code;
+	size_t len;
 
-	bzero(pkt, sizeof(pkt));
-
-	pkt_set_header(sd, pkt, PACKET_ERROR, sizeof(pkt));
+	pkt_set_header(sd, hdr, PACKET_ERROR, sizeof(hdr)+512);
 	real_code = htonl(code);
-	memcpy(pkt+PKT_HEADER_SIZE+0, &real_code, sizeof(real_code));
-
-	strncpy(pkt+PKT_HEADER_SIZE+4, msg, 512-1);
-	return net_write_data(sd, pkt, sizeof(pkt));
+	memcpy(hdr+PKT_HEADER_SIZE+0, &real_code, sizeof(real_code));
+
+	/* The message as it is, then NULs out to 512 */
+	len = msg ? strlen(msg) : 0;
+	if (len > 512-1)
+		len = 512-1;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = msg;
+	iov[1].iov_len = len;
+	iov[2].iov_base = (void *)padding;
+	iov[2].iov_len = 512 - len;
+	return pkt_sendv_cpu(sd, iov, 3);
 }
 
 
@@ -117,9 +190,9 @@ int pkt_send_error(struct sd *sd, uint32_t code, char *msg) {
  *    12   |  1   | Bits [0..4] are ALE, CLE, WE, RE, and CS (in order)
  *    13   |  2   | Bits [0..9] are the unknown pins
  */
-int pkt_send_nand_cycle(struct sd *sd, uint32_t fpga_counter, uint8_t data, uint8_t ctrl, uint8_t unk[2]) {
+int pkt_send_nand_cycle(struct sd *sd, uint32_t wraps, uint32_t fpga_counter, uint8_t data, uint8_t ctrl, uint8_t unk[2]) {
 	char pkt[PKT_HEADER_SIZE+1+1+2];
-	pkt_set_header_fpga(sd, pkt, fpga_counter, PACKET_NAND_CYCLE, sizeof(pkt));
+	pkt_set_header_fpga(sd, pkt, wraps, fpga_counter, PACKET_NAND_CYCLE, sizeof(pkt));
 	pkt[PKT_HEADER_SIZE+0] = data;
 	pkt[PKT_HEADER_SIZE+1] = ctrl;
 	pkt[PKT_HEADER_SIZE+2] = unk[0];
@@ -136,10 +209,14 @@ int pkt_send_nand_cycle(struct sd *sd, uint32_t fpga_counter, uint8_t data, uint
  *    11   | 512  | One block of data from the card
  */
 int pkt_send_sd_data(struct sd *sd, uint8_t *block) {
-	char pkt[PKT_HEADER_SIZE+512];
-	pkt_set_header(sd, pkt, PACKET_SD_DATA, sizeof(pkt));
-	memcpy(pkt+PKT_HEADER_SIZE, block, 512);
-	return net_write_data(sd, pkt, sizeof(pkt));
+	char hdr[PKT_HEADER_SIZE];
+	struct iovec iov[2];
+	pkt_set_header(sd, hdr, PACKET_SD_DATA, sizeof(hdr)+512);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = block;
+	iov[1].iov_len = 512;
+	return pkt_sendv_cpu_data(sd, iov, 2);
 }
 
 
@@ -152,9 +229,9 @@ int pkt_send_sd_data(struct sd *sd, uint8_t *block) {
  *    12   |   1  | Value of the register or CMD number
  */
 
-int pkt_send_sd_cmd_arg_fpga(struct sd *sd, uint32_t fpga_counter, uint8_t regnum, uint8_t val) {
+int pkt_send_sd_cmd_arg_fpga(struct sd *sd, uint32_t wraps, uint32_t fpga_counter, uint8_t regnum, uint8_t val) {
 	char pkt[PKT_HEADER_SIZE+1+1];
-	pkt_set_header_fpga(sd, pkt, fpga_counter, PACKET_SD_CMD_ARG, sizeof(pkt));
+	pkt_set_header_fpga(sd, pkt, wraps, fpga_counter, PACKET_SD_CMD_ARG, sizeof(pkt));
 	pkt[PKT_HEADER_SIZE+0] = regnum;
 	pkt[PKT_HEADER_SIZE+1] = val;
 	return net_write_data(sd, pkt, sizeof(pkt));
@@ -175,7 +252,7 @@ int pkt_send_sd_cmd_arg(struct sd *sd, uint8_t regnum, uint8_t val) {
 	pkt_set_header(sd, pkt, PACKET_SD_CMD_ARG, sizeof(pkt));
 	pkt[PKT_HEADER_SIZE+0] = regnum;
 	pkt[PKT_HEADER_SIZE+1] = val;
-	return net_write_data(sd, pkt, sizeof(pkt));
+	return pkt_send_cpu(sd, pkt, sizeof(pkt));
 }
 
 
@@ -186,9 +263,9 @@ int pkt_send_sd_cmd_arg(struct sd *sd, uint8_t regnum, uint8_t val) {
  *     0   |  11  | Header
  *    11   |   1  | The contents of the first byte that the card answered with
  */
-int pkt_send_sd_response_fpga(struct sd *sd, uint32_t fpga_counter, uint8_t byte) {
+int pkt_send_sd_response_fpga(struct sd *sd, uint32_t wraps, uint32_t fpga_counter, uint8_t byte) {
 	char pkt[PKT_HEADER_SIZE+1];
-	pkt_set_header_fpga(sd, pkt, fpga_counter, PACKET_SD_RESPONSE, sizeof(pkt));
+	pkt_set_header_fpga(sd, pkt, wraps, fpga_counter, PACKET_SD_RESPONSE, sizeof(pkt));
 	pkt[PKT_HEADER_SIZE+0] = byte;
 	return net_write_data(sd, pkt, sizeof(pkt));
 }
@@ -205,7 +282,7 @@ int pkt_send_sd_response(struct sd *sd, uint8_t byte) {
 	char pkt[PKT_HEADER_SIZE+1];
 	pkt_set_header(sd, pkt, PACKET_SD_RESPONSE, sizeof(pkt));
 	pkt[PKT_HEADER_SIZE+0] = byte;
-	return net_write_data(sd, pkt, sizeof(pkt));
+	return pkt_send_cpu(sd, pkt, sizeof(pkt));
 }
 
 
@@ -220,7 +297,7 @@ int pkt_send_sd_cid(struct sd *sd, uint8_t cid[16]) {
 	char pkt[PKT_HEADER_SIZE+16];
 	pkt_set_header(sd, pkt, PACKET_SD_CID, sizeof(pkt));
 	memcpy(pkt+PKT_HEADER_SIZE, cid, 16);
-	return net_write_data(sd, pkt, sizeof(pkt));
+	return pkt_send_cpu(sd, pkt, sizeof(pkt));
 }
 
 
@@ -235,7 +312,7 @@ int pkt_send_sd_csd(struct sd *sd, uint8_t csd[16]) {
 	char pkt[PKT_HEADER_SIZE+16];
 	pkt_set_header(sd, pkt, PACKET_SD_CSD, sizeof(pkt));
 	memcpy(pkt+PKT_HEADER_SIZE, csd, 16);
-	return net_write_data(sd, pkt, sizeof(pkt));
+	return pkt_send_cpu(sd, pkt, sizeof(pkt));
 }
 
 
@@ -254,7 +331,7 @@ int pkt_send_buffer_offset(struct sd *sd, uint8_t buffertype, uint32_t offset) {
 	real_offset = htonl(offset);
 	pkt[PKT_HEADER_SIZE+0] = buffertype;
 	memcpy(pkt+PKT_HEADER_SIZE+1, &real_offset, sizeof(real_offset));
-	return net_write_data(sd, pkt, sizeof(pkt));
+	return pkt_send_cpu(sd, pkt, sizeof(pkt));
 }
 
 
@@ -267,11 +344,15 @@ int pkt_send_buffer_offset(struct sd *sd, uint8_t buffertype, uint32_t offset) {
  *    12   | 512  | Contents of the buffer
  */
 int pkt_send_buffer_contents(struct sd *sd, uint8_t buffertype, uint8_t *buffer) {
-	char pkt[PKT_HEADER_SIZE+1+512];
-	pkt_set_header(sd, pkt, PACKET_BUFFER_CONTENTS, sizeof(pkt));
-	pkt[PKT_HEADER_SIZE+0] = buffertype;
-	memcpy(pkt+PKT_HEADER_SIZE+1, buffer, 512);
-	return net_write_data(sd, pkt, sizeof(pkt));
+	char hdr[PKT_HEADER_SIZE+1];
+	struct iovec iov[2];
+	pkt_set_header(sd, hdr, PACKET_BUFFER_CONTENTS, sizeof(hdr)+512);
+	hdr[PKT_HEADER_SIZE+0] = buffertype;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = buffer;
+	iov[1].iov_len = 512;
+	return pkt_sendv_cpu_data(sd, iov, 2);
 }
 
 
@@ -282,18 +363,46 @@ int pkt_send_buffer_contents(struct sd *sd, uint8_t buffertype, uint8_t *buffer)
  *     0   |  11  | Header
  *    11   |   2  | Two-character command code
  *    13   |   4  | 32-bit command argument
- *    14   |   1  | 1 if the command is starting, 2 if it's ending
+ *    17   |   1  | 1 if the command is starting, 2 if it's ending
+ *    18   |   4  | Request ID from the command's frame, or 0
+ *    22   |   4  | Ending: 0 if the command went well, otherwise -1, or
+ *         |      | the SD driver's status for commands that drive the card
+ *    26   |   4  | Ending: how long it took, in microseconds
+ *
+ * A command refused for a bad argument sends a PACKET_ERROR saying why
+ * before its end.
+ *
+ * By the time a command's end goes out, everything it sent, and for
+ * commands that drive the card, whatever that put in the FPGA's FIFO, is
+ * queued ahead of it.
  */
-int pkt_send_command(struct sd *sd, struct sd_cmd *cmd, uint8_t start_stop) {
-	char pkt[PKT_HEADER_SIZE+2+4+1];
-	uint32_t arg;
+static int pkt_send_command_state(struct sd *sd, struct sd_cmd *cmd,
+				  uint8_t start_stop, int32_t ret,
+				  uint32_t elapsed_us) {
+	char pkt[PKT_HEADER_SIZE+2+4+1+4+4+4];
+	uint32_t arg, id, code, us;
 	arg = htonl(cmd->arg);
+	id = htonl(cmd->id);
+	code = htonl(ret);
+	us = htonl(elapsed_us);
 	pkt_set_header(sd, pkt, PACKET_COMMAND, sizeof(pkt));
 	pkt[PKT_HEADER_SIZE+0] = cmd->cmd[0];
 	pkt[PKT_HEADER_SIZE+1] = cmd->cmd[1];
 	memcpy(pkt+PKT_HEADER_SIZE+2, &arg, sizeof(arg));
 	pkt[PKT_HEADER_SIZE+2+4] = start_stop;
-	return net_write_data(sd, pkt, sizeof(pkt));
+	memcpy(pkt+PKT_HEADER_SIZE+2+4+1, &id, sizeof(id));
+	memcpy(pkt+PKT_HEADER_SIZE+2+4+1+4, &code, sizeof(code));
+	memcpy(pkt+PKT_HEADER_SIZE+2+4+1+4+4, &us, sizeof(us));
+	return pkt_send_cpu(sd, pkt, sizeof(pkt));
+}
+
+int pkt_send_command(struct sd *sd, struct sd_cmd *cmd, uint8_t start_stop) {
+	return pkt_send_command_state(sd, cmd, start_stop, 0, 0);
+}
+
+int pkt_send_cmd_done(struct sd *sd, struct sd_cmd *cmd, int ret,
+		      uint32_t elapsed_us) {
+	return pkt_send_command_state(sd, cmd, CMD_END, ret, elapsed_us);
 }
 
 
@@ -308,7 +417,7 @@ int pkt_send_reset(struct sd *sd) {
 	char pkt[PKT_HEADER_SIZE+1];
 	pkt_set_header(sd, pkt, PACKET_RESET, sizeof(pkt));
 	pkt[PKT_HEADER_SIZE+0] = PKT_VERSION_NUMBER;
-	return net_write_data(sd, pkt, sizeof(pkt));
+	return pkt_send_cpu(sd, pkt, sizeof(pkt));
 }
 
 
@@ -323,7 +432,7 @@ int pkt_send_buffer_drain(struct sd *sd, uint8_t start_stop) {
 	char pkt[PKT_HEADER_SIZE+1];
 	pkt_set_header(sd, pkt, PACKET_BUFFER_DRAIN, sizeof(pkt));
 	pkt[PKT_HEADER_SIZE+0] = start_stop;
-	return net_write_data(sd, pkt, sizeof(pkt));
+	return pkt_send_cpu_data(sd, pkt, sizeof(pkt));
 }
 
 
@@ -333,10 +442,555 @@ int pkt_send_buffer_drain(struct sd *sd, uint8_t start_stop) {
  * --------+------+-------------
  *     0   |  11  | Header
  *    11   |   1  | Command stream version number
+ *    12   |   4  | Packet features.  On connect, every feature the server
+ *         |      | supports.  In reply to "hi", the features now enabled.
+ *
+ * Observers get the features now enabled as they connect, when a new
+ * controller resets them, and after every "hi".
  */
-int pkt_send_hello(struct sd *sd) {
-	char pkt[PKT_HEADER_SIZE+1];
-	pkt_set_header(sd, pkt, PACKET_HELLO, sizeof(pkt));
+int pkt_build_hello(struct sd *sd, char *pkt, uint32_t features) {
+	pkt_set_header(sd, pkt, PACKET_HELLO, PKT_HELLO_SIZE);
 	pkt[PKT_HEADER_SIZE+0] = PKT_VERSION_NUMBER;
+	features = htonl(features);
+	memcpy(pkt+PKT_HEADER_SIZE+1, &features, sizeof(features));
+	return PKT_HELLO_SIZE;
+}
+
+int pkt_send_hello(struct sd *sd, uint32_t features) {
+	char pkt[PKT_HELLO_SIZE];
+	pkt_build_hello(sd, pkt, features);
+	return pkt_send_cpu(sd, pkt, sizeof(pkt));
+}
+
+
+/*
+ * PACKET_FPGA_BATCH format (FPGA):
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |  11  | Header (time of the first sample)
+ *    11   |   4  | FPGA counter of the first sample
+ *    15   |   2  | Number of samples
+ *    17   |   n  | Samples, back to back
+ *
+ * Each sample is:
+ *  Size   | Description
+ * --------+-------------
+ *  1..5   | Ticks since the previous sample (0 for the first), as a
+ *         | little-endian base-128 varint
+ *    1    | Sample type (PKT_NAND, PKT_SD_CMD or PKT_SD_RESPONSE)
+ *    4    | PKT_NAND: data pins, control pins, unknown pins (2 bytes)
+ *    2    | PKT_SD_CMD: register number, register value
+ *    1    | PKT_SD_RESPONSE: response byte
+ */
+#define PKT_BATCH_OFFSET (PKT_HEADER_SIZE+4+2)
+#define PKT_BATCH_SAMPLE_MAX (5+1+4)
+
+/* Batches are kept to what one data channel datagram can carry */
+static uint32_t pkt_batch_room(struct sd *sd) {
+	uint32_t mtu = net_data_mtu(sd);
+
+	if (!mtu || mtu > PKT_BATCH_MAX_SIZE)
+		return PKT_BATCH_MAX_SIZE;
+	return mtu;
+}
+
+/*
+ * PACKET_COMPRESSED format (CPU), only sent once the client has asked for
+ * PKT_FEATURE_COMPRESS, and only when it comes out smaller:
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |  11  | Header, with the time of the packet inside
+ *    11   |   1  | Codec, PKT_CODEC_LZ4 for an LZ4 block
+ *    12   |   2  | Size of the packet once unpacked
+ *    14   |  ... | The packet, header and all, compressed
+ */
+#define PKT_CODEC_LZ4 1
+#define PKT_COMPRESSED_OFFSET (PKT_HEADER_SIZE+1+2)
+
+/* Not worth the trouble below this */
+#define PKT_COMPRESS_MIN 64
+
+static int pkt_send_compressed(struct sd *sd, char *pkt, int size) {
+	char out[PKT_COMPRESSED_OFFSET + PKT_BATCH_MAX_SIZE];
+	uint16_t sz;
+	int len;
+
+	if (!(sd->pkt_features & PKT_FEATURE_COMPRESS)
+	 || size < PKT_COMPRESS_MIN || size > PKT_BATCH_MAX_SIZE)
+		return net_write_data(sd, pkt, size);
+
+	telemetry_self->compress_in += size;
+	len = compress_block((uint8_t *)pkt, size,
+			     (uint8_t *)out + PKT_COMPRESSED_OFFSET,
+			     size - PKT_COMPRESSED_OFFSET - 1);
+	if (!len) {
+		telemetry_self->compress_out += size;
+		return net_write_data(sd, pkt, size);
+	}
+
+	len += PKT_COMPRESSED_OFFSET;
+	telemetry_self->compress_out += len;
+
+	out[0] = PACKET_COMPRESSED;
+	memcpy(out+1, pkt+1, 8);
+	sz = htons(len);
+	memcpy(out+9, &sz, sizeof(sz));
+	out[PKT_HEADER_SIZE] = PKT_CODEC_LZ4;
+	sz = htons(size);
+	memcpy(out+PKT_HEADER_SIZE+1, &sz, sizeof(sz));
+	return net_write_data(sd, out, len);
+}
+
+int pkt_batch_flush(struct sd *sd, struct pkt_batch *batch) {
+	char *pkt = (char *)batch->buf;
+	uint32_t counter;
+	uint16_t count;
+	int ret;
+
+	if (!batch->count)
+		return 0;
+
+	memcpy(&counter, pkt+PKT_HEADER_SIZE, sizeof(counter));
+	pkt_set_header_fpga(sd, pkt, batch->wraps, ntohl(counter),
+			    PACKET_FPGA_BATCH, batch->len);
+	count = htons(batch->count);
+	memcpy(pkt+PKT_HEADER_SIZE+4, &count, sizeof(count));
+
+	ret = pkt_send_compressed(sd, pkt, batch->len);
+	batch->count = 0;
+	batch->len = 0;
+	return ret;
+}
+
+int pkt_batch_add(struct sd *sd, struct pkt_batch *batch,
+		  struct fpga_sample *sample) {
+	uint8_t *p;
+	uint32_t delta;
+
+	if (batch->count >= PKT_BATCH_MAX_SAMPLES
+	 || batch->len + PKT_BATCH_SAMPLE_MAX > pkt_batch_room(sd))
+		pkt_batch_flush(sd, batch);
+
+	if (!batch->count) {
+		uint32_t counter = htonl(sample->counter);
+		memcpy(batch->buf+PKT_HEADER_SIZE, &counter, sizeof(counter));
+		batch->len = PKT_BATCH_OFFSET;
+		batch->last = sample->counter;
+		batch->wraps = sample->wraps;
+	}
+
+	p = batch->buf + batch->len;
+
+	/* Unsigned subtraction keeps the delta right across a counter wrap */
+	delta = sample->counter - batch->last;
+	batch->last = sample->counter;
+	while (delta >= 0x80) {
+		*p++ = (delta & 0x7f) | 0x80;
+		delta >>= 7;
+	}
+	*p++ = delta;
+
+	*p++ = sample->type;
+	if (sample->type == PKT_NAND) {
+		*p++ = sample->data;
+		*p++ = sample->ctrl;
+		*p++ = sample->aux & 0xff;
+		*p++ = sample->aux >> 8;
+	}
+	else if (sample->type == PKT_SD_CMD) {
+		*p++ = sample->data;
+		*p++ = sample->ctrl;
+	}
+	else {
+		*p++ = sample->data;
+	}
+
+	batch->len = p - batch->buf;
+	batch->count++;
+	return 0;
+}
+
+/* Payload bytes after the type, for each sample type */
+static const uint8_t pkt_batch_payload[16] = {
+	[PKT_NAND] = 4,
+	[PKT_SD_CMD] = 2,
+	[PKT_SD_RESPONSE] = 1,
+};
+
+/*
+ * pkt_batch_add() for a whole decoded run.  Every sample writes all four
+ * payload bytes and then only keeps as many as its type has, which there
+ * is always room for, so the type needs no branches.
+ */
+int pkt_batch_add_run(struct sd *sd, struct pkt_batch *batch,
+		      struct fpga_batch *run) {
+	uint32_t room = pkt_batch_room(sd);
+	int i;
+
+	for (i=0; i<run->count; i++) {
+		uint8_t *p;
+		uint32_t delta;
+
+		if (batch->count >= PKT_BATCH_MAX_SAMPLES
+		 || batch->len + PKT_BATCH_SAMPLE_MAX > room)
+			pkt_batch_flush(sd, batch);
+
+		if (!batch->count) {
+			uint32_t counter = htonl(run->counter[i]);
+			memcpy(batch->buf+PKT_HEADER_SIZE, &counter, sizeof(counter));
+			batch->len = PKT_BATCH_OFFSET;
+			batch->last = run->counter[i];
+			batch->wraps = run->wraps[i];
+		}
+
+		p = batch->buf + batch->len;
+		delta = run->counter[i] - batch->last;
+		batch->last = run->counter[i];
+		while (delta >= 0x80) {
+			*p++ = (delta & 0x7f) | 0x80;
+			delta >>= 7;
+		}
+		*p++ = delta;
+
+		p[0] = run->type[i];
+		p[1] = run->data[i];
+		p[2] = run->ctrl[i];
+		p[3] = run->aux[i] & 0xff;
+		p[4] = run->aux[i] >> 8;
+		p += 1 + pkt_batch_payload[run->type[i] & 0x0f];
+
+		batch->len = p - batch->buf;
+		batch->count++;
+	}
+	return 0;
+}
+
+
+/*
+ * PACKET_NAND_OP format (FPGA):
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |  11  | Header (time of the first cycle)
+ *    11   |   4  | FPGA counter of the first cycle
+ *    15   |   4  | Duration of the operation, in FPGA ticks
+ *    19   |   1  | Opcode (first command latched)
+ *    20   |   1  | Second command latched, if flags bit 1 is set
+ *    21   |   1  | Flags: bit 0 data out (read), bit 1 second command,
+ *         |      |        bit 2 data phase present
+ *    22   |   1  | Number of address cycles
+ *    23   |   2  | Column address (first two address cycles)
+ *    25   |   4  | Row address (remaining address cycles, or all of
+ *         |      |              them for a block erase)
+ *    29   |   4  | Number of data bytes
+ *    33   |   4  | FNV-1a hash of the data bytes
+ *    37   |   4  | First four data bytes (zero padded)
+ */
+int pkt_send_nand_op(struct sd *sd, struct nand_op *op) {
+	char pkt[PKT_HEADER_SIZE+4+4+1+1+1+1+2+4+4+4+4];
+	uint32_t counter, duration, column, row, len, hash;
+	uint16_t col16;
+	int naddr;
+	long long start, end;
+
+	start = op->start_wraps*0x100000000LL + op->start_counter;
+	end = op->end_wraps*0x100000000LL + op->end_counter;
+
+	naddr = op->addr_count;
+	if (naddr > sizeof(op->addr))
+		naddr = sizeof(op->addr);
+	column = 0;
+	row = 0;
+	if (op->opcode == 0x60) {
+		/* Block erase only takes a row address */
+		while (naddr--)
+			row = (row << 8) | op->addr[naddr];
+	}
+	else {
+		if (naddr > 0)
+			column |= op->addr[0];
+		if (naddr > 1)
+			column |= op->addr[1] << 8;
+		while (naddr-- > 2)
+			row = (row << 8) | op->addr[naddr];
+	}
+
+	pkt_set_header_fpga(sd, pkt, op->start_wraps, op->start_counter, PACKET_NAND_OP, sizeof(pkt));
+	counter = htonl(op->start_counter);
+	duration = htonl(end - start);
+	col16 = htons(column);
+	row = htonl(row);
+	len = htonl(op->data_len);
+	hash = htonl(op->data_hash);
+	memcpy(pkt+PKT_HEADER_SIZE+0, &counter, sizeof(counter));
+	memcpy(pkt+PKT_HEADER_SIZE+4, &duration, sizeof(duration));
+	pkt[PKT_HEADER_SIZE+8] = op->opcode;
+	pkt[PKT_HEADER_SIZE+9] = op->confirm;
+	pkt[PKT_HEADER_SIZE+10] = op->flags;
+	pkt[PKT_HEADER_SIZE+11] = op->addr_count;
+	memcpy(pkt+PKT_HEADER_SIZE+12, &col16, sizeof(col16));
+	memcpy(pkt+PKT_HEADER_SIZE+14, &row, sizeof(row));
+	memcpy(pkt+PKT_HEADER_SIZE+18, &len, sizeof(len));
+	memcpy(pkt+PKT_HEADER_SIZE+22, &hash, sizeof(hash));
+	memcpy(pkt+PKT_HEADER_SIZE+26, op->data_head, sizeof(op->data_head));
+	return net_write_data(sd, pkt, sizeof(pkt));
+}
+
+
+/*
+ * PACKET_SD_CMD_RECORD format (FPGA):
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |  11  | Header (time of the command byte)
+ *    11   |   4  | FPGA counter of the command byte
+ *    15   |   1  | Command index
+ *    16   |   1  | Flags: bit 0 argument complete, bit 1 CRC seen,
+ *         |      |        bit 2 CRC matched, bit 3 response complete,
+ *         |      |        bit 4 application command (after CMD55)
+ *    17   |   4  | Command argument
+ *    21   |   1  | CRC7 as sniffed (only valid if flags bit 1 is set)
+ *    22   |   1  | CRC7 computed over the command and argument
+ *    23   |   4  | FPGA ticks from the last command byte to the response
+ *    27   |   1  | Number of response bytes
+ *    28   |   5  | Response bytes (R1, R2, R3 or R7, zero padded)
+ */
+int pkt_send_sd_record(struct sd *sd, struct sd_record *rec) {
+	char pkt[PKT_HEADER_SIZE+4+1+1+4+1+1+4+1+5];
+	uint32_t counter, arg, latency;
+
+	pkt_set_header_fpga(sd, pkt, rec->cmd_wraps, rec->cmd_counter, PACKET_SD_CMD_RECORD, sizeof(pkt));
+	counter = htonl(rec->cmd_counter);
+	arg = htonl(rec->arg);
+	latency = htonl(rec->latency);
+	memcpy(pkt+PKT_HEADER_SIZE+0, &counter, sizeof(counter));
+	pkt[PKT_HEADER_SIZE+4] = rec->index;
+	pkt[PKT_HEADER_SIZE+5] = rec->flags;
+	memcpy(pkt+PKT_HEADER_SIZE+6, &arg, sizeof(arg));
+	pkt[PKT_HEADER_SIZE+10] = rec->crc >> 1;
+	pkt[PKT_HEADER_SIZE+11] = rec->crc_calc;
+	memcpy(pkt+PKT_HEADER_SIZE+12, &latency, sizeof(latency));
+	pkt[PKT_HEADER_SIZE+16] = rec->resp_len;
+	memset(pkt+PKT_HEADER_SIZE+17, 0, sizeof(rec->resp));
+	memcpy(pkt+PKT_HEADER_SIZE+17, rec->resp, rec->resp_len);
+	return net_write_data(sd, pkt, sizeof(pkt));
+}
+
+
+/*
+ * PACKET_FILTER_STATS format (CPU):
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |  11  | Header
+ *    11   |   8  | Samples that passed the filter
+ *    19   |   8  | NAND samples dropped
+ *    27   |   8  | SD command samples dropped
+ *    35   |   8  | SD response samples dropped
+ *    43   |   2  | Number of instructions in the filter, 0 if none
+ */
+int pkt_send_filter_stats(struct sd *sd) {
+	char pkt[PKT_HEADER_SIZE+8+8+8+8+2];
+	uint16_t len;
+	pkt_set_header(sd, pkt, PACKET_FILTER_STATS, sizeof(pkt));
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+0, sd->filter_passed);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+8, sd->filter_dropped[PKT_NAND]);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+16, sd->filter_dropped[PKT_SD_CMD]);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+24, sd->filter_dropped[PKT_SD_RESPONSE]);
+	len = htons(sd->filter.len);
+	memcpy(pkt+PKT_HEADER_SIZE+32, &len, sizeof(len));
+	return pkt_send_cpu(sd, pkt, sizeof(pkt));
+}
+
+
+/*
+ * PACKET_TRIGGER format (FPGA):
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |  11  | Header (time of the triggering sample)
+ *    11   |   1  | 1 if the trigger fired, 2 if this is a status reply
+ *    12   |   1  | Trigger state: 0 off, 1 armed, 2 sending the
+ *         |      |                post-trigger window, 3 one-shot done
+ *    13   |   4  | FPGA counter of the triggering sample
+ *    17   |   4  | Number of hits since the trigger was armed
+ *    21   |   4  | Pre-trigger samples sent after this packet
+ *    25   |   4  | Post-trigger samples sent after the triggering one
+ */
+int pkt_send_trigger(struct sd *sd, struct fpga_sample *sample) {
+	char pkt[PKT_HEADER_SIZE+1+1+4+4+4+4];
+	uint32_t counter, hits, pre, post;
+
+	if (sample) {
+		pkt_set_header_fpga(sd, pkt, sample->wraps, sample->counter, PACKET_TRIGGER, sizeof(pkt));
+		pkt[PKT_HEADER_SIZE+0] = 1;
+		counter = htonl(sample->counter);
+	}
+	else {
+		pkt_set_header(sd, pkt, PACKET_TRIGGER, sizeof(pkt));
+		pkt[PKT_HEADER_SIZE+0] = 2;
+		counter = 0;
+	}
+	pkt[PKT_HEADER_SIZE+1] = sd->trigger_state;
+	hits = htonl(sd->trigger_hits);
+	pre = htonl(sd->trigger_ring_count);
+	post = htonl(sd->trigger_post);
+	memcpy(pkt+PKT_HEADER_SIZE+2, &counter, sizeof(counter));
+	memcpy(pkt+PKT_HEADER_SIZE+6, &hits, sizeof(hits));
+	memcpy(pkt+PKT_HEADER_SIZE+10, &pre, sizeof(pre));
+	memcpy(pkt+PKT_HEADER_SIZE+14, &post, sizeof(post));
 	return net_write_data(sd, pkt, sizeof(pkt));
 }
+
+
+/*
+ * PACKET_RECORD_STATUS format (CPU):
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |  11  | Header
+ *    11   |   1  | 1 if recording, 0 if not
+ *    12   |   4  | Oldest segment on disk
+ *    16   |   4  | Segment being written
+ *    20   |   4  | Segment size, in bytes
+ *    24   |   8  | Cap on the total recording size, in bytes
+ *    32   |   8  | Bytes recorded since the server started
+ */
+int pkt_send_record_status(struct sd *sd) {
+	char pkt[PKT_HEADER_SIZE+1+4+4+4+8+8];
+	uint32_t first, seq, size;
+	pkt_set_header(sd, pkt, PACKET_RECORD_STATUS, sizeof(pkt));
+	pkt[PKT_HEADER_SIZE+0] = sd->record_enabled;
+	first = htonl(sd->record_first);
+	seq = htonl(sd->record_seq);
+	size = htonl(sd->record_segment_size);
+	memcpy(pkt+PKT_HEADER_SIZE+1, &first, sizeof(first));
+	memcpy(pkt+PKT_HEADER_SIZE+5, &seq, sizeof(seq));
+	memcpy(pkt+PKT_HEADER_SIZE+9, &size, sizeof(size));
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+13, sd->record_max_size);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+21, sd->record_bytes);
+	return net_write_control(sd, pkt, sizeof(pkt));
+}
+
+
+/*
+ * PACKET_QUERY_DONE format (CPU):
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |  11  | Header
+ *    11   |   8  | Samples that matched and were sent
+ *    19   |   8  | Samples read from disk to answer the query
+ *    27   |   4  | Segments searched
+ *    31   |   4  | Index blocks inside the time range
+ *    35   |   4  | ...of which were skipped on their summary alone
+ */
+int pkt_send_query_done(struct sd *sd, uint64_t matched, uint64_t scanned,
+			uint32_t segments, uint32_t blocks, uint32_t skipped) {
+	char pkt[PKT_HEADER_SIZE+8+8+4+4+4];
+	pkt_set_header(sd, pkt, PACKET_QUERY_DONE, sizeof(pkt));
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+0, matched);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+8, scanned);
+	segments = htonl(segments);
+	blocks = htonl(blocks);
+	skipped = htonl(skipped);
+	memcpy(pkt+PKT_HEADER_SIZE+16, &segments, sizeof(segments));
+	memcpy(pkt+PKT_HEADER_SIZE+20, &blocks, sizeof(blocks));
+	memcpy(pkt+PKT_HEADER_SIZE+24, &skipped, sizeof(skipped));
+	return net_write_control(sd, pkt, sizeof(pkt));
+}
+
+
+/*
+ * PACKET_REPLAY_STATS format (CPU):
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |  11  | Header
+ *    11   |   1  | 1 if the replay is still running, 0 if it finished
+ *    12   |   8  | Samples replayed
+ *    20   |   8  | Bytes sent to the client during the replay
+ *    28   |   8  | Nanoseconds since the replay started
+ *    36   |   8  | Samples per second
+ *    44   |   8  | Bytes per second
+ */
+int pkt_send_replay_stats(struct sd *sd, int running, uint64_t samples,
+			  uint64_t bytes, uint64_t elapsed_ns) {
+	char pkt[PKT_HEADER_SIZE+1+8+8+8+8+8];
+	uint64_t msec = elapsed_ns / 1000000;
+	pkt_set_header(sd, pkt, PACKET_REPLAY_STATS, sizeof(pkt));
+	pkt[PKT_HEADER_SIZE+0] = running;
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+1, samples);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+9, bytes);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+17, elapsed_ns);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+25, msec ? samples * 1000 / msec : 0);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+33, msec ? bytes * 1000 / msec : 0);
+	return net_write_control(sd, pkt, sizeof(pkt));
+}
+
+
+/*
+ * PACKET_STATS format (CPU), summed over every capture thread:
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |  11  | Header
+ *    11   |   8  | Samples read out of the FIFO
+ *    19   |   8  | Samples sent to the client
+ *    27   |   8  | Duplicate samples thrown away
+ *    35   |   8  | Samples read with the FIFO overflow pin up
+ *    43   |   8  | Drains
+ *    51   |   8  | Nanoseconds spent draining
+ *    59   |   8  | Bytes sent to clients
+ *    67   |   4  | Average FIFO level at the start of a drain
+ *    71   |   4  | Highest FIFO level at the start of a drain
+ *    75   |   4  | Least free space left in the FIFO
+ *    79   |   1  | Number of histogram buckets, N
+ *    80   | 4*N  | Drains taking under 1, 2, 4 ... us, the last one catching
+ *         |      | everything longer
+ *  80+4*N |   8  | Bytes of packets put through compression
+ *  88+4*N |   8  | Bytes they went out as
+ *  96+4*N |   8  | Frames of data dropped because the client fell behind
+ * 104+4*N |   8  | Control frames written
+ * 112+4*N |   8  | Nanoseconds they spent queued for the writer, in all
+ * 120+4*N |   8  | Longest one of them waited
+ * 128+4*N |  24  | The same three for data frames
+ * 152+4*N |   8  | Frames observers missed because they fell behind
+ */
+int pkt_send_stats(struct sd *sd) {
+	char pkt[PKT_HEADER_SIZE+8*7+4*3+1+4*TELEMETRY_DRAIN_BUCKETS+8*3
+		 +8*3*NET_CLASSES+8];
+	char *p;
+	struct telemetry t;
+	uint32_t val;
+	int i;
+
+	telemetry_sum(&t);
+
+	pkt_set_header(sd, pkt, PACKET_STATS, sizeof(pkt));
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+0, t.samples_read);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+8, t.samples_sent);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+16, t.duplicates);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+24, t.overflows);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+32, t.drains);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+40, t.drain_ns);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+48, sd->net_tx_bytes);
+
+	val = htonl(t.drains ? t.fifo_sum / t.drains : 0);
+	memcpy(pkt+PKT_HEADER_SIZE+56, &val, sizeof(val));
+	val = htonl(t.fifo_max);
+	memcpy(pkt+PKT_HEADER_SIZE+60, &val, sizeof(val));
+	val = htonl(sd->fpga_headroom);
+	memcpy(pkt+PKT_HEADER_SIZE+64, &val, sizeof(val));
+
+	pkt[PKT_HEADER_SIZE+68] = TELEMETRY_DRAIN_BUCKETS;
+	for (i=0; i<TELEMETRY_DRAIN_BUCKETS; i++) {
+		val = htonl(t.drain_hist[i]);
+		memcpy(pkt+PKT_HEADER_SIZE+69+i*4, &val, sizeof(val));
+	}
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+69+i*4, t.compress_in);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+77+i*4, t.compress_out);
+	pkt_put_u64(pkt+PKT_HEADER_SIZE+85+i*4, t.frames_dropped);
+
+	p = pkt+PKT_HEADER_SIZE+93+i*4;
+	for (i=0; i<NET_CLASSES; i++) {
+		pkt_put_u64(p+0, t.queue_frames[i]);
+		pkt_put_u64(p+8, t.queue_ns[i]);
+		pkt_put_u64(p+16, t.queue_max_ns[i]);
+		p += 24;
+	}
+	pkt_put_u64(p, t.observer_dropped);
+	return net_write_control(sd, pkt, sizeof(pkt));
+}
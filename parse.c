@@ -8,6 +8,7 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "sd.h"
 
@@ -17,8 +18,9 @@ static int do_unknown_cmd(struct sd *server, int arg);
 
 static struct sd_syscmd __cmds[] = {
     {"rc", 0, "Reset card, counters, and buffers"},
-    {"bm", 0, "Switch to binary network mode"},
+    {"bm", CMD_FLAG_ARG, "Switch to binary network mode, in version arg frames if 3"},
     {"lm", 0, "Switch to line network mode"},
+    {"hi", CMD_FLAG_ARG, "Client hello, arg is the set of packet features it supports"},
     HELP_BLANK_LINE
 
     {"ci", 0, "Return card CID"},
@@ -43,6 +45,35 @@ static struct sd_syscmd __cmds[] = {
     {"cb", 0, "Copy read buffer contents to write buffer"},
     {"ps", CMD_FLAG_ARG, "Select the pattern set specified in arg"},
     {"ib", CMD_FLAG_ARG, "Ignore the first [arg] packets"},
+    {"fw", CMD_FLAG_ARG, "Drain the FPGA FIFO before it holds more than arg samples"},
+    {"fq", CMD_FLAG_ARG, "Set the FPGA clock frequency to arg Hz"},
+    {"st", 0, "Return capture pipeline statistics"},
+    {"si", CMD_FLAG_ARG, "Send capture pipeline statistics every arg ms, 0 to stop"},
+    HELP_BLANK_LINE
+
+    {"nd", CMD_FLAG_ARG, "NAND decoding: 0 raw cycles, 1 operations, 2 both"},
+    {"sn", CMD_FLAG_ARG, "SD sniff decoding: 0 raw bytes, 1 commands, 2 both"},
+    {"fi", CMD_FLAG_STRING, "Install the capture filter given as a string"},
+    {"fc", 0, "Clear the capture filter"},
+    {"fs", 0, "Return capture filter statistics"},
+    {"ta", CMD_FLAG_ARG, "Trigger: 0 off, 1 one-shot, 2 continuous re-arm"},
+    {"tb", CMD_FLAG_ARG, "Keep arg samples from before the trigger"},
+    {"tf", CMD_FLAG_ARG, "Send arg samples following the trigger"},
+    {"ts", CMD_FLAG_STRING, "Add a trigger stage, given as a filter string"},
+    {"tx", 0, "Clear all trigger stages"},
+    {"th", 0, "Return trigger state and hit count"},
+    HELP_BLANK_LINE
+
+    {"d+", 0, "Start recording the capture to disk"},
+    {"d-", 0, "Stop recording the capture to disk"},
+    {"dz", CMD_FLAG_ARG, "Set recording segment size to arg MiB"},
+    {"dl", CMD_FLAG_ARG, "Limit the recording to arg MiB on disk"},
+    {"dd", CMD_FLAG_STRING, "Set the recording directory"},
+    {"ds", 0, "Return recording status"},
+    {"pl", CMD_FLAG_ARG, "Replay the capture at arg times real time, 0 for flat out"},
+    {"ph", 0, "Halt the capture replay"},
+    {"pr", 0, "Return capture replay statistics"},
+    {"qr", CMD_FLAG_STRING, "Query the recording: \"<from> <to> [filter]\" in FPGA ticks"},
     HELP_BLANK_LINE
 
     {"c+", 0, "Enable clock auto-tick"},
@@ -63,8 +94,9 @@ static struct sd_syscmd __cmds[] = {
     {"p+", 0, "Turn card power on and reset card"},
     HELP_BLANK_LINE
 
-    {"ip", CMD_FLAG_ARG, "Set destination IPv4 address to arg"},
-    {"up", CMD_FLAG_ARG, "Set destination UDP port to arg"},
+    {"nl", CMD_FLAG_ARG, "Hold TCP output back at most arg us to send it together, 0 not at all"},
+    {"ip", CMD_FLAG_ARG, "Set data channel IPv4 address to arg, 0 for the client's own"},
+    {"up", CMD_FLAG_ARG, "Set data channel UDP port to arg, 0 to send data over TCP"},
     HELP_BLANK_LINE
     {"\0\0", 0, NULL},
 };
@@ -72,13 +104,13 @@ static struct sd_syscmd __cmds[] = {
 static int do_unknown_cmd(struct sd *server, int arg) {
     pkt_send_error(server, MAKE_ERROR(SUBSYS_PARSE, PARSE_ERR_UNKNOWN_CMD, 0),
 			"Unknown command");
-    return 0;
+    return -1;
 }
 
 static int do_error_cmd(struct sd *server, int arg) {
     pkt_send_error(server, MAKE_ERROR(SUBSYS_PARSE, PARSE_ERR_UNKNOWN, 0),
 			"An unknown error occurred");
-    return 0;
+    return -1;
 }
 
 static struct sd_syscmd unknown_cmd =
@@ -88,16 +120,33 @@ static struct sd_syscmd unknown_cmd =
 static struct sd_syscmd error_cmd =
     {"!!", 0, "An error occurred", do_error_cmd};
 
+static int do_too_long_cmd(struct sd *server, int arg) {
+    pkt_send_error(server, MAKE_ERROR(SUBSYS_PARSE, PARSE_ERR_TOO_LONG, 0),
+			"Command too long");
+    return -1;
+}
+
+static struct sd_syscmd too_long_cmd =
+    {"!!", 0, "Command too long", do_too_long_cmd};
+
+
+/*
+ * Commands are looked up in a table indexed by their two characters,
+ * built once at startup, rather than by searching __cmds every time.
+ */
+#define PARSE_INDEX_CHARS 128
+
 
 static struct sd_syscmd *get_syscmd(struct sd *server,
                                           const uint8_t txt[2]) {
-    struct sd_syscmd *c = server->cmds;
-    while(c && c->description) {
-        if (!memcmp(c->cmd, txt, sizeof(c->cmd)))
-            return c;
-        c++;
-    }
-    return NULL;
+    int slot;
+
+    if (txt[0] >= PARSE_INDEX_CHARS || txt[1] >= PARSE_INDEX_CHARS)
+        return NULL;
+    slot = server->cmd_index[txt[0] * PARSE_INDEX_CHARS + txt[1]];
+    if (!slot)
+        return NULL;
+    return &server->cmds[slot - 1];
 }
 
 static int is_valid_command(struct sd *server, struct sd_cmd *cmd) {
@@ -122,6 +171,27 @@ static int getnnline(uint8_t *output, int output_len,
 }
 
 
+/*
+ * Binary command frame, version 3.  Every field is in network byte order,
+ * with nothing in between:
+ *  Offset | Size | Description
+ * --------+------+-------------
+ *     0   |   2  | Two-character command code
+ *     2   |   2  | Payload length
+ *     4   |   4  | Request ID, handed back in the command's PACKET_COMMANDs
+ *     8   |   4  | 32-bit command argument
+ *    12   |   n  | Payload: the string, for commands that take one
+ */
+#define PARSE_FRAME_HEADER 12
+
+static uint32_t parse_get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t parse_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
 static int real_parse_cmd(struct sd *server, struct sd_cmd *cmd,
                           uint8_t *buf, int len) {
     int size_copied;
@@ -137,13 +207,47 @@ static int real_parse_cmd(struct sd *server, struct sd_cmd *cmd,
 
         bzero(cmd, sizeof(*cmd));
 
-        if (sizeof(*cmd) < len)
-            size_copied = sizeof(*cmd);
+        if (offsetof(struct sd_cmd, syscmd) < len)
+            size_copied = offsetof(struct sd_cmd, syscmd);
         else
             size_copied = len;
 
         memcpy(cmd, buf, size_copied);
         cmd->syscmd = get_syscmd(server, cmd->cmd);
+
+        /* String args follow the fixed part of the command */
+        server->cmd_str[0] = '\0';
+        if (cmd->syscmd && (cmd->syscmd->flags & CMD_FLAG_STRING)
+         && len > offsetof(struct sd_cmd, syscmd)) {
+            int str_len = len - offsetof(struct sd_cmd, syscmd);
+            if (str_len > sizeof(server->cmd_str) - 1)
+                str_len = sizeof(server->cmd_str) - 1;
+            memcpy(server->cmd_str, buf + offsetof(struct sd_cmd, syscmd),
+                   str_len);
+            server->cmd_str[str_len] = '\0';
+        }
+    }
+
+    else if (server->parse_mode == PARSE_MODE_FRAMED) {
+        int str_len = parse_get16(buf + 2);
+
+        bzero(cmd, sizeof(*cmd));
+        memcpy(cmd->cmd, buf, sizeof(cmd->cmd));
+        cmd->id = parse_get32(buf + 4);
+        cmd->arg = parse_get32(buf + 8);
+        cmd->syscmd = get_syscmd(server, cmd->cmd);
+
+        server->cmd_str[0] = '\0';
+        if (str_len > sizeof(server->cmd_str) - 1) {
+            errno = EMSGSIZE;
+            cmd->syscmd = &too_long_cmd;
+            return -1;
+        }
+        if (cmd->syscmd && (cmd->syscmd->flags & CMD_FLAG_STRING)) {
+            memcpy(server->cmd_str, buf + PARSE_FRAME_HEADER, str_len);
+            server->cmd_str[str_len] = '\0';
+        }
+        size_copied = len;
     }
 
     else if (server->parse_mode == PARSE_MODE_LINE) {
@@ -152,6 +256,7 @@ static int real_parse_cmd(struct sd *server, struct sd_cmd *cmd,
         struct sd_syscmd *syscmd;
 
         size_copied = getnnline(line, sizeof(line)-1, buf, len);
+        cmd->id = 0;
 
         offset = 0;
         while(isspace(line[offset]) && line[offset] != '\0')
@@ -182,6 +287,20 @@ static int real_parse_cmd(struct sd *server, struct sd_cmd *cmd,
             }
             else
                 cmd->arg = 0;
+
+            /* String args run to the end of the line */
+            server->cmd_str[0] = '\0';
+            if (syscmd->flags & CMD_FLAG_STRING) {
+                int end;
+                while(isspace(line[offset]) && line[offset] != '\0')
+                    offset++;
+                strncpy(server->cmd_str, (char *)&line[offset],
+                        sizeof(server->cmd_str) - 1);
+                server->cmd_str[sizeof(server->cmd_str) - 1] = '\0';
+                end = strlen(server->cmd_str);
+                while (end > 0 && isspace((unsigned char)server->cmd_str[end-1]))
+                    server->cmd_str[--end] = '\0';
+            }
             cmd->syscmd = syscmd;
         }
     }
@@ -203,25 +322,98 @@ int parse_write_prompt(struct sd *server) {
     return 0;
 }
 
+/*
+ * Input framing.
+ *
+ * Clients may send any number of commands at once, and TCP can split or
+ * merge them however it likes, so whatever arrives is kept in net_bfr
+ * until it makes up whole commands, which are then run one at a time in
+ * the order they came.  A command is only framed once the one before it
+ * has run, so a "bm" or "lm" changes how everything after it is read.
+ *
+ * In line mode, a command runs to the end of the line.  In binary mode,
+ * it's the cmd and arg of a struct sd_cmd, and for commands that take a
+ * string, the string follows, up to and including its NUL.  Version 3
+ * frames say how long they are.
+ *
+ * Anything too long to ever end inside the buffer is taken as it is,
+ * except for a frame, where the rest of it is thrown away as it comes.
+ */
+static int parse_frame_length(struct sd *server) {
+    uint8_t *buf = server->net_bfr;
+    int len = server->net_bfr_ptr;
+    uint8_t *end;
+
+    if (server->parse_mode == PARSE_MODE_FRAMED) {
+        int frame;
+
+        if (len < PARSE_FRAME_HEADER)
+            return 0;
+        frame = PARSE_FRAME_HEADER + parse_get16(buf + 2);
+        if (frame <= len || frame > sizeof(server->net_bfr))
+            return frame;
+        return 0;
+    }
+
+    if (server->parse_mode == PARSE_MODE_BINARY) {
+        int fixed = offsetof(struct sd_cmd, syscmd);
+        struct sd_syscmd *syscmd;
+
+        if (len < fixed)
+            end = NULL;
+        else {
+            syscmd = get_syscmd(server, buf);
+            if (!syscmd || !(syscmd->flags & CMD_FLAG_STRING))
+                return fixed;
+            end = memchr(buf + fixed, '\0', len - fixed);
+        }
+    }
+    else
+        end = memchr(buf, '\n', len);
+
+    if (end)
+        return end - buf + 1;
+    if (len == sizeof(server->net_bfr))
+        return len;
+    return 0;
+}
+
+/*
+ * Take the next whole command from what the client has sent.  Returns 1
+ * with it in cmd, or 0 if there isn't one yet.
+ */
 int parse_get_next_command(struct sd *server, struct sd_cmd *cmd) {
-    uint8_t *buf;
-    int ret;
+    int len, ret;
+
+    if (server->net_bfr_skip) {
+        len = server->net_bfr_skip;
+        if (len > server->net_bfr_ptr)
+            len = server->net_bfr_ptr;
+        server->net_bfr_skip -= len;
+        server->net_bfr_ptr -= len;
+        memmove(server->net_bfr, server->net_bfr + len, server->net_bfr_ptr);
+    }
 
-    ret = net_get_packet(server, &buf);
-    if (ret <= 0)
-        return -1;
+    len = parse_frame_length(server);
+    if (!len)
+        return 0;
+    if (len > server->net_bfr_ptr) {
+        server->net_bfr_skip = len - server->net_bfr_ptr;
+        len = server->net_bfr_ptr;
+    }
 
     /* Got a command.  Was it valid? */
-    ret = real_parse_cmd(server, cmd, buf, ret);
+    ret = real_parse_cmd(server, cmd, server->net_bfr, len);
 
     /* Invalid command */
-    if (ret < 0) {
+    if (ret < 0 && cmd->syscmd != &too_long_cmd) {
         memcpy(cmd->cmd, unknown_cmd.cmd, sizeof(unknown_cmd.cmd));
         cmd->syscmd = &unknown_cmd;
-        ret = 0;
     }
 
-    return ret;
+    server->net_bfr_ptr -= len;
+    memmove(server->net_bfr, server->net_bfr + len, server->net_bfr_ptr);
+    return 1;
 }
 
 int parse_set_hook(struct sd *server, char cmd[2], int
@@ -239,13 +431,30 @@ int parse_set_mode(struct sd *server, enum sd_parse_mode mode) {
 }
 
 int parse_init(struct sd *server) {
+    struct sd_syscmd *c;
+    uint8_t *slot;
+
     server->parse_mode = PARSE_MODE_LINE;
     server->cmds = malloc(sizeof(__cmds));
+    server->cmd_index = calloc(PARSE_INDEX_CHARS * PARSE_INDEX_CHARS, 1);
+    if (!server->cmds || !server->cmd_index)
+        return -1;
     memcpy(server->cmds, __cmds, sizeof(__cmds));
+
+    /* The first of any duplicates, like the help screen's blank lines */
+    for (c = server->cmds; c->description; c++) {
+        if (c->cmd[0] >= PARSE_INDEX_CHARS || c->cmd[1] >= PARSE_INDEX_CHARS
+         || c - server->cmds >= 255)
+            return -1;
+        slot = &server->cmd_index[c->cmd[0] * PARSE_INDEX_CHARS + c->cmd[1]];
+        if (!*slot)
+            *slot = c - server->cmds + 1;
+    }
     return 0;
 }
 
 int parse_deinit(struct sd *server) {
+    free(server->cmd_index);
     free(server->cmds);
     return 0;
 }
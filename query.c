@@ -0,0 +1,208 @@
+#define _POSIX_C_SOURCE 20121221L
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sd.h"
+
+/*
+ * Queries over the recorded capture.
+ *
+ * "qr" takes "<from> <to> [filter]", with times in extended FPGA ticks
+ * and the filter in the same language as "fi".  The index of each segment
+ * is binary searched for the first block that ends at or after <from>, and
+ * blocks are then walked until one starts after <to>.  Blocks whose
+ * summary rules out the filter are skipped without being read; the rest
+ * are scanned, and only the matching samples are sent back, followed by a
+ * PACKET_QUERY_DONE.  This relies on time only moving forwards within a
+ * recording.
+ */
+
+struct query {
+	struct filter		filter;
+	uint64_t		from, to;
+	struct pkt_batch	batch;
+	uint64_t		matched, scanned;
+	uint32_t		segments, blocks, skipped;
+};
+
+static void query_block(struct sd *sd, struct query *q, uint8_t *p,
+			struct record_block *blk) {
+	struct filter_state st = blk->start;
+	uint8_t *end = p + blk->len;
+
+	while (p + sizeof(struct record_entry) <= end) {
+		struct record_entry *entry = (struct record_entry *)p;
+		uint8_t *payload = (uint8_t *)(entry + 1);
+
+		p += RECORD_ALIGN(sizeof(*entry) + entry->len);
+		if (entry->kind == RECORD_SAMPLE && entry->len == 4 + 8
+		 && payload + entry->len <= end) {
+			struct fpga_sample sample;
+			uint32_t wraps;
+			uint64_t t;
+
+			memcpy(&wraps, payload, sizeof(wraps));
+			fpga_unpack_sample(payload + sizeof(wraps), wraps, &sample);
+			filter_track(&st, &sample);
+			q->scanned++;
+
+			t = ((uint64_t)sample.wraps << 32) | sample.counter;
+			if (t < q->from || t > q->to)
+				continue;
+			if (!filter_match(&q->filter, &st, &sample))
+				continue;
+			fpga_send_sample(sd, &q->batch, &sample);
+			q->matched++;
+		}
+	}
+}
+
+static struct record_block *query_load_index(struct sd *sd, uint32_t seq,
+					     int *count) {
+	char path[CMD_MAX_STRING + 32];
+	struct record_block *blks;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/capture-%08u.idx", sd->record_dir, seq);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(*blks)) {
+		close(fd);
+		return NULL;
+	}
+
+	*count = st.st_size / sizeof(*blks);
+	size = *count * sizeof(*blks);
+	blks = malloc(size);
+	if (blks && read(fd, blks, size) != size) {
+		free(blks);
+		blks = NULL;
+	}
+	close(fd);
+	return blks;
+}
+
+static void query_segment(struct sd *sd, struct query *q, uint32_t seq) {
+	char path[CMD_MAX_STRING + 32];
+	struct record_block *blks;
+	struct stat st;
+	uint8_t *map;
+	int count, lo, hi, i;
+	int fd;
+
+	blks = query_load_index(sd, seq, &count);
+	if (!blks)
+		return;
+
+	if (blks[0].min_time > q->to || blks[count-1].max_time < q->from) {
+		free(blks);
+		return;
+	}
+	q->segments++;
+
+	/* First block that ends at or after the start of the range */
+	lo = 0;
+	hi = count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (blks[mid].max_time < q->from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	snprintf(path, sizeof(path), "%s/capture-%08u.seg", sd->record_dir, seq);
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		free(blks);
+		return;
+	}
+	if (fstat(fd, &st) == -1
+	 || (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		free(blks);
+		return;
+	}
+
+	for (i=lo; i<count && blks[i].min_time <= q->to; i++) {
+		q->blocks++;
+		if (!filter_may_match(&q->filter, &blks[i])) {
+			q->skipped++;
+			continue;
+		}
+		if (blks[i].offset + (off_t)blks[i].len > st.st_size)
+			break;
+		query_block(sd, q, map + blks[i].offset, &blks[i]);
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+	free(blks);
+}
+
+static int query_bad_range(struct sd *sd, const char *p) {
+	int offset = p - sd->cmd_str;
+	pkt_send_error(sd,
+		MAKE_ERROR(SUBSYS_RECORD, RECORD_ERR_QUERY, offset),
+		"Query needs a time range: <from> <to> [filter]");
+	return -1;
+}
+
+static int query_run(struct sd *sd, int arg) {
+	struct query q;
+	const char *error;
+	char *p, *end;
+	uint32_t first, last, seq;
+	int ret;
+
+	memset(&q, 0, sizeof(q));
+
+	p = sd->cmd_str;
+	q.from = strtoull(p, &end, 0);
+	if (end == p)
+		return query_bad_range(sd, p);
+	p = end;
+	q.to = strtoull(p, &end, 0);
+	if (end == p || q.to < q.from)
+		return query_bad_range(sd, p);
+	p = end;
+
+	ret = filter_compile(&q.filter, p, &error);
+	if (ret) {
+		char errmsg[512];
+		int offset = (p - sd->cmd_str) + ret - 1;
+		snprintf(errmsg, sizeof(errmsg)-1,
+			 "Query error at offset %d: %s", offset, error);
+		pkt_send_error(sd,
+			MAKE_ERROR(SUBSYS_FILTER, FILTER_ERR_SYNTAX, offset),
+			errmsg);
+		return -1;
+	}
+
+	if (!recorder_segments(sd, &first, &last))
+		for (seq=first; seq<=last; seq++)
+			query_segment(sd, &q, seq);
+
+	pkt_batch_flush(sd, &q.batch);
+	net_flush(sd);
+	pkt_send_query_done(sd, q.matched, q.scanned,
+			    q.segments, q.blocks, q.skipped);
+	return 0;
+}
+
+int query_init(struct sd *sd) {
+	parse_set_hook(sd, "qr", query_run);
+	return 0;
+}
@@ -0,0 +1,391 @@
+#define _POSIX_C_SOURCE 20121221L
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sd.h"
+
+/*
+ * Capture-to-disk recorder.
+ *
+ * Raw FPGA samples and CPU-side packets are copied straight into a
+ * memory-mapped segment file.  When a segment fills up, the next one is
+ * created, and the oldest ones are deleted to keep the whole recording
+ * under record_max_size.  This runs whether or not a client is connected.
+ *
+ * Alongside each segment, a summary of every block of samples goes into a
+ * sparse index so queries can skip straight to the blocks they need.
+ */
+
+static void recorder_path(struct sd *sd, char *path, int len, uint32_t seq,
+			  const char *ext) {
+	snprintf(path, len, "%s/capture-%08u.%s", sd->record_dir, seq, ext);
+}
+
+static struct record_header *recorder_header(struct sd *sd) {
+	return (struct record_header *)sd->record_map;
+}
+
+static void recorder_block_open(struct sd *sd) {
+	struct record_block *blk = &sd->record_block;
+	memset(blk, 0, sizeof(*blk));
+	blk->offset = recorder_header(sd)->used;
+	blk->start = sd->record_track;
+}
+
+/* Append the summary of the block being filled to the index */
+static void recorder_block_close(struct sd *sd) {
+	struct record_block *blk = &sd->record_block;
+	if (blk->samples && sd->record_idx_fd != -1
+	 && write(sd->record_idx_fd, blk, sizeof(*blk)) != sizeof(*blk))
+		perror("Couldn't write capture index");
+	blk->samples = 0;
+}
+
+static void recorder_block_add(struct sd *sd, struct fpga_sample *sample) {
+	struct record_block *blk = &sd->record_block;
+	uint64_t t = ((uint64_t)sample->wraps << 32) | sample->counter;
+
+	filter_track(&sd->record_track, sample);
+	if (!blk->samples || t < blk->min_time)
+		blk->min_time = t;
+	if (!blk->samples || t > blk->max_time)
+		blk->max_time = t;
+	blk->samples++;
+	blk->types |= 1 << (sample->type & 0x0f);
+	if (sample->type != PKT_NAND) {
+		if (sd->record_track.sdcmd == FILTER_NONE)
+			blk->flags |= RECORD_BLOCK_SDCMD_NONE;
+		else
+			blk->sdcmds |= 1ULL << sd->record_track.sdcmd;
+	}
+}
+
+static void recorder_close_segment(struct sd *sd) {
+	uint32_t size;
+	if (!sd->record_map)
+		return;
+	recorder_block_close(sd);
+	close(sd->record_idx_fd);
+	sd->record_idx_fd = -1;
+	size = recorder_header(sd)->segment_size;
+	msync(sd->record_map, size, MS_ASYNC);
+	munmap(sd->record_map, size);
+	close(sd->record_fd);
+	sd->record_map = NULL;
+	sd->record_fd = -1;
+}
+
+static int recorder_open_segment(struct sd *sd, uint32_t seq) {
+	struct record_header *hdr;
+	char path[CMD_MAX_STRING + 32];
+	uint64_t max_segments;
+
+	recorder_path(sd, path, sizeof(path), seq, "idx");
+	sd->record_idx_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (sd->record_idx_fd == -1) {
+		perror("Couldn't create capture index");
+		return -1;
+	}
+
+	recorder_path(sd, path, sizeof(path), seq, "seg");
+	sd->record_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (sd->record_fd == -1) {
+		perror("Couldn't create capture segment");
+		close(sd->record_idx_fd);
+		sd->record_idx_fd = -1;
+		return -1;
+	}
+
+	if (ftruncate(sd->record_fd, sd->record_segment_size) == -1) {
+		perror("Couldn't size capture segment");
+		close(sd->record_fd);
+		close(sd->record_idx_fd);
+		sd->record_fd = -1;
+		sd->record_idx_fd = -1;
+		return -1;
+	}
+
+	sd->record_map = mmap(NULL, sd->record_segment_size,
+			      PROT_READ | PROT_WRITE, MAP_SHARED,
+			      sd->record_fd, 0);
+	if (sd->record_map == MAP_FAILED) {
+		perror("Couldn't map capture segment");
+		sd->record_map = NULL;
+		close(sd->record_fd);
+		close(sd->record_idx_fd);
+		sd->record_fd = -1;
+		sd->record_idx_fd = -1;
+		return -1;
+	}
+
+	hdr = recorder_header(sd);
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic));
+	hdr->version = RECORD_VERSION;
+	hdr->header_size = sizeof(*hdr);
+	hdr->fpga_frequency = sd->fpga_timebase.freq;
+	hdr->wraps_base = fpga_ticks(sd);
+	hdr->sequence = seq;
+	hdr->segment_size = sd->record_segment_size;
+	hdr->used = sizeof(*hdr);
+	sd->record_seq = seq;
+	recorder_block_open(sd);
+
+	/* Drop the oldest segments to stay under the size cap */
+	max_segments = sd->record_max_size / sd->record_segment_size;
+	if (max_segments < 1)
+		max_segments = 1;
+	while (sd->record_seq - sd->record_first + 1 > max_segments) {
+		recorder_path(sd, path, sizeof(path), sd->record_first, "seg");
+		unlink(path);
+		recorder_path(sd, path, sizeof(path), sd->record_first, "idx");
+		unlink(path);
+		sd->record_first++;
+	}
+
+	return 0;
+}
+
+/* Find room for a record of len bytes, moving to a new segment if needed */
+static struct record_entry *recorder_reserve(struct sd *sd, uint8_t kind,
+					     int len) {
+	struct record_header *hdr = recorder_header(sd);
+	struct record_entry *entry;
+	uint32_t size = RECORD_ALIGN(sizeof(*entry) + len);
+
+	if (hdr->used + size > hdr->segment_size) {
+		uint32_t next = sd->record_seq + 1;
+		recorder_close_segment(sd);
+		if (recorder_open_segment(sd, next)) {
+			sd->record_enabled = 0;
+			return NULL;
+		}
+		hdr = recorder_header(sd);
+	}
+	else if (hdr->used + size - sd->record_block.offset > RECORD_BLOCK_SIZE) {
+		recorder_block_close(sd);
+		recorder_block_open(sd);
+	}
+
+	entry = (struct record_entry *)(sd->record_map + hdr->used);
+	entry->kind = kind;
+	entry->reserved = 0;
+	entry->len = len;
+	hdr->used += size;
+	sd->record_block.len = hdr->used - sd->record_block.offset;
+	hdr->records++;
+	sd->record_bytes += size;
+	return entry;
+}
+
+int recorder_write_samples(struct sd *sd, struct fpga_raw *samples, int count) {
+	int i;
+
+	if (!sd->record_enabled)
+		return 0;
+
+	pthread_mutex_lock(&sd->record_lock);
+	for (i=0; i<count && sd->record_enabled; i++) {
+		struct record_entry *entry;
+		struct fpga_sample sample;
+
+		entry = recorder_reserve(sd, RECORD_SAMPLE, sizeof(samples[i]));
+		if (!entry)
+			break;
+		memcpy(entry + 1, &samples[i], sizeof(samples[i]));
+
+		fpga_unpack_sample(samples[i].bytes, samples[i].wraps, &sample);
+		recorder_block_add(sd, &sample);
+	}
+	pthread_mutex_unlock(&sd->record_lock);
+	return 0;
+}
+
+int recorder_write_packet(struct sd *sd, void *pkt, int len) {
+	struct iovec iov;
+
+	iov.iov_base = pkt;
+	iov.iov_len = len;
+	return recorder_writev_packet(sd, &iov, 1);
+}
+
+/* The same, for a packet in pieces */
+int recorder_writev_packet(struct sd *sd, const struct iovec *iov, int iovcnt) {
+	struct record_entry *entry;
+	uint8_t *p;
+	int i, len = 0;
+
+	if (!sd->record_enabled)
+		return 0;
+
+	for (i=0; i<iovcnt; i++)
+		len += iov[i].iov_len;
+
+	pthread_mutex_lock(&sd->record_lock);
+	if (sd->record_enabled) {
+		entry = recorder_reserve(sd, RECORD_PACKET, len);
+		if (entry) {
+			p = (uint8_t *)(entry + 1);
+			for (i=0; i<iovcnt; i++) {
+				memcpy(p, iov[i].iov_base, iov[i].iov_len);
+				p += iov[i].iov_len;
+			}
+		}
+	}
+	pthread_mutex_unlock(&sd->record_lock);
+	return 0;
+}
+
+/* Pick up numbering after any segments already in the directory */
+static void recorder_scan(struct sd *sd) {
+	DIR *dir;
+	struct dirent *de;
+	int found = 0;
+
+	sd->record_first = 0;
+	sd->record_seq = 0;
+
+	dir = opendir(sd->record_dir);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir))) {
+		unsigned int seq;
+		if (sscanf(de->d_name, "capture-%08u.seg", &seq) != 1)
+			continue;
+		if (!found || seq < sd->record_first)
+			sd->record_first = seq;
+		if (!found || seq > sd->record_seq)
+			sd->record_seq = seq;
+		found = 1;
+	}
+	closedir(dir);
+
+	if (found)
+		sd->record_seq++;
+	else
+		sd->record_first = sd->record_seq;
+}
+
+/*
+ * Find the segments on disk for a query, first making sure the index
+ * covers everything recorded so far.  Returns -1 if there are none.
+ */
+int recorder_segments(struct sd *sd, uint32_t *first, uint32_t *last) {
+	int ret = 0;
+
+	pthread_mutex_lock(&sd->record_lock);
+	if (sd->record_enabled) {
+		recorder_block_close(sd);
+		recorder_block_open(sd);
+		*first = sd->record_first;
+		*last = sd->record_seq;
+	}
+	else {
+		recorder_scan(sd);
+		if (sd->record_seq == sd->record_first)
+			ret = -1;
+		*first = sd->record_first;
+		*last = sd->record_seq - 1;
+	}
+	pthread_mutex_unlock(&sd->record_lock);
+	return ret;
+}
+
+int recorder_start(struct sd *sd) {
+	int ret = 0;
+
+	pthread_mutex_lock(&sd->record_lock);
+	if (!sd->record_enabled) {
+		mkdir(sd->record_dir, 0755);
+		recorder_scan(sd);
+		sd->record_track.sdcmd = FILTER_NONE;
+		sd->record_track.sdarg = FILTER_NONE;
+		ret = recorder_open_segment(sd, sd->record_seq);
+		if (!ret)
+			sd->record_enabled = 1;
+	}
+	pthread_mutex_unlock(&sd->record_lock);
+
+	if (ret)
+		pkt_send_error(sd, MAKE_ERROR(SUBSYS_RECORD, RECORD_ERR_OPEN, errno),
+			       "Couldn't start recording");
+	return ret;
+}
+
+int recorder_stop(struct sd *sd) {
+	pthread_mutex_lock(&sd->record_lock);
+	sd->record_enabled = 0;
+	recorder_close_segment(sd);
+	pthread_mutex_unlock(&sd->record_lock);
+	return 0;
+}
+
+static int recorder_net_start(struct sd *sd, int arg) {
+	return recorder_start(sd);
+}
+
+static int recorder_net_stop(struct sd *sd, int arg) {
+	return recorder_stop(sd);
+}
+
+static int recorder_set_segment_size(struct sd *sd, int arg) {
+	if (arg < 1)
+		arg = 1;
+	if (arg > 1024)
+		arg = 1024;
+	/* Takes effect with the next segment */
+	sd->record_segment_size = arg * 1024 * 1024;
+	return 0;
+}
+
+static int recorder_set_max_size(struct sd *sd, int arg) {
+	if (arg < 1)
+		arg = 1;
+	sd->record_max_size = arg * 1024LL * 1024;
+	return 0;
+}
+
+static int recorder_set_dir(struct sd *sd, int arg) {
+	if (!sd->cmd_str[0])
+		return 0;
+	/* Takes effect on the next start */
+	snprintf(sd->record_dir, sizeof(sd->record_dir), "%s", sd->cmd_str);
+	return 0;
+}
+
+static int recorder_status(struct sd *sd, int arg) {
+	pkt_send_record_status(sd);
+	return 0;
+}
+
+int recorder_init(struct sd *sd) {
+	pthread_mutex_init(&sd->record_lock, NULL);
+	sd->record_enabled = 0;
+	sd->record_fd = -1;
+	sd->record_idx_fd = -1;
+	sd->record_map = NULL;
+	sd->record_segment_size = RECORD_SEGMENT_SIZE;
+	sd->record_max_size = RECORD_MAX_SIZE;
+	if (!sd->record_dir[0])
+		strncpy(sd->record_dir, RECORD_DIR, sizeof(sd->record_dir) - 1);
+
+	parse_set_hook(sd, "d+", recorder_net_start);
+	parse_set_hook(sd, "d-", recorder_net_stop);
+	parse_set_hook(sd, "dz", recorder_set_segment_size);
+	parse_set_hook(sd, "dl", recorder_set_max_size);
+	parse_set_hook(sd, "dd", recorder_set_dir);
+	parse_set_hook(sd, "ds", recorder_status);
+	query_init(sd);
+	return 0;
+}
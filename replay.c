@@ -0,0 +1,259 @@
+#define _POSIX_C_SOURCE 20121221L
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sd.h"
+
+/*
+ * Capture replay.
+ *
+ * Started with "-r dir", the server skips the hardware and instead plays a
+ * recording back through fpga_send_packet(), so the decoders, filter,
+ * trigger and packet code all see exactly what they would on the board.
+ * "pl" starts a replay at arg times real time, or as fast as possible for
+ * 0.  When it ends, a PACKET_REPLAY_STATS reports the samples and bytes
+ * per second achieved, which makes it a repeatable benchmark of the send
+ * path.
+ */
+
+/* Samples pushed through per trip around the pipeline lock */
+#define REPLAY_CHUNK 1024
+
+/* Don't sleep for less than this, or more than this at once */
+#define REPLAY_MIN_SLEEP_NS 1000000
+#define REPLAY_MAX_SLEEP_NS 100000000
+
+static uint64_t replay_elapsed_ns(struct sd *sd) {
+	struct timespec now;
+
+	if (sd->replay_running)
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	else
+		now = sd->replay_end;
+	return (now.tv_sec - sd->replay_start.tv_sec) * 1000000000ULL
+	     + now.tv_nsec - sd->replay_start.tv_nsec;
+}
+
+/* Nanoseconds until a sample at extended time t is due at this speed */
+static uint64_t replay_due_ns(struct sd *sd, uint64_t t) {
+	uint64_t dt, ns, elapsed;
+
+	if (!sd->replay_speed)
+		return 0;
+
+	if (!sd->replay_samples)
+		sd->replay_t0 = t;
+	if (t < sd->replay_t0)
+		return 0;
+
+	dt = (t - sd->replay_t0) / sd->replay_speed;
+	ns = dt / sd->fpga_timebase.freq * 1000000000ULL
+	   + dt % sd->fpga_timebase.freq * 1000000000ULL / sd->fpga_timebase.freq;
+	elapsed = replay_elapsed_ns(sd);
+	return ns > elapsed ? ns - elapsed : 0;
+}
+
+static void replay_sleep(uint64_t ns) {
+	struct timespec ts;
+
+	if (ns > REPLAY_MAX_SLEEP_NS)
+		ns = REPLAY_MAX_SLEEP_NS;
+	ts.tv_sec = 0;
+	ts.tv_nsec = ns;
+	nanosleep(&ts, NULL);
+}
+
+static void replay_segment(struct sd *sd, uint32_t seq) {
+	char path[CMD_MAX_STRING + 32];
+	struct record_header *hdr;
+	struct stat st;
+	uint8_t *map, *p, *end;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/capture-%08u.seg", sd->replay_dir, seq);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(*hdr)
+	 || (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+
+	hdr = (struct record_header *)map;
+	if (memcmp(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic))
+	 || hdr->used > st.st_size) {
+		fprintf(stderr, "%s isn't a capture segment\n", path);
+		munmap(map, st.st_size);
+		close(fd);
+		return;
+	}
+
+	p = map + hdr->header_size;
+	end = map + hdr->used;
+	while (p + sizeof(struct record_entry) <= end && !sd->replay_stop) {
+		struct fpga_raw run[REPLAY_CHUNK];
+		uint64_t wait = 0;
+		int count = 0;
+
+		pthread_mutex_lock(&sd->fpga_pipeline_lock);
+		while (p + sizeof(struct record_entry) <= end && count < REPLAY_CHUNK) {
+			struct record_entry *entry = (struct record_entry *)p;
+			uint8_t *payload = (uint8_t *)(entry + 1);
+
+			if (payload + entry->len > end) {
+				p = end;
+				break;
+			}
+
+			if (entry->kind == RECORD_SAMPLE && entry->len == sizeof(*run)) {
+				uint32_t counter;
+
+				memcpy(&run[count], payload, sizeof(*run));
+				memcpy(&counter, run[count].bytes, sizeof(counter));
+				wait = replay_due_ns(sd, ((uint64_t)run[count].wraps << 32) | counter);
+				if (wait >= REPLAY_MIN_SLEEP_NS)
+					break;
+
+				sd->replay_samples++;
+				count++;
+			}
+			else if (entry->kind == RECORD_PACKET
+			      && pkt_replayable(payload, entry->len)) {
+				/* Keep it in order with the samples around it */
+				fpga_send_batch(sd, run, count);
+				count = 0;
+				pkt_batch_flush(sd, &sd->pkt_batch);
+				net_write_data(sd, payload, entry->len);
+			}
+
+			p += RECORD_ALIGN(sizeof(*entry) + entry->len);
+		}
+		fpga_send_batch(sd, run, count);
+		pthread_mutex_unlock(&sd->fpga_pipeline_lock);
+		pkt_batch_flush(sd, &sd->pkt_batch);
+		net_flush(sd);
+
+		if (wait >= REPLAY_MIN_SLEEP_NS)
+			replay_sleep(wait);
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+}
+
+/* Find the oldest and newest segments in the replay directory */
+static int replay_scan(struct sd *sd, uint32_t *first, uint32_t *last) {
+	DIR *dir;
+	struct dirent *de;
+	int found = 0;
+
+	dir = opendir(sd->replay_dir);
+	if (!dir)
+		return -1;
+
+	while ((de = readdir(dir))) {
+		unsigned int seq;
+		if (sscanf(de->d_name, "capture-%08u.seg", &seq) != 1)
+			continue;
+		if (!found || seq < *first)
+			*first = seq;
+		if (!found || seq > *last)
+			*last = seq;
+		found = 1;
+	}
+	closedir(dir);
+
+	return found ? 0 : -1;
+}
+
+static void *replay_thread(void *arg) {
+	struct sd *sd = arg;
+	uint32_t first, last, seq;
+	uint64_t elapsed;
+
+	telemetry_thread("replay");
+
+	if (!replay_scan(sd, &first, &last))
+		for (seq=first; seq<=last && !sd->replay_stop; seq++)
+			replay_segment(sd, seq);
+
+	/* The run isn't over until the client has it all */
+	net_sync(sd);
+	clock_gettime(CLOCK_MONOTONIC, &sd->replay_end);
+	sd->replay_tx_end = sd->net_tx_bytes;
+	sd->replay_running = 0;
+
+	elapsed = replay_elapsed_ns(sd);
+	fprintf(stderr, "Replayed %llu samples in %llu ms\n",
+		(unsigned long long)sd->replay_samples,
+		(unsigned long long)(elapsed / 1000000));
+	pkt_send_replay_stats(sd, 0, sd->replay_samples,
+			      sd->replay_tx_end - sd->replay_tx_base, elapsed);
+	return NULL;
+}
+
+static void replay_halt(struct sd *sd) {
+	if (!sd->replay_joinable)
+		return;
+	sd->replay_stop = 1;
+	pthread_join(sd->replay_thread, NULL);
+	sd->replay_joinable = 0;
+}
+
+static int replay_play(struct sd *sd, int arg) {
+	replay_halt(sd);
+
+	sd->replay_speed = arg < 0 ? 0 : arg;
+	sd->replay_stop = 0;
+	sd->replay_samples = 0;
+	sd->replay_tx_base = sd->net_tx_bytes;
+	sd->replay_running = 1;
+	clock_gettime(CLOCK_MONOTONIC, &sd->replay_start);
+
+	if (pthread_create(&sd->replay_thread, NULL, replay_thread, sd)) {
+		perror("Couldn't start replay");
+		sd->replay_running = 0;
+		return -1;
+	}
+	sd->replay_joinable = 1;
+	return 0;
+}
+
+static int replay_net_halt(struct sd *sd, int arg) {
+	replay_halt(sd);
+	return 0;
+}
+
+static int replay_status(struct sd *sd, int arg) {
+	uint64_t bytes;
+
+	if (sd->replay_running)
+		bytes = sd->net_tx_bytes - sd->replay_tx_base;
+	else
+		bytes = sd->replay_tx_end - sd->replay_tx_base;
+	pkt_send_replay_stats(sd, sd->replay_running, sd->replay_samples,
+			      bytes, replay_elapsed_ns(sd));
+	return 0;
+}
+
+int replay_init(struct sd *sd, const char *dir) {
+	snprintf(sd->replay_dir, sizeof(sd->replay_dir), "%s", dir);
+	sd->replay_joinable = 0;
+	sd->replay_running = 0;
+
+	parse_set_hook(sd, "pl", replay_play);
+	parse_set_hook(sd, "ph", replay_net_halt);
+	parse_set_hook(sd, "pr", replay_status);
+	return 0;
+}
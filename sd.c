@@ -431,13 +431,21 @@ static int sd_net_power_off(struct sd *state, int arg) {
 	return 0;
 }
 
+/*
+ * Commands that talk to the card wait for the capture of it to be sent
+ * before they're done, see fpga_drain_sync().
+ */
 static int sd_net_do_reset(struct sd *state, int arg) {
-	return sd_reset(state);
+	int ret;
+	ret = sd_reset(state);
+	fpga_drain_sync(state);
+	return ret;
 }
 
 static int sd_net_read_current_sector(struct sd *state, int arg) {
 	int ret;
 	ret = sd_read_block(state, state->sd_sector, state->sd_read_bfr, 1);
+	fpga_drain_sync(state);
 	if (ret) {
 		fprintf(stderr, "Couldn't read: %d\n", ret);
 		return ret;
@@ -449,6 +457,7 @@ static int sd_net_read_current_sector(struct sd *state, int arg) {
 static int sd_net_write_current_sector(struct sd *state, int arg) {
 	int ret;
 	ret = sd_write_block(state, state->sd_sector, state->sd_write_bfr, 1);
+	fpga_drain_sync(state);
 	return ret;
 }
 
@@ -466,6 +475,7 @@ static int sd_net_get_cid(struct sd *state, int arg) {
 	int ret;
 	uint8_t cid[16];
 	ret = sd_get_cid(state, cid);
+	fpga_drain_sync(state);
 	if (ret) {
 		pkt_send_error(state, MAKE_ERROR(SUBSYS_SD, SD_ERR_CID, ret),
 				"Unable to request card CID");
@@ -480,6 +490,7 @@ static int sd_net_get_csd(struct sd *state, int arg) {
 	int ret;
 	uint8_t csd[16];
 	ret = sd_get_csd(state, csd);
+	fpga_drain_sync(state);
 	if (ret) {
 		pkt_send_error(state, MAKE_ERROR(SUBSYS_SD, SD_ERR_CSD, ret),
 				"Unable to request card CSD");
@@ -3,14 +3,37 @@
 #include <stdint.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #define SD_DEFAULT_BLKLEN 512
 
 #define NET_PORT 7283
 #define NET_DATA_PORT 17283
-#define NET_MAX_CONNECTIONS 1
+#define NET_MAX_CONNECTIONS 4
 #define NET_PROMPT "cmd> "
 #define NET_MAX_TRIES 20
+#define NET_INPUT_SIZE 4096	/* Commands read but not yet run */
+
+/* A 1500-byte Ethernet frame, less the IP and UDP headers */
+#define NET_DATAGRAM_SIZE 1472
+#define NET_DATAGRAM_SEQ 4	/* Sequence number at the start of each */
+#define NET_DATAGRAM_BATCH 16	/* Datagrams per sendmmsg() */
+#define NET_DATAGRAM_FRAMES 4	/* Queued frames one datagram may gather */
+
+#define NET_OUTBUF_SIZE 16384
+#define NET_OUT_DIRECT 1024	/* Frames this big skip the buffer */
+#define NET_FLUSH_US 500	/* Longest output waits to be sent together */
+
+/* Frames queued for the writer thread */
+#define NET_FRAME_SIZE 8192
+#define NET_CONTROL_FRAMES 16	/* Powers of two */
+#define NET_DATA_FRAMES 128
+
+/* Read-only clients watching alongside the one in control */
+#define NET_MAX_OBSERVERS 4
+#define NET_OBSERVER_FRAMES 64	/* Queued for each, a power of two */
+#define NET_OBSERVE_ALL 0xffffffff
 
 #ifdef DEBUG
 #define DBG(fmt, ...) \
@@ -19,6 +42,10 @@
 #define DBG(...)
 #endif
 
+enum FPGAFrequency {
+	FPGA_FREQUENCY = 130000000,
+};
+
 #define MAKE_ERROR(x, y, z) (((x<<24)&0xff000000) | ((y<<16)&0x00ff0000) | ((z<<0)&0x0000ffff))
 
 /*
@@ -38,6 +65,8 @@ enum subsystem_ids {
 	SUBSYS_FPGA = 3,
 	SUBSYS_PARSE = 4,
 	SUBSYS_PKT = 5,
+	SUBSYS_FILTER = 6,
+	SUBSYS_RECORD = 7,
 };
 
 enum sd_cmds {
@@ -69,12 +98,19 @@ enum sd_cs {
 enum sd_parse_mode {
     PARSE_MODE_BINARY,
     PARSE_MODE_LINE,
+    PARSE_MODE_FRAMED,	/* Binary, in version 3 command frames */
 };
 
+/* "bm" with this or later for PARSE_MODE_FRAMED */
+#define PARSE_FRAME_VERSION 3
+
 enum cmd_flags {
 	CMD_FLAG_ARG = 1, /* True if the command has an arg */
+	CMD_FLAG_STRING = 2, /* True if the rest of the line is a string arg */
 };
 
+#define CMD_MAX_STRING 256
+
 enum buffer_drain_start_stop {
 	PKT_BUFFER_DRAIN_START = 1,
 	PKT_BUFFER_DRAIN_STOP = 2,
@@ -91,6 +127,123 @@ enum cmd_start_stop {
 	CMD_END = 2,
 };
 
+/* Optional packet features, announced by the client with the "hi" command */
+enum pkt_features {
+	PKT_FEATURE_BATCH = (1 << 0), /* PACKET_FPGA_BATCH instead of one packet per sample */
+	PKT_FEATURE_COMPRESS = (1 << 1), /* Batches may come as PACKET_COMPRESSED */
+};
+#define PKT_FEATURES_SUPPORTED (PKT_FEATURE_BATCH | PKT_FEATURE_COMPRESS)
+
+/* A PACKET_HELLO: header, version and features */
+#define PKT_HELLO_SIZE 16
+
+/* Room for a few hundred samples behind a single packet header */
+#define PKT_BATCH_MAX_SIZE 4096
+#define PKT_BATCH_MAX_SAMPLES 512
+
+/* A PACKET_FPGA_BATCH being built up */
+struct pkt_batch {
+	uint8_t		buf[PKT_BATCH_MAX_SIZE];
+	uint32_t	len;
+	uint32_t	count;
+	uint32_t	last;	/* FPGA counter of the previous sample */
+	uint32_t	wraps;	/* Clock wraps of the first sample */
+};
+
+/* What the on-board protocol decoders send for each bus */
+enum fpga_decode_mode {
+	DECODE_RAW = 0,		/* Raw samples only (default) */
+	DECODE_RECORDS = 1,	/* One decoded record per operation */
+	DECODE_BOTH = 2,	/* Decoded records, plus the raw samples */
+};
+
+enum fpga_pkt_type {
+	PKT_NAND = 0,
+	PKT_SD_CMD = 1,
+	PKT_SD_RESPONSE = 2,
+};
+
+/* Data channel datagrams waiting to go out, see net.c */
+struct net_datagrams {
+	uint32_t	seq[NET_DATAGRAM_BATCH];	/* Big-endian */
+	struct iovec	iov[NET_DATAGRAM_BATCH][1 + NET_DATAGRAM_FRAMES];
+	uint32_t	iovcnt[NET_DATAGRAM_BATCH];
+	uint32_t	len[NET_DATAGRAM_BATCH];
+	int		count;	/* Including the one being filled */
+	uint64_t	deadline;	/* When the first must go, in ns */
+
+	/* The queued frames they point into, held until they've gone */
+	struct net_frame	*frames[NET_DATAGRAM_BATCH * NET_DATAGRAM_FRAMES];
+	int		nframes;
+};
+
+enum net_class {
+	NET_CLASS_CONTROL = 0,	/* Replies, never dropped */
+	NET_CLASS_DATA = 1,	/* Capture and block data */
+	NET_CLASSES,
+};
+
+enum net_frame_flags {
+	NET_FRAME_FLUSH = (1 << 0),	/* Send everything once this is written */
+	NET_FRAME_AFTER = (1 << 1),	/* Not before data frame "after" */
+	NET_FRAME_CONTROLLER = (1 << 2),	/* Not for observers */
+	NET_FRAME_OBSERVERS = (1 << 3),	/* Only for observers */
+};
+
+/* Packets from one thread, on their way to the writer thread */
+struct net_frame {
+	volatile uint32_t	seq;	/* Queue slot state, see net.c */
+	uint32_t		after;	/* Where its thread's last data frame went */
+	uint32_t		session;	/* The controller it was meant for */
+	uint64_t		queued;	/* When, in ns */
+	uint16_t		len;
+	uint8_t			cls;
+	uint8_t			flags;
+	uint8_t			buf[NET_FRAME_SIZE];
+};
+
+struct net_queue {
+	volatile uint32_t	head, tail;
+	uint32_t		mask;
+	struct net_frame	*frames;
+};
+
+/* A frame on its way to observers, freed by the last one to send it */
+struct net_ref {
+	volatile int	refs;
+	uint32_t	len;
+	uint8_t		buf[];
+};
+
+/* A read-only client, see net.c */
+struct net_observer {
+	int			fd;	/* -1 if the slot is free */
+	struct sockaddr_in	addr;
+	uint32_t		mask;	/* Packet types wanted, bit n for type n */
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct net_ref		*queue[NET_OBSERVER_FRAMES];
+	uint32_t		head, tail;
+	int			closing;
+	uint64_t		dropped;
+	char			line[64];	/* Command being read */
+	uint32_t		line_len;
+};
+
+enum net_role {
+	NET_ROLE_NONE = 0,	/* Turned away */
+	NET_ROLE_CONTROL = 1,
+	NET_ROLE_OBSERVER = 2,
+};
+
+/* TCP output waiting to be written, see net.c */
+struct net_outbuf {
+	uint8_t		buf[NET_OUTBUF_SIZE];
+	uint32_t	len;
+	uint64_t	deadline;	/* When the oldest byte must go, in ns */
+};
+
 struct sd;
 
 struct sd_syscmd {
@@ -100,18 +253,263 @@ struct sd_syscmd {
     int(*handle_cmd)(struct sd *server, int arg);
 };
 
-/* Command as it travels over the wire in binary mode */
+/* Command as it travels over the wire in the original binary mode */
 struct sd_cmd {
     uint8_t cmd[2]; /* `\                   */
                     /*    > Network packet  */
     uint32_t arg;   /* ,/                   */
 
     struct sd_syscmd *syscmd;
+    uint32_t id;    /* Request ID, from a version 3 frame */
+};
+
+/*
+ * One FPGA sample, pulled apart from the 8 raw bytes.  The field meanings
+ * depend on the type:
+ *   PKT_NAND:        data = data pins, ctrl = ALE/CLE/WE/RE/CS, aux = unknown pins
+ *   PKT_SD_CMD:      data = register number, ctrl = register value
+ *   PKT_SD_RESPONSE: data = response byte
+ */
+struct fpga_sample {
+	uint32_t counter;
+	uint32_t wraps;
+	uint8_t  type;
+	uint8_t  data;
+	uint8_t  ctrl;
+	uint16_t aux;
+};
+
+/* A run of samples decoded field by field, see fpga_unpack_batch() */
+#define FPGA_BATCH_MAX 1024
+struct fpga_batch {
+	int		count;
+	uint32_t	counter[FPGA_BATCH_MAX];
+	uint32_t	wraps[FPGA_BATCH_MAX];
+	uint8_t		type[FPGA_BATCH_MAX];
+	uint8_t		data[FPGA_BATCH_MAX];
+	uint8_t		ctrl[FPGA_BATCH_MAX];
+	uint16_t	aux[FPGA_BATCH_MAX];
+};
+
+/* Tick to time conversion, see timebase.c */
+struct fpga_timebase {
+	uint32_t	freq;	/* FPGA clock rate, in Hz */
+	uint64_t	recip;	/* 2^64 / freq, rounded down */
+
+	/* Result of the previous conversion */
+	uint64_t	ticks;
+	uint64_t	sec;
+	uint32_t	rem;
+};
+
+/* Capture pipeline counters, one set per thread, see telemetry.c */
+#define TELEMETRY_DRAIN_BUCKETS 16
+struct telemetry {
+	const char	*name;
+	uint64_t	samples_read;	/* Pulled out of the FIFO */
+	uint64_t	samples_sent;	/* Handed to the client, batched or not */
+	uint64_t	duplicates;	/* Repeated samples thrown away */
+	uint64_t	overflows;	/* Samples read with the overflow pin up */
+	uint64_t	drains;
+	uint64_t	drain_ns;	/* Total time spent draining */
+	uint64_t	fifo_sum;	/* FIFO level at the start of each drain */
+	uint32_t	fifo_max;
+	uint32_t	drain_hist[TELEMETRY_DRAIN_BUCKETS]; /* < 2^n us per drain */
+	uint64_t	compress_in;	/* Packet bytes offered for compression */
+	uint64_t	compress_out;	/* ... and what they were sent as */
+	uint64_t	frames_dropped;	/* Data frames the writer couldn't keep up with */
+	uint64_t	queue_frames[NET_CLASSES]; /* Frames written, per class */
+	uint64_t	queue_ns[NET_CLASSES];	/* Time they spent queued */
+	uint64_t	queue_max_ns[NET_CLASSES];
+	uint64_t	observer_dropped; /* Frames an observer fell behind on */
+};
+extern __thread struct telemetry *telemetry_self;
+
+/* A sample as read out of the FIFO, with the clock wraps it happened at */
+struct fpga_raw {
+	uint32_t wraps;
+	uint8_t  bytes[8];
+};
+
+/* Full eight-bit register value of a PKT_SD_CMD sample */
+#define SD_SAMPLE_VALUE(s) ((s)->ctrl | (((s)->aux & 0x03) << 6))
+
+/* Fields a capture filter can look at */
+enum filter_field {
+	FILTER_FIELD_TYPE,
+	FILTER_FIELD_DATA,
+	FILTER_FIELD_CTRL,
+	FILTER_FIELD_AUX,
+	FILTER_FIELD_SDCMD,	/* Index of the SD command in progress */
+	FILTER_FIELD_SDARG,	/* Its argument, as far as it has been seen */
+	FILTER_FIELD_TIME,	/* Extended FPGA ticks */
+	FILTER_FIELD_COUNT,
+};
+
+enum filter_opcode {
+	FILTER_OP_TEST,		/* Push ((field & mask) in [lo, hi]) ^ negate */
+	FILTER_OP_AND,
+	FILTER_OP_OR,
+	FILTER_OP_NOT,
+};
+
+struct filter_insn {
+	uint8_t		op;
+	uint8_t		field;
+	uint8_t		negate;
+	uint64_t	mask, lo, hi;
+};
+
+/* A compiled filter: postfix bytecode over a one-bit-per-entry stack */
+#define FILTER_MAX_INSNS 64
+#define FILTER_MAX_DEPTH 32
+struct filter {
+	int			len;
+	struct filter_insn	insn[FILTER_MAX_INSNS];
+};
+
+/* Running SD command state, so every byte of a command can be matched */
+#define FILTER_NONE (~0ULL)
+struct filter_state {
+	uint64_t	sdcmd;
+	uint64_t	sdarg;
+};
+
+enum trigger_mode {
+	TRIGGER_OFF = 0,	/* Ship every sample */
+	TRIGGER_ONESHOT = 1,	/* Ship one window, then stop */
+	TRIGGER_CONTINUOUS = 2,	/* Re-arm after every window */
+};
+
+enum trigger_state {
+	TRIGGER_STATE_OFF,
+	TRIGGER_STATE_ARMED,
+	TRIGGER_STATE_POST,	/* Shipping the post-trigger window */
+	TRIGGER_STATE_DONE,	/* One-shot trigger has fired */
+};
+
+#define TRIGGER_MAX_STAGES 4
+#define TRIGGER_MAX_PRE (1024 * 1024)
+#define TRIGGER_DEFAULT_PRE 1024
+#define TRIGGER_DEFAULT_POST 1024
+
+/*
+ * Capture recordings are a series of fixed-size segment files, each a
+ * struct record_header followed by records.  Every record is a struct
+ * record_entry and its payload, padded to a multiple of four bytes.
+ * Everything is in host byte order.
+ */
+#define RECORD_DIR "/var/spicode"
+#define RECORD_MAGIC "SPCR"
+#define RECORD_VERSION 1
+#define RECORD_SEGMENT_SIZE (64 * 1024 * 1024)
+#define RECORD_MAX_SIZE (1024LL * 1024 * 1024)
+
+enum record_kind {
+	RECORD_SAMPLE = 1,	/* uint32_t clock wraps, then 8 raw FPGA bytes */
+	RECORD_PACKET = 2,	/* A CPU-side packet, as sent to the client */
+};
+
+struct record_header {
+	char		magic[4];
+	uint16_t	version;
+	uint16_t	header_size;
+	uint32_t	fpga_frequency;
+	uint32_t	wraps_base;	/* FPGA clock wraps when the segment opened */
+	uint32_t	sequence;
+	uint32_t	segment_size;
+	uint32_t	used;		/* Bytes in use, including this header */
+	uint32_t	records;
+	uint8_t		reserved[32];
+};
+
+struct record_entry {
+	uint8_t		kind;
+	uint8_t		reserved;
+	uint16_t	len;
+};
+#define RECORD_ALIGN(x) (((x) + 3) & ~3)
+
+/*
+ * Each segment has a sparse index next to it, capture-NNNNNNNN.idx, that
+ * is an array of struct record_block: one summary for every
+ * RECORD_BLOCK_SIZE bytes of records that held at least one sample.
+ */
+#define RECORD_BLOCK_SIZE (64 * 1024)
+
+enum record_block_flags {
+	RECORD_BLOCK_SDCMD_NONE = (1 << 0),	/* SD samples before any command byte */
+};
+
+struct record_block {
+	uint64_t		min_time, max_time;	/* Extended FPGA ticks */
+	uint32_t		offset;		/* First record, from the segment start */
+	uint32_t		len;		/* Bytes of records */
+	uint32_t		samples;
+	uint16_t		types;		/* Bitmap of sample types */
+	uint16_t		flags;
+	uint64_t		sdcmds;		/* Bitmap of SD command indexes */
+	struct filter_state	start;		/* SD command state before the block */
+};
+
+/* NAND control pins, as found in the ctrl field of a PKT_NAND sample */
+enum nand_ctrl {
+	NAND_ALE = (1 << 0),
+	NAND_CLE = (1 << 1),
+	NAND_WE  = (1 << 2),
+	NAND_RE  = (1 << 3),
+	NAND_CS  = (1 << 4), /* Active low */
+};
+
+enum nand_op_flags {
+	NAND_OP_DATA_OUT = (1 << 0),	/* Data was read from the chip */
+	NAND_OP_CONFIRM  = (1 << 1),	/* A second command was latched */
+	NAND_OP_DATA     = (1 << 2),	/* There was a data phase */
+};
+
+enum sd_record_flags {
+	SD_RECORD_ARG      = (1 << 0),	/* All four argument bytes were seen */
+	SD_RECORD_CRC      = (1 << 1),	/* A CRC byte was seen */
+	SD_RECORD_CRC_OK   = (1 << 2),	/* ...and it matched the command */
+	SD_RECORD_RESPONSE = (1 << 3),	/* The whole response was seen */
+	SD_RECORD_APP_CMD  = (1 << 4),	/* Command followed CMD55 */
+};
+
+/* One sniffed SD command and its response, rebuilt from FPGA bytes */
+struct sd_record {
+	int		state;
+	uint32_t	cmd_counter, cmd_wraps;
+	uint32_t	last_counter, last_wraps;
+	uint32_t	latency;
+	uint32_t	arg;
+	uint8_t		index;
+	uint8_t		flags;
+	uint8_t		crc;
+	uint8_t		crc_calc;
+	uint8_t		resp_len;
+	uint8_t		resp_expected;
+	uint8_t		resp[5];
+};
+
+/* One NAND operation, rebuilt from the raw bus cycles */
+struct nand_op {
+	int		state;
+	uint32_t	start_counter, start_wraps;
+	uint32_t	end_counter, end_wraps;
+	uint8_t		opcode;
+	uint8_t		confirm;
+	uint8_t		flags;
+	uint8_t		addr_count;
+	uint8_t		addr[5];
+	uint32_t	data_len;
+	uint32_t	data_hash;
+	uint8_t		data_head[4];
 };
 
 enum fpga_errs {
 	FPGA_ERR_UNKNOWN_PKT,
 	FPGA_ERR_OVERFLOW,
+	FPGA_ERR_FREQUENCY,
 };
 
 enum sd_errs {
@@ -122,6 +520,19 @@ enum sd_errs {
 enum parse_errs {
 	PARSE_ERR_UNKNOWN_CMD,
 	PARSE_ERR_UNKNOWN,
+	PARSE_ERR_TOO_LONG,
+};
+
+enum record_errs {
+	RECORD_ERR_OPEN,
+	RECORD_ERR_MAP,
+	RECORD_ERR_QUERY,
+};
+
+enum filter_errs {
+	FILTER_ERR_SYNTAX,
+	FILTER_ERR_DECODING,
+	FILTER_ERR_TOO_MANY,
 };
 
 struct sd {
@@ -133,12 +544,60 @@ struct sd {
 	int			net_fd;
 	struct sockaddr_in	net_sockaddr;
 	uint32_t		net_buf_len;
-	uint8_t			net_bfr[512];
-	uint32_t		net_bfr_ptr;
+	uint8_t			net_bfr[NET_INPUT_SIZE];
+	uint32_t		net_bfr_ptr;	/* Bytes of it held */
+	uint32_t		net_bfr_skip;	/* Of a frame too big to hold */
 	int			net_port;
 	pthread_mutex_t		net_lock;
+	uint64_t		net_tx_bytes;	/* Bytes written to clients */
+	struct net_outbuf	net_out;
+	uint32_t		net_flush_us;
+
+	/* Writer thread, and the frames waiting for it */
+	pthread_t		net_writer;
+	pthread_mutex_t		net_writer_lock;
+	pthread_cond_t		net_writer_cond;
+	volatile int		net_writer_idle;
+	struct net_queue	net_control, net_data;
+	volatile uint32_t	net_session;	/* Bumped as each controller leaves */
+
+	/* Threads waiting for the writer to free up frames */
+	pthread_mutex_t		net_space_lock;
+	pthread_cond_t		net_space_cond;
+	volatile int		net_space_waiters;
+
+	/* Read-only clients */
+	struct net_observer	net_observers[NET_MAX_OBSERVERS];
+	volatile int		net_observer_count;
+	pthread_mutex_t		net_observer_lock;
+
+	/* UDP data channel */
+	int			net_data_socket;
+	struct sockaddr_in	net_data_addr;	/* Port 0 sends data over TCP */
+	uint32_t		net_data_seq;
+	struct net_datagrams	net_datagrams;
+
+	/* Event loop, and the workers it hands blocking jobs to, see main.c */
+	int			loop_fd;
+	int			loop_drain_timer, loop_telemetry_timer;
+	int			loop_drain_go, loop_drain_done;
+	int			loop_command_go, loop_command_done;
+	int			loop_draining;
+	int			loop_command_busy;
+	struct sd_cmd		loop_command;
+	pthread_t		loop_command_thread;
+
+	/* Periodic PACKET_STATS, in ms */
+	uint32_t		telemetry_interval;
+	uint64_t		telemetry_next;
+
+	/* Packet features negotiated with the client */
+	uint32_t		pkt_features;
+	struct pkt_batch	pkt_batch;
 
 	struct sd_syscmd	*cmds;
+	uint8_t			*cmd_index;	/* cmds slot + 1, by command */
+	char			cmd_str[CMD_MAX_STRING]; /* String arg of the current command */
 
 	/* Raw SD commands */
 	uint8_t			sd_registers[4];
@@ -156,18 +615,93 @@ struct sd {
 	/* FPGA communications */
 	int			fpga_ready_fd, fpga_overflow_fd;
 	struct timespec		fpga_starttime;
-	/* Number of times FPGA clock has wrapped */
 	uint32_t		fpga_reset_clock;
-	int			fpga_wraps;
 	uint32_t		fpga_overflow_pin;
 	uint32_t		fpga_overflow_pin_value;
-	uint32_t		fpga_clock_ticks;
-	pthread_t		fpga_overflow_thread;
 	pthread_t		fpga_data_available_thread;
-	pthread_mutex_t		fpga_overflow_mutex;
+
+	struct fpga_timebase	fpga_timebase;
+
+	/* Extended FPGA clock, see fpga_clock_extend() */
+	volatile uint32_t	fpga_clock_seq;
+	volatile uint32_t	fpga_wraps;	/* Times the clock has wrapped */
+	volatile uint32_t	fpga_clock_last; /* Counter of the newest sample */
+	volatile uint32_t	fpga_clock_edges; /* Overflow pin edges seen */
+	int32_t			fpga_clock_skew;
+	volatile uint32_t	fpga_clock_reset; /* Resets asked for ... */
+	uint32_t		fpga_clock_reset_seen; /* ... and done */
 	int			fpga_read;
 	uint32_t		fpga_ignore_blocks;
 
+	/* Drain scheduling, see fpga_drain_check() */
+	uint32_t		fpga_drain_watermark;	/* Drain by this many samples */
+	uint32_t		fpga_drain_burst;	/* Samples to drain at now */
+	uint32_t		fpga_fill_rate;		/* Samples/s arriving */
+	uint32_t		fpga_fill_last;		/* FIFO level after a drain */
+	struct timespec		fpga_fill_time;		/* ... and when it was read */
+	uint32_t		fpga_headroom;		/* Least free FIFO space seen */
+	int			fpga_drain_waiting;	/* Samples are waiting ... */
+	struct timespec		fpga_drain_first;	/* ... since then */
+	struct timespec		fpga_drain_last;	/* When the last drain ended */
+	int			fpga_drain_quiet;	/* Drain to end what's decoding */
+	uint32_t		fpga_drains;		/* Drains finished */
+	pthread_mutex_t		fpga_drain_lock;
+	pthread_cond_t		fpga_drain_cond;
+
+
+	/* NAND bus decoder */
+	int			nand_mode;
+	uint8_t			nand_last_ctrl;
+	struct nand_op		nand_op;
+
+	/* SD command reassembly */
+	int			sdsniff_mode;
+	uint8_t			sdsniff_last_index;
+	struct sd_record	sdsniff_record;
+
+	/* Capture filter */
+	pthread_mutex_t		fpga_pipeline_lock;
+	struct filter		filter;
+	struct filter_state	filter_state;
+	uint64_t		filter_passed;
+	uint64_t		filter_dropped[PKT_SD_RESPONSE+1];
+
+	/* Trigger */
+	int			trigger_mode;
+	int			trigger_state;
+	int			trigger_nstages;
+	int			trigger_stage;
+	struct filter		trigger_stages[TRIGGER_MAX_STAGES];
+	uint32_t		trigger_pre, trigger_post;
+	uint32_t		trigger_post_left;
+	uint32_t		trigger_hits;
+	struct fpga_sample	*trigger_ring;
+	uint32_t		trigger_ring_head, trigger_ring_count;
+
+	/* Capture recorder */
+	pthread_mutex_t		record_lock;
+	int			record_enabled;
+	char			record_dir[CMD_MAX_STRING];
+	uint32_t		record_segment_size;
+	uint64_t		record_max_size;
+	uint32_t		record_first, record_seq; /* Oldest and current segment */
+	int			record_fd;
+	uint8_t			*record_map;
+	uint64_t		record_bytes;
+	int			record_idx_fd;
+	struct record_block	record_block;	/* Block being filled */
+	struct filter_state	record_track;	/* SD command state at the write point */
+
+	/* Capture replay */
+	char			replay_dir[CMD_MAX_STRING];
+	pthread_t		replay_thread;
+	int			replay_joinable;
+	int			replay_running, replay_stop;
+	uint32_t		replay_speed;	/* 0 for as fast as possible */
+	uint64_t		replay_t0;	/* Extended ticks of the first sample */
+	uint64_t		replay_samples;
+	uint64_t		replay_tx_base, replay_tx_end;
+	struct timespec		replay_start, replay_end;
 
 	/* I2C (for use with the FPGA) */
 	int			i2c_fpga_fd, i2c_fpga_device, i2c_fpga_bus;
@@ -183,10 +717,21 @@ int parse_write_prompt(struct sd *server);
 
 
 int net_init(struct sd *server);
-int net_accept(struct sd *server);
+int net_accept(struct sd *server, int *fd);
+int net_disconnect(struct sd *server);
 int net_write_data(struct sd *server, void *data, size_t count);
-int net_get_packet(struct sd *server, uint8_t **data);
+int net_write_control(struct sd *server, void *data, size_t count);
+int net_writev_data(struct sd *server, const struct iovec *iov, int iovcnt);
+int net_writev_control(struct sd *server, const struct iovec *iov, int iovcnt);
+int net_flush(struct sd *server);
+int net_sync(struct sd *server);
+void net_lossy(void);
+void net_audience(int only);
+int net_data_mtu(struct sd *server);
+int net_read_input(struct sd *server);
 int net_fd(struct sd *server);
+int net_listen_fd(struct sd *server);
+void net_observer_event(struct sd *server, int fd, int revents);
 int net_deinit(struct sd *server);
 
 
@@ -205,7 +750,10 @@ int sd_get_elapsed(struct sd *state, time_t *tv_sec, long *tv_nsec);
 
 int fpga_init(struct sd *st);
 int fpga_data_avail(struct sd *st);
+int fpga_drain_check(struct sd *st, int *timeout);
 int fpga_drain(struct sd *st);
+void fpga_drain_done(struct sd *st);
+int fpga_drain_sync(struct sd *st);
 int fpga_get_new_sample(struct sd *st, uint8_t data[8]);
 int fpga_read_data(struct sd *st);
 int fpga_ready_fd(struct sd *st);
@@ -213,16 +761,35 @@ int fpga_overflow_fd(struct sd *st);
 int fpga_tick_clock_maybe(struct sd *sd);
 int fpga_reset_ticks(struct sd *sd);
 int fpga_ignore_first_packets(struct sd *sd, int count);
+int fpga_pipeline_init(struct sd *sd);
+int fpga_send_packet(struct sd *sd, uint8_t *pkt, uint32_t wraps);
+int fpga_send_batch(struct sd *sd, struct fpga_raw *raw, int count);
+int fpga_unpack_batch(struct fpga_raw *raw, int count,
+		      struct fpga_batch *batch);
+int fpga_process_sample(struct sd *sd, struct fpga_sample *sample);
+int fpga_emit_sample(struct sd *sd, struct fpga_sample *sample);
+int fpga_send_sample(struct sd *sd, struct pkt_batch *batch,
+		     struct fpga_sample *sample);
+void fpga_unpack_sample(uint8_t *pkt, uint32_t wraps,
+			struct fpga_sample *sample);
 uint32_t fpga_ticks(struct sd *sd);
+void fpga_clock_extend(struct sd *sd, struct fpga_raw *raw, int count);
+void fpga_clock_check(struct sd *sd);
 
+int timebase_init(struct sd *sd);
+int timebase_set_frequency(struct sd *sd, uint32_t freq);
+void timebase_convert(struct sd *sd, uint64_t ticks,
+		      uint32_t *sec, uint32_t *nsec);
 
+
+int pkt_replayable(const uint8_t *pkt, int len);
 int pkt_send_error(struct sd *sd, uint32_t code, char *msg);
-int pkt_send_nand_cycle(struct sd *sd, uint32_t fpga_counter, uint8_t data, uint8_t ctrl, uint8_t unk[2]);
+int pkt_send_nand_cycle(struct sd *sd, uint32_t wraps, uint32_t fpga_counter, uint8_t data, uint8_t ctrl, uint8_t unk[2]);
 int pkt_send_sd_data(struct sd *sd, uint8_t *block);
 int pkt_send_sd_cmd_arg(struct sd *sd, uint8_t regnum, uint8_t val);
-int pkt_send_sd_cmd_arg_fpga(struct sd *sd, uint32_t fpga_counter, uint8_t regnum, uint8_t val);
+int pkt_send_sd_cmd_arg_fpga(struct sd *sd, uint32_t wraps, uint32_t fpga_counter, uint8_t regnum, uint8_t val);
 int pkt_send_sd_response(struct sd *sd, uint8_t byte);
-int pkt_send_sd_response_fpga(struct sd *sd, uint32_t fpga_counter, uint8_t byte);
+int pkt_send_sd_response_fpga(struct sd *sd, uint32_t wraps, uint32_t fpga_counter, uint8_t byte);
 int pkt_send_sd_cid(struct sd *sd, uint8_t cid[16]);
 int pkt_send_sd_csd(struct sd *sd, uint8_t csd[16]);
 int pkt_send_buffer_offset(struct sd *sd, uint8_t buffertype, uint32_t offset);
@@ -230,8 +797,70 @@ int pkt_send_buffer_contents(struct sd *sd, uint8_t buffertype, uint8_t *buffer)
 int pkt_send_command(struct sd *sd, struct sd_cmd *cmd, uint8_t start_stop);
 int pkt_send_reset(struct sd *sd);
 int pkt_send_buffer_drain(struct sd *sd, uint8_t start_stop);
-int pkt_send_hello(struct sd *sd);
-int pkt_send_cmd_done(struct sd *sd, uint8_t previous_command);
+int pkt_build_hello(struct sd *sd, char *pkt, uint32_t features);
+int pkt_send_hello(struct sd *sd, uint32_t features);
+int pkt_send_cmd_done(struct sd *sd, struct sd_cmd *cmd, int ret,
+		      uint32_t elapsed_us);
+int pkt_batch_add(struct sd *sd, struct pkt_batch *batch,
+		  struct fpga_sample *sample);
+int pkt_batch_flush(struct sd *sd, struct pkt_batch *batch);
+int pkt_batch_add_run(struct sd *sd, struct pkt_batch *batch,
+		      struct fpga_batch *run);
+int pkt_send_nand_op(struct sd *sd, struct nand_op *op);
+int pkt_send_sd_record(struct sd *sd, struct sd_record *rec);
+int pkt_send_filter_stats(struct sd *sd);
+int pkt_send_trigger(struct sd *sd, struct fpga_sample *sample);
+int pkt_send_record_status(struct sd *sd);
+int pkt_send_replay_stats(struct sd *sd, int running, uint64_t samples,
+			  uint64_t bytes, uint64_t elapsed_ns);
+int pkt_send_query_done(struct sd *sd, uint64_t matched, uint64_t scanned,
+			uint32_t segments, uint32_t blocks, uint32_t skipped);
+int pkt_send_stats(struct sd *sd);
+
+int nand_init(struct sd *sd);
+int nand_decode_sample(struct sd *sd, struct fpga_sample *sample);
+int nand_flush(struct sd *sd);
+int nand_pending(struct sd *sd);
+
+int sdsniff_init(struct sd *sd);
+int sdsniff_decode_sample(struct sd *sd, struct fpga_sample *sample);
+int sdsniff_flush(struct sd *sd);
+int sdsniff_pending(struct sd *sd);
+
+int filter_init(struct sd *sd);
+int filter_compile(struct filter *f, const char *text, const char **error);
+void filter_track(struct filter_state *st, struct fpga_sample *sample);
+int filter_match(struct filter *f, struct filter_state *st,
+		 struct fpga_sample *sample);
+int filter_sample(struct sd *sd, struct fpga_sample *sample);
+int filter_allowed(struct sd *sd);
+int filter_decode_allowed(struct sd *sd);
+int filter_may_match(struct filter *f, struct record_block *blk);
+
+int recorder_init(struct sd *sd);
+int recorder_start(struct sd *sd);
+int recorder_stop(struct sd *sd);
+int recorder_write_samples(struct sd *sd, struct fpga_raw *samples, int count);
+int recorder_write_packet(struct sd *sd, void *pkt, int len);
+int recorder_writev_packet(struct sd *sd, const struct iovec *iov, int iovcnt);
+int recorder_segments(struct sd *sd, uint32_t *first, uint32_t *last);
+
+int query_init(struct sd *sd);
+
+int replay_init(struct sd *sd, const char *dir);
+
+int compress_block(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+int telemetry_init(struct sd *sd);
+int telemetry_thread(const char *name);
+void telemetry_drain(uint64_t ns);
+void telemetry_sum(struct telemetry *total);
+int telemetry_timeout(struct sd *sd);
+int telemetry_tick(struct sd *sd);
+
+int trigger_init(struct sd *sd);
+int trigger_sample(struct sd *sd, struct fpga_sample *sample);
+
 
 int i2c_init(struct sd *sd);
 int i2c_set_byte(struct sd *sd, uint8_t addr, uint8_t value);
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sd.h"
+
+/*
+ * On-board SD command reassembly.
+ *
+ * The FPGA reports a sniffed command one register at a time as PKT_SD_CMD
+ * samples (register 0 is the command index, 1-4 are the argument from the
+ * most significant byte down, and 5 is the CRC byte if the FPGA captured
+ * it), followed by PKT_SD_RESPONSE samples for each response byte.  This
+ * stitches them back into a single PACKET_SD_CMD_RECORD with the CRC
+ * checked and the response latency measured in FPGA ticks.
+ */
+
+enum sdsniff_state {
+	SDSNIFF_IDLE,
+	SDSNIFF_COMMAND,
+	SDSNIFF_RESPONSE,
+};
+
+/* Response lengths in SPI mode: R1, R2, R3 and R7 */
+static int sdsniff_response_length(uint8_t index, int app_cmd) {
+	if (index == SD_CMD13)
+		return 2;
+	if (!app_cmd && (index == SD_CMD8 || index == SD_CMD58))
+		return 5;
+	return 1;
+}
+
+static uint8_t sdsniff_crc7(struct sd_record *rec) {
+	uint8_t bytes[5];
+	uint8_t crc = 0;
+	int i, bit;
+
+	bytes[0] = 0x40 | rec->index;
+	bytes[1] = rec->arg >> 24;
+	bytes[2] = rec->arg >> 16;
+	bytes[3] = rec->arg >> 8;
+	bytes[4] = rec->arg >> 0;
+
+	for (i=0; i<sizeof(bytes); i++) {
+		for (bit=7; bit>=0; bit--) {
+			crc <<= 1;
+			if (((bytes[i] >> bit) ^ (crc >> 7)) & 1)
+				crc ^= 0x09;
+		}
+	}
+	return crc & 0x7f;
+}
+
+/* Whether a command is partway through, waiting for more bytes */
+int sdsniff_pending(struct sd *sd) {
+	return sd->sdsniff_record.state != SDSNIFF_IDLE;
+}
+
+int sdsniff_flush(struct sd *sd) {
+	struct sd_record *rec = &sd->sdsniff_record;
+	int ret;
+
+	if (rec->state == SDSNIFF_IDLE)
+		return 0;
+
+	rec->crc_calc = sdsniff_crc7(rec);
+	if ((rec->flags & SD_RECORD_CRC) && rec->crc_calc == (rec->crc >> 1))
+		rec->flags |= SD_RECORD_CRC_OK;
+	if (rec->resp_len >= rec->resp_expected)
+		rec->flags |= SD_RECORD_RESPONSE;
+
+	ret = pkt_send_sd_record(sd, rec);
+	rec->state = SDSNIFF_IDLE;
+	return ret;
+}
+
+int sdsniff_decode_sample(struct sd *sd, struct fpga_sample *sample) {
+	struct sd_record *rec = &sd->sdsniff_record;
+
+	if (sample->type == PKT_SD_CMD) {
+		uint8_t val = SD_SAMPLE_VALUE(sample);
+
+		if (sample->data == 0) {
+			sdsniff_flush(sd);
+			memset(rec, 0, sizeof(*rec));
+			rec->state = SDSNIFF_COMMAND;
+			rec->cmd_counter = sample->counter;
+			rec->cmd_wraps = sample->wraps;
+			rec->index = val & 0x3f;
+			if (sd->sdsniff_last_index == SD_CMD55)
+				rec->flags |= SD_RECORD_APP_CMD;
+			rec->resp_expected = sdsniff_response_length(rec->index,
+					rec->flags & SD_RECORD_APP_CMD);
+			sd->sdsniff_last_index = rec->index;
+		}
+		else if (rec->state != SDSNIFF_COMMAND)
+			return 0;
+		else if (sample->data <= 4) {
+			int shift = (4 - sample->data) * 8;
+			rec->arg &= ~(0xffU << shift);
+			rec->arg |= (uint32_t)val << shift;
+			if (sample->data == 4)
+				rec->flags |= SD_RECORD_ARG;
+		}
+		else if (sample->data == 5) {
+			rec->crc = val;
+			rec->flags |= SD_RECORD_CRC;
+		}
+
+		rec->last_counter = sample->counter;
+		rec->last_wraps = sample->wraps;
+	}
+
+	else if (sample->type == PKT_SD_RESPONSE) {
+		if (rec->state == SDSNIFF_IDLE)
+			return 0;
+
+		if (rec->state == SDSNIFF_COMMAND) {
+			long long start, now;
+			start = rec->last_wraps*0x100000000LL + rec->last_counter;
+			now = sample->wraps*0x100000000LL + sample->counter;
+			rec->latency = now - start;
+			rec->state = SDSNIFF_RESPONSE;
+		}
+
+		if (rec->resp_len < sizeof(rec->resp))
+			rec->resp[rec->resp_len++] = sample->data;
+		if (rec->resp_len >= rec->resp_expected)
+			sdsniff_flush(sd);
+	}
+
+	return 0;
+}
+
+static int sdsniff_set_mode(struct sd *sd, int arg) {
+	if (arg < DECODE_RAW || arg > DECODE_BOTH)
+		arg = DECODE_RAW;
+	if (arg != DECODE_RAW && !filter_decode_allowed(sd))
+		return -1;
+	sd->sdsniff_mode = arg;
+	return 0;
+}
+
+int sdsniff_init(struct sd *sd) {
+	sd->sdsniff_mode = DECODE_RAW;
+	sd->sdsniff_record.state = SDSNIFF_IDLE;
+	parse_set_hook(sd, "sn", sdsniff_set_mode);
+	return 0;
+}
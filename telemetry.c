@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 20121221L
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sd.h"
+
+/*
+ * Capture pipeline telemetry.
+ *
+ * Each thread that touches samples claims a block of counters with
+ * telemetry_thread(), padded out to whole cache lines, and from then on
+ * bumps them through telemetry_self with plain increments: no locks, no
+ * atomics and no sharing.  A report sums every block.  On a 32-bit core a
+ * report can catch a 64-bit counter halfway through a carry, which the
+ * next report puts right.
+ *
+ * "st" sends a PACKET_STATS now, and "si" sends one every arg ms.
+ */
+
+#define TELEMETRY_LINE 64
+#define TELEMETRY_MAX_THREADS 8
+
+/* Where threads that never registered count, so the hot path needn't check */
+static struct telemetry telemetry_unregistered;
+__thread struct telemetry *telemetry_self = &telemetry_unregistered;
+
+static struct telemetry *telemetry_slots[TELEMETRY_MAX_THREADS];
+static int telemetry_count;
+
+/*
+ * Give the calling thread its counters.  A thread that's started again,
+ * like the replay, picks up where its last run left off.
+ */
+int telemetry_thread(const char *name) {
+	struct telemetry *t;
+	size_t size;
+	int slot;
+
+	for (slot=0; slot<telemetry_count && slot<TELEMETRY_MAX_THREADS; slot++) {
+		t = telemetry_slots[slot];
+		if (t && !strcmp(t->name, name)) {
+			telemetry_self = t;
+			return 0;
+		}
+	}
+
+	slot = __sync_fetch_and_add(&telemetry_count, 1);
+	if (slot >= TELEMETRY_MAX_THREADS)
+		return -1;
+
+	size = (sizeof(*t) + TELEMETRY_LINE - 1) / TELEMETRY_LINE * TELEMETRY_LINE;
+	if (posix_memalign((void **)&t, TELEMETRY_LINE, size))
+		return -1;
+	memset(t, 0, size);
+	t->name = name;
+
+	telemetry_slots[slot] = t;
+	telemetry_self = t;
+	return 0;
+}
+
+/* Count a drain that took ns */
+void telemetry_drain(uint64_t ns) {
+	struct telemetry *t = telemetry_self;
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+
+	while (us && bucket < TELEMETRY_DRAIN_BUCKETS-1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	t->drains++;
+	t->drain_ns += ns;
+	t->drain_hist[bucket]++;
+}
+
+void telemetry_sum(struct telemetry *total) {
+	int i, j, count;
+
+	memset(total, 0, sizeof(*total));
+	count = telemetry_count;
+	if (count > TELEMETRY_MAX_THREADS)
+		count = TELEMETRY_MAX_THREADS;
+
+	for (i=0; i<count; i++) {
+		struct telemetry *t = telemetry_slots[i];
+		if (!t)
+			continue;
+		total->samples_read += t->samples_read;
+		total->samples_sent += t->samples_sent;
+		total->duplicates += t->duplicates;
+		total->overflows += t->overflows;
+		total->drains += t->drains;
+		total->drain_ns += t->drain_ns;
+		total->fifo_sum += t->fifo_sum;
+		if (t->fifo_max > total->fifo_max)
+			total->fifo_max = t->fifo_max;
+		for (j=0; j<TELEMETRY_DRAIN_BUCKETS; j++)
+			total->drain_hist[j] += t->drain_hist[j];
+		total->compress_in += t->compress_in;
+		total->compress_out += t->compress_out;
+		total->frames_dropped += t->frames_dropped;
+		total->observer_dropped += t->observer_dropped;
+		for (j=0; j<NET_CLASSES; j++) {
+			total->queue_frames[j] += t->queue_frames[j];
+			total->queue_ns[j] += t->queue_ns[j];
+			if (t->queue_max_ns[j] > total->queue_max_ns[j])
+				total->queue_max_ns[j] = t->queue_max_ns[j];
+		}
+	}
+}
+
+static uint64_t telemetry_now_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/* Milliseconds until the next report is due, or -1 if none is */
+int telemetry_timeout(struct sd *sd) {
+	uint64_t now;
+
+	if (!sd->telemetry_interval)
+		return -1;
+
+	now = telemetry_now_ms();
+	if (now >= sd->telemetry_next)
+		return 0;
+	return sd->telemetry_next - now;
+}
+
+/* Send a report if one is due */
+int telemetry_tick(struct sd *sd) {
+	uint64_t now;
+
+	if (!sd->telemetry_interval)
+		return 0;
+
+	now = telemetry_now_ms();
+	if (now < sd->telemetry_next)
+		return 0;
+
+	sd->telemetry_next = now + sd->telemetry_interval;
+	return pkt_send_stats(sd);
+}
+
+static int telemetry_send(struct sd *sd, int arg) {
+	pkt_send_stats(sd);
+	return 0;
+}
+
+static int telemetry_set_interval(struct sd *sd, int arg) {
+	sd->telemetry_interval = arg < 0 ? 0 : arg;
+	sd->telemetry_next = telemetry_now_ms() + sd->telemetry_interval;
+	return 0;
+}
+
+int telemetry_init(struct sd *sd) {
+	sd->telemetry_interval = 0;
+	parse_set_hook(sd, "st", telemetry_send);
+	parse_set_hook(sd, "si", telemetry_set_interval);
+	return 0;
+}
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sd.h"
+
+/*
+ * Round-trip compress_block() through a reference LZ4 block decoder,
+ * written from the format description rather than from the encoder, at
+ * the sizes where the format changes: lengths either side of the 15 that
+ * spills into extra bytes, blocks too short for any match, data that
+ * doesn't compress, and whole batches as they go out.
+ */
+
+#define LZ4_MIN_MATCH		4
+#define LZ4_LAST_LITERALS	5
+#define LZ4_MF_LIMIT		12
+
+/* Room for anything the encoder may write, and a guard behind it */
+#define BLOCK_MAX	(PKT_BATCH_MAX_SIZE * 2)
+#define GUARD		64
+
+static int failures;
+
+/* What a block held, as the decoder saw it */
+struct lz4_seen {
+	int	literals[BLOCK_MAX];	/* Runs of each length */
+	int	matches[BLOCK_MAX];
+};
+
+static struct lz4_seen seen;
+
+static int lz4_get_length(const uint8_t **ip, const uint8_t *end, int len) {
+	uint8_t b;
+
+	if (len < 15)
+		return len;
+	do {
+		if (*ip >= end)
+			return -1;
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+/*
+ * Decode one block into the size bytes of dst it should fill, returning
+ * how much it did, or -1 with a reason if it breaks the format, including
+ * the rules about how close to the end a match may come.
+ */
+static int lz4_decode(const uint8_t *src, int len, uint8_t *dst, int size,
+		      const char **why) {
+	const uint8_t *ip = src, *end = src + len;
+	int op = 0;
+
+	memset(&seen, 0, sizeof(seen));
+	while (1) {
+		int token, lit, match, offset;
+
+		if (ip >= end) {
+			*why = "no final literals";
+			return -1;
+		}
+		token = *ip++;
+		lit = lz4_get_length(&ip, end, token >> 4);
+		if (lit < 0 || ip + lit > end || op + lit > size) {
+			*why = "literals overrun";
+			return -1;
+		}
+		memcpy(dst + op, ip, lit);
+		ip += lit;
+		op += lit;
+		seen.literals[lit]++;
+
+		if (ip == end) {
+			if (token & 0x0f) {
+				*why = "last sequence has a match";
+				return -1;
+			}
+			return op;
+		}
+
+		if (op > size - LZ4_MF_LIMIT) {
+			*why = "match starts too near the end";
+			return -1;
+		}
+		if (ip + 2 > end) {
+			*why = "offset cut short";
+			return -1;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || offset > op) {
+			*why = "offset out of range";
+			return -1;
+		}
+		match = lz4_get_length(&ip, end, token & 0x0f);
+		if (match < 0) {
+			*why = "match length cut short";
+			return -1;
+		}
+		match += LZ4_MIN_MATCH;
+		if (op + match > size - LZ4_LAST_LITERALS) {
+			*why = "match runs into the last literals";
+			return -1;
+		}
+		seen.matches[match]++;
+
+		/* Byte at a time: a match may overlap what it copies */
+		while (match--) {
+			dst[op] = dst[op - offset];
+			op++;
+		}
+	}
+}
+
+/*
+ * Compress src with cap bytes of room, and check the result decodes back
+ * to it.  Returns what compress_block() did.
+ */
+static int round_trip(const char *name, const uint8_t *src, int len, int cap) {
+	static uint8_t block[BLOCK_MAX + GUARD], out[BLOCK_MAX];
+	const char *why = NULL;
+	int ret, got, i;
+
+	memset(block, 0xa5, sizeof(block));
+	ret = compress_block(src, len, block, cap);
+	for (i=cap; i<cap+GUARD; i++) {
+		if (block[i] != 0xa5) {
+			why = "wrote past cap";
+			goto fail;
+		}
+	}
+	if (!ret)
+		return 0;
+	if (ret > cap) {
+		why = "longer than cap";
+		goto fail;
+	}
+
+	got = lz4_decode(block, ret, out, len, &why);
+	if (got < 0)
+		goto fail;
+	if (got != len || memcmp(out, src, len)) {
+		why = "decodes to something else";
+		goto fail;
+	}
+	return ret;
+
+fail:
+	if (failures++ < 10)
+		fprintf(stderr, "%s: %d bytes into %d: %s\n", name, len, cap, why);
+	return -1;
+}
+
+static uint32_t rand32(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void fill_random(uint8_t *buf, int len, uint32_t *state) {
+	int i;
+	for (i=0; i<len; i++)
+		buf[i] = rand32(state);
+}
+
+static void expect(const char *name, int ok) {
+	if (!ok && failures++ < 10)
+		fprintf(stderr, "%s\n", name);
+}
+
+/* Too short for a match to be allowed anywhere */
+static void check_short(void) {
+	uint8_t src[LZ4_MF_LIMIT];
+	int len;
+
+	memset(src, 0, sizeof(src));
+	for (len=0; len<LZ4_MF_LIMIT; len++) {
+		round_trip("short", src, len, BLOCK_MAX);
+		expect("short: not all literals", seen.literals[len] == 1);
+	}
+}
+
+/*
+ * A zero run is one literal, a match of the rest bar the last five, and
+ * five literals; random bytes after a run come out as a final literal run
+ * of exactly that length.
+ */
+static void check_lengths(void) {
+	static const int lengths[] = { 14, 15, 270 };
+	static uint8_t src[BLOCK_MAX];
+	uint32_t state = 1;
+	char name[32];
+	int i, n;
+
+	for (i=0; i<sizeof(lengths)/sizeof(*lengths); i++) {
+		n = lengths[i];
+
+		snprintf(name, sizeof(name), "match %d", n);
+		memset(src, 0, n + 6);
+		round_trip(name, src, n + 6, BLOCK_MAX);
+		expect(name, seen.matches[n] == 1);
+
+		snprintf(name, sizeof(name), "literals %d", n);
+		memset(src, 0, 20);
+		fill_random(src + 20, n, &state);
+		round_trip(name, src, 20 + n, BLOCK_MAX);
+		expect(name, seen.literals[n] == 1);
+	}
+}
+
+/* Nothing to find: it must say so rather than send it bigger */
+static void check_incompressible(void) {
+	static uint8_t src[PKT_BATCH_MAX_SIZE];
+	uint32_t state = 7;
+	int len;
+
+	for (len=LZ4_MF_LIMIT; len<=PKT_BATCH_MAX_SIZE; len+=len/4+1) {
+		fill_random(src, len, &state);
+		expect("incompressible: not refused",
+		       !round_trip("incompressible", src, len, len - 1));
+		/* ... but given room, it still has to be right */
+		round_trip("incompressible", src, len, len + len/255 + 16);
+	}
+}
+
+/*
+ * A batch as pkt_batch_add() fills one: a header, then samples with a
+ * small counter delta and fields that mostly repeat.
+ */
+static int fill_batch(uint8_t *buf, int size, uint32_t *state) {
+	int len = 11 + 4 + 2;	/* Packet header, wraps and count */
+	uint8_t data = 0;
+
+	memset(buf, 0, len);
+	while (len + 6 <= size) {
+		uint32_t r = rand32(state);
+
+		buf[len++] = 1 + (r & 3);
+		buf[len++] = PKT_NAND;
+		buf[len++] = (r & 0x30) ? data : data++;
+		buf[len++] = (r & 0x40) ? NAND_WE : NAND_WE | NAND_CLE;
+		buf[len++] = 0;
+		buf[len++] = 0;
+	}
+	return len;
+}
+
+static void check_batches(void) {
+	static uint8_t src[PKT_BATCH_MAX_SIZE];
+	static const int sizes[] = {
+		NET_DATAGRAM_SIZE - NET_DATAGRAM_SEQ, PKT_BATCH_MAX_SIZE,
+	};
+	uint32_t state = 3;
+	int i, len;
+
+	for (i=0; i<sizeof(sizes)/sizeof(*sizes); i++) {
+		len = fill_batch(src, sizes[i], &state);
+		expect("batch: didn't compress",
+		       round_trip("batch", src, len, len - 1) > 0);
+	}
+}
+
+/*
+ * Random runs, repeats and noise, with room to spare, and then with too
+ * little, where it may give up but mustn't write past the end.
+ */
+static void check_mixed(void) {
+	static uint8_t src[PKT_BATCH_MAX_SIZE];
+	uint32_t state = 5;
+	int i, len, at, ret;
+
+	for (i=0; i<20000; i++) {
+		len = rand32(&state) % PKT_BATCH_MAX_SIZE;
+		at = 0;
+		while (at < len) {
+			int run = 1 + rand32(&state) % 300;
+			if (run > len - at)
+				run = len - at;
+			switch (rand32(&state) % 3) {
+			case 0:
+				memset(src + at, rand32(&state), run);
+				break;
+			case 1:
+				fill_random(src + at, run, &state);
+				break;
+			default:
+				if (at) {
+					int from = rand32(&state) % at;
+					int j;
+					for (j=0; j<run; j++)
+						src[at + j] = src[from + j];
+				}
+				else
+					fill_random(src, run, &state);
+			}
+			at += run;
+		}
+		ret = round_trip("mixed", src, len, len + len/255 + 16);
+		expect("mixed: refused with room", ret > 0);
+		if (ret > 1) {
+			round_trip("mixed, tight", src, len, ret - 1);
+			round_trip("mixed, tight", src, len, ret / 2);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	check_short();
+	check_lengths();
+	check_incompressible();
+	check_batches();
+	check_mixed();
+
+	if (failures) {
+		printf("compress: %d failures\n", failures);
+		return 1;
+	}
+	printf("compress: OK\n");
+	return 0;
+}
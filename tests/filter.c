@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sd.h"
+
+/*
+ * Check what compiled filters match, particularly comparisons at the ends
+ * of the 64-bit range, where the bounds of the test can't be stored as
+ * they're written.
+ */
+
+#define MAX (~0ULL)
+
+static int failures;
+
+/* Ticks that go in the time field, the one that uses all 64 bits */
+static const uint64_t values[] = {
+	0, 1, 2, 0x100000000ULL, MAX / 2, MAX - 2, MAX - 1, MAX,
+};
+
+struct filter_check {
+	const char	*text;
+	int		(*want)(uint64_t v);
+};
+
+static int never(uint64_t v) { return 0; }
+static int always(uint64_t v) { return 1; }
+static int is_zero(uint64_t v) { return v == 0; }
+static int is_max(uint64_t v) { return v == MAX; }
+static int not_max(uint64_t v) { return v != MAX; }
+static int below_two(uint64_t v) { return v < 2; }
+static int above_one(uint64_t v) { return v > 1; }
+
+static const struct filter_check checks[] = {
+	{"time < 0", never},
+	{"time > 0xffffffffffffffff", never},
+	{"not time < 0", always},
+	{"not time > 0xffffffffffffffff", always},
+	{"time < 1", is_zero},
+	{"time > 0xfffffffffffffffe", is_max},
+	{"time <= 0xfffffffffffffffe", not_max},
+	{"time >= 0xffffffffffffffff", is_max},
+	{"time < 2", below_two},
+	{"time > 1", above_one},
+	{"time in 0..0xffffffffffffffff", always},
+	{"time < 0 or time > 0xffffffffffffffff", never},
+};
+
+int main(int argc, char **argv) {
+	struct filter_state st = { FILTER_NONE, FILTER_NONE };
+	struct fpga_sample sample = { 0 };
+	struct filter f;
+	const char *error;
+	int i, j;
+
+	for (i=0; i<sizeof(checks)/sizeof(*checks); i++) {
+		if (filter_compile(&f, checks[i].text, &error)) {
+			printf("\"%s\": %s\n", checks[i].text, error);
+			failures++;
+			continue;
+		}
+		for (j=0; j<sizeof(values)/sizeof(*values); j++) {
+			int got, want = checks[i].want(values[j]);
+			sample.wraps = values[j] >> 32;
+			sample.counter = values[j];
+			got = filter_match(&f, &st, &sample);
+			if (got != want) {
+				printf("\"%s\" at %#llx: got %d, want %d\n",
+				       checks[i].text,
+				       (unsigned long long)values[j], got, want);
+				failures++;
+			}
+		}
+	}
+
+	if (failures) {
+		printf("filter: %d failures\n", failures);
+		return 1;
+	}
+	printf("filter: OK\n");
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sd.h"
+
+/*
+ * Check timebase_convert() against the division it replaced, across the
+ * whole 64-bit range of ticks and at every rate worth trying.
+ */
+
+static struct sd sd;
+static int failures;
+
+static const uint32_t rates[] = {
+	2, 3, 1000, 32768, 1000000, 33333333, 100000000,
+	FPGA_FREQUENCY, 0x80000000, 0xffffffff,
+};
+
+static void check(uint32_t freq, uint64_t ticks) {
+	uint32_t sec, nsec, want_sec, want_nsec;
+
+	/* The old formula: two divisions and a multiply */
+	want_sec = ticks / freq;
+	want_nsec = (ticks % freq) * 1000000000ULL / freq;
+
+	timebase_convert(&sd, ticks, &sec, &nsec);
+	if (sec != want_sec || nsec != want_nsec) {
+		if (failures++ < 10)
+			fprintf(stderr, "%u Hz, %llu ticks: got %u.%09u, "
+				"want %u.%09u\n", freq,
+				(unsigned long long)ticks, sec, nsec,
+				want_sec, want_nsec);
+	}
+}
+
+static uint64_t rand64(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static void check_rate(uint32_t freq) {
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	uint64_t ticks, second;
+	int i, j;
+
+	timebase_set_frequency(&sd, freq);
+
+	check(freq, 0);
+	check(freq, 1);
+	check(freq, UINT64_MAX);
+	for (i=0; i<64; i++) {
+		check(freq, (1ULL << i) - 1);
+		check(freq, 1ULL << i);
+		check(freq, (1ULL << i) + 1);
+	}
+
+	/* Either side of second boundaries, all the way up */
+	for (i=0; i<=4096; i++) {
+		second = UINT64_MAX / freq / 4096 * i;
+		ticks = second * freq;
+		check(freq, ticks - 1);
+		check(freq, ticks);
+		check(freq, ticks + 1);
+		check(freq, ticks + freq - 1);
+	}
+
+	for (i=0; i<100000; i++)
+		check(freq, rand64(&state));
+
+	/* Runs in order, the way samples arrive, carried from one to the next */
+	for (i=0; i<100; i++) {
+		ticks = rand64(&state);
+		for (j=0; j<1000; j++) {
+			ticks += rand64(&state) % (freq / 4 + 2);
+			check(freq, ticks);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	int i;
+
+	for (i=0; i<sizeof(rates)/sizeof(*rates); i++)
+		check_rate(rates[i]);
+
+	if (failures) {
+		printf("timebase: %d mismatches\n", failures);
+		return 1;
+	}
+	printf("timebase: OK\n");
+	return 0;
+}
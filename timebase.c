@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sd.h"
+
+/*
+ * FPGA tick to time conversion.
+ *
+ * Every FPGA packet header carries seconds and nanoseconds since reset,
+ * which used to cost two 64-bit divisions per packet.  ARM has no 64-bit
+ * divide, so each was a library call.  Instead, a reciprocal of the clock
+ * rate is worked out once and division becomes a multiply-high plus at
+ * most one correction, which is exact over the full 64-bit range.
+ *
+ * Samples arrive in order and close together, so the seconds are usually
+ * carried forward from the previous conversion rather than recomputed.
+ * That cursor is shared between threads without a lock: it is only ever
+ * a hint, and it's checked by multiplying it back out before it's used.
+ * A torn read can't pass that check, because any seconds and remainder
+ * that multiply back to the ticks are the right ones.
+ */
+
+/* High 64 bits of a 64x64 multiply, from 32-bit pieces */
+static uint64_t mulhi64(uint64_t a, uint64_t b) {
+	uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+	uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+	uint64_t lo_lo = a_lo * b_lo;
+	uint64_t hi_lo = a_hi * b_lo;
+	uint64_t lo_hi = a_lo * b_hi;
+	uint64_t cross;
+
+	cross = (lo_lo >> 32) + (uint32_t)hi_lo + (uint32_t)lo_hi;
+	return a_hi * b_hi + (hi_lo >> 32) + (lo_hi >> 32) + (cross >> 32);
+}
+
+/*
+ * With recip = floor(2^64 / freq), the estimate below is never more than
+ * one under the real quotient, so one correction step makes it exact.
+ */
+static uint64_t timebase_divmod(struct fpga_timebase *tb, uint64_t n,
+				uint32_t *rem) {
+	uint64_t q = mulhi64(n, tb->recip);
+	uint64_t r = n - q * tb->freq;
+
+	if (r >= tb->freq) {
+		q++;
+		r -= tb->freq;
+	}
+	*rem = r;
+	return q;
+}
+
+int timebase_set_frequency(struct sd *sd, uint32_t freq) {
+	struct fpga_timebase *tb = &sd->fpga_timebase;
+
+	if (freq < 2)
+		return -1;
+
+	tb->freq = freq;
+	tb->recip = UINT64_MAX / freq;
+	/* UINT64_MAX is one short of 2^64, which matters for powers of two */
+	if (UINT64_MAX - tb->recip * freq == freq - 1)
+		tb->recip++;
+
+	/* Invalidate the cursor: no seconds and no remainder isn't one tick */
+	tb->ticks = 1;
+	tb->sec = 0;
+	tb->rem = 0;
+	return 0;
+}
+
+void timebase_convert(struct sd *sd, uint64_t ticks,
+		      uint32_t *sec, uint32_t *nsec) {
+	struct fpga_timebase *tb = &sd->fpga_timebase;
+	uint64_t last_ticks = tb->ticks;
+	uint64_t last_sec = tb->sec;
+	uint32_t last_rem = tb->rem;
+	uint64_t s, next;
+	uint32_t rem, ns_rem;
+
+	if (ticks >= last_ticks
+	 && last_rem < tb->freq
+	 && last_sec * tb->freq + last_rem == last_ticks
+	 && ticks - last_ticks < tb->freq) {
+		s = last_sec;
+		next = last_rem + (ticks - last_ticks);
+		if (next >= tb->freq) {
+			next -= tb->freq;
+			s++;
+		}
+		rem = next;
+	}
+	else
+		s = timebase_divmod(tb, ticks, &rem);
+
+	tb->ticks = ticks;
+	tb->sec = s;
+	tb->rem = rem;
+
+	*sec = s;
+	*nsec = timebase_divmod(tb, (uint64_t)rem * 1000000000, &ns_rem);
+}
+
+static int timebase_set(struct sd *sd, int arg) {
+	if (arg < 2 || timebase_set_frequency(sd, arg)) {
+		char errmsg[128];
+		snprintf(errmsg, sizeof(errmsg)-1,
+			 "Invalid FPGA clock frequency %d Hz", arg);
+		pkt_send_error(sd,
+			MAKE_ERROR(SUBSYS_FPGA, FPGA_ERR_FREQUENCY, 0),
+			errmsg);
+		return -1;
+	}
+	return 0;
+}
+
+int timebase_init(struct sd *sd) {
+	timebase_set_frequency(sd, FPGA_FREQUENCY);
+	parse_set_hook(sd, "fq", timebase_set);
+	return 0;
+}
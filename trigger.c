@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sd.h"
+
+/*
+ * Logic-analyzer style trigger.
+ *
+ * While armed, filtered samples are held in a rolling pre-trigger ring
+ * instead of being sent.  Each sample is checked against the current
+ * trigger stage (a compiled filter); when the last stage of the sequence
+ * matches, a PACKET_TRIGGER goes out, followed by the pre-trigger ring,
+ * the triggering sample and the next trigger_post samples.  A one-shot
+ * trigger then stops sending, and a continuous one re-arms.  Like a
+ * filter, it can't be armed while decoding; see filter.c.
+ */
+
+static void trigger_reset(struct sd *sd) {
+	sd->trigger_stage = 0;
+	sd->trigger_post_left = 0;
+	sd->trigger_ring_head = 0;
+	sd->trigger_ring_count = 0;
+	if (sd->trigger_mode == TRIGGER_OFF)
+		sd->trigger_state = TRIGGER_STATE_OFF;
+	else
+		sd->trigger_state = TRIGGER_STATE_ARMED;
+}
+
+static void trigger_ring_push(struct sd *sd, struct fpga_sample *sample) {
+	if (!sd->trigger_pre)
+		return;
+
+	sd->trigger_ring[sd->trigger_ring_head] = *sample;
+	sd->trigger_ring_head = (sd->trigger_ring_head + 1) % sd->trigger_pre;
+	if (sd->trigger_ring_count < sd->trigger_pre)
+		sd->trigger_ring_count++;
+}
+
+static void trigger_ring_flush(struct sd *sd) {
+	uint32_t i, idx;
+
+	idx = (sd->trigger_ring_head + sd->trigger_pre - sd->trigger_ring_count)
+		% (sd->trigger_pre ? sd->trigger_pre : 1);
+	for (i=0; i<sd->trigger_ring_count; i++) {
+		fpga_emit_sample(sd, &sd->trigger_ring[idx]);
+		idx = (idx + 1) % sd->trigger_pre;
+	}
+	sd->trigger_ring_count = 0;
+	sd->trigger_ring_head = 0;
+}
+
+/* Returns 1 if the sample should be sent now */
+int trigger_sample(struct sd *sd, struct fpga_sample *sample) {
+	if (sd->trigger_state == TRIGGER_STATE_POST) {
+		if (--sd->trigger_post_left == 0) {
+			if (sd->trigger_mode == TRIGGER_CONTINUOUS)
+				sd->trigger_state = TRIGGER_STATE_ARMED;
+			else
+				sd->trigger_state = TRIGGER_STATE_DONE;
+		}
+		return 1;
+	}
+
+	if (sd->trigger_state != TRIGGER_STATE_ARMED)
+		return 0;
+
+	if (sd->trigger_nstages
+	 && filter_match(&sd->trigger_stages[sd->trigger_stage],
+			 &sd->filter_state, sample)
+	 && ++sd->trigger_stage >= sd->trigger_nstages) {
+		sd->trigger_hits++;
+		sd->trigger_stage = 0;
+		pkt_send_trigger(sd, sample);
+		trigger_ring_flush(sd);
+
+		if (sd->trigger_post) {
+			sd->trigger_post_left = sd->trigger_post;
+			sd->trigger_state = TRIGGER_STATE_POST;
+		}
+		else if (sd->trigger_mode != TRIGGER_CONTINUOUS)
+			sd->trigger_state = TRIGGER_STATE_DONE;
+		return 1;
+	}
+
+	trigger_ring_push(sd, sample);
+	return 0;
+}
+
+static int trigger_arm(struct sd *sd, int arg) {
+	if (arg < TRIGGER_OFF || arg > TRIGGER_CONTINUOUS)
+		arg = TRIGGER_OFF;
+	if (arg != TRIGGER_OFF && !filter_allowed(sd))
+		return -1;
+	pthread_mutex_lock(&sd->fpga_pipeline_lock);
+	sd->trigger_mode = arg;
+	sd->trigger_hits = 0;
+	trigger_reset(sd);
+	pthread_mutex_unlock(&sd->fpga_pipeline_lock);
+	return 0;
+}
+
+static int trigger_set_pre(struct sd *sd, int arg) {
+	struct fpga_sample *ring = NULL;
+
+	if (arg < 0)
+		arg = 0;
+	if (arg > TRIGGER_MAX_PRE)
+		arg = TRIGGER_MAX_PRE;
+	if (arg) {
+		ring = malloc(arg * sizeof(*ring));
+		if (!ring) {
+			perror("Couldn't allocate trigger ring");
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&sd->fpga_pipeline_lock);
+	free(sd->trigger_ring);
+	sd->trigger_ring = ring;
+	sd->trigger_pre = arg;
+	trigger_reset(sd);
+	pthread_mutex_unlock(&sd->fpga_pipeline_lock);
+	return 0;
+}
+
+static int trigger_set_post(struct sd *sd, int arg) {
+	if (arg < 0)
+		arg = 0;
+	pthread_mutex_lock(&sd->fpga_pipeline_lock);
+	sd->trigger_post = arg;
+	trigger_reset(sd);
+	pthread_mutex_unlock(&sd->fpga_pipeline_lock);
+	return 0;
+}
+
+static int trigger_add_stage(struct sd *sd, int arg) {
+	struct filter f;
+	const char *error;
+	int ret;
+
+	if (sd->trigger_nstages >= TRIGGER_MAX_STAGES) {
+		pkt_send_error(sd,
+			MAKE_ERROR(SUBSYS_FILTER, FILTER_ERR_TOO_MANY, TRIGGER_MAX_STAGES),
+			"Too many trigger stages");
+		return -1;
+	}
+
+	ret = filter_compile(&f, sd->cmd_str, &error);
+	if (ret) {
+		char errmsg[512];
+		int offset = ret - 1;
+		snprintf(errmsg, sizeof(errmsg)-1,
+			 "Trigger error at offset %d: %s", offset, error);
+		pkt_send_error(sd,
+			MAKE_ERROR(SUBSYS_FILTER, FILTER_ERR_SYNTAX, offset),
+			errmsg);
+		return -1;
+	}
+
+	pthread_mutex_lock(&sd->fpga_pipeline_lock);
+	memcpy(&sd->trigger_stages[sd->trigger_nstages++], &f, sizeof(f));
+	trigger_reset(sd);
+	pthread_mutex_unlock(&sd->fpga_pipeline_lock);
+	return 0;
+}
+
+static int trigger_clear_stages(struct sd *sd, int arg) {
+	pthread_mutex_lock(&sd->fpga_pipeline_lock);
+	sd->trigger_nstages = 0;
+	trigger_reset(sd);
+	pthread_mutex_unlock(&sd->fpga_pipeline_lock);
+	return 0;
+}
+
+static int trigger_status(struct sd *sd, int arg) {
+	pkt_send_trigger(sd, NULL);
+	return 0;
+}
+
+int trigger_init(struct sd *sd) {
+	sd->trigger_mode = TRIGGER_OFF;
+	sd->trigger_nstages = 0;
+	sd->trigger_post = TRIGGER_DEFAULT_POST;
+	trigger_set_pre(sd, TRIGGER_DEFAULT_PRE);
+
+	parse_set_hook(sd, "ta", trigger_arm);
+	parse_set_hook(sd, "tb", trigger_set_pre);
+	parse_set_hook(sd, "tf", trigger_set_post);
+	parse_set_hook(sd, "ts", trigger_add_stage);
+	parse_set_hook(sd, "tx", trigger_clear_stages);
+	parse_set_hook(sd, "th", trigger_status);
+	return 0;
+}